@@ -0,0 +1,39 @@
+#include "accel.h"
+
+#include <cstdio>
+
+namespace accel {
+
+    std::shared_ptr<IAccel> create(AccelType type) {
+        if (type == ACCEL_TYPE_COMPRESSED_QBVH) {
+            return std::shared_ptr<IAccel>(new CompressedQBVHAccel());
+        }
+
+        if (type != ACCEL_TYPE_QBVH && OBVHAccel::isSupported()) {
+            return std::shared_ptr<IAccel>(new OBVHAccel());
+        }
+        return std::shared_ptr<IAccel>(new QBVHAccel());
+    }
+
+    std::string cacheFilename(const IAccel& accel, const std::vector<Triangle>& triangles, AccelBuildType buildType,
+                              const std::string& cacheDirectory) {
+        char name[64];
+        sprintf(name, "%s_%016llx.bvh", accel.name(), cacheKey(triangles, buildType, accel.name()));
+        return cacheDirectory + name;
+    }
+
+    bool constructCached(IAccel* accel, const std::vector<Triangle>& triangles, AccelBuildType buildType,
+                         const std::string& cacheDirectory) {
+        const std::string filename = cacheFilename(*accel, triangles, buildType, cacheDirectory);
+        if (accel->load(filename, triangles, buildType)) {
+            return true;
+        }
+
+        accel->construct(triangles, buildType);
+        if (!makeCacheDirectory(cacheDirectory) || !accel->save(filename)) {
+            std::cerr << "[WARNING] Failed to write BVH cache: " << filename << std::endl;
+        }
+        return false;
+    }
+
+}  // namespace accel
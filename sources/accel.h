@@ -0,0 +1,35 @@
+#ifndef _ACCEL_H_
+#define _ACCEL_H_
+
+#include <memory>
+#include <string>
+
+#include "accel_interface.h"
+#include "qbvh_accel.h"
+#include "obvh_accel.h"
+#include "compressed_qbvh_accel.h"
+
+namespace accel {
+
+    // Create an empty acceleration structure of the type
+    // ACCEL_TYPE_AUTO chooses OBVH when AVX is available, and QBVH otherwise.
+    // OBVH is also replaced with QBVH on CPUs without AVX.
+    // Compressed QBVH is used only when it is explicitly requested.
+    std::shared_ptr<IAccel> create(AccelType type = ACCEL_TYPE_AUTO);
+
+    // Construct a tree, or map it from a cache file in the directory
+    // Cache files are named after the hash of the triangles and the build settings,
+    // so a tree is constructed (and cached) only when no matching file is found.
+    // The directory is created when the first tree is cached.
+    // @param[in] cacheDirectory: directory of cache files (with a trailing separator)
+    // @return true if the tree was loaded from the cache
+    bool constructCached(IAccel* accel, const std::vector<Triangle>& triangles, AccelBuildType buildType,
+                         const std::string& cacheDirectory);
+
+    // Path to the cache file of a tree
+    std::string cacheFilename(const IAccel& accel, const std::vector<Triangle>& triangles, AccelBuildType buildType,
+                              const std::string& cacheDirectory);
+
+}  // namespace accel
+
+#endif  // _ACCEL_H_
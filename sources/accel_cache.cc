@@ -0,0 +1,190 @@
+#include "accel_cache.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(_WIN32) || defined(__WIN32__)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+    const unsigned long long fnvOffset = 14695981039346656037ULL;
+    const unsigned long long fnvPrime = 1099511628211ULL;
+
+    inline unsigned long long fnv1a(unsigned long long hash, const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * fnvPrime;
+        }
+        return hash;
+    }
+
+}
+
+MappedFile::MappedFile()
+    : _data(NULL)
+    , _size(0)
+#if defined(_WIN32) || defined(__WIN32__)
+    , _file(NULL)
+    , _mapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#if defined(_WIN32) || defined(__WIN32__)
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+
+    _data = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (_data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    _size = (size_t)size.QuadPart;
+    _file = file;
+    _mapping = mapping;
+    return true;
+}
+
+void MappedFile::close() {
+    if (_data != NULL) {
+        UnmapViewOfFile(_data);
+        CloseHandle((HANDLE)_mapping);
+        CloseHandle((HANDLE)_file);
+    }
+    _data = NULL;
+    _size = 0;
+    _file = NULL;
+    _mapping = NULL;
+}
+
+#else
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    _data = (char*)data;
+    _size = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (_data != NULL) {
+        munmap(_data, _size);
+    }
+    _data = NULL;
+    _size = 0;
+}
+
+#endif
+
+namespace accel {
+
+    unsigned long long cacheKey(const std::vector<Triangle>& triangles, AccelBuildType buildType, const char* format) {
+        static_assert(sizeof(AccelCacheHeader) == 64, "AccelCacheHeader must keep the arrays aligned");
+
+        unsigned long long hash = fnvOffset;
+        hash = fnv1a(hash, format, strlen(format));
+        hash = fnv1a(hash, &cacheVersion, sizeof(cacheVersion));
+
+        const int type = (int)buildType;
+        hash = fnv1a(hash, &type, sizeof(int));
+
+        double vertices[9];
+        for (size_t i = 0; i < triangles.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                const Vector3D p = triangles[i].p(k);
+                vertices[k * 3 + 0] = p.x();
+                vertices[k * 3 + 1] = p.y();
+                vertices[k * 3 + 2] = p.z();
+            }
+            hash = fnv1a(hash, vertices, sizeof(vertices));
+        }
+        return hash;
+    }
+
+    const AccelCacheHeader* checkCache(const MappedFile& file, const char* format, unsigned long long key,
+                                       size_t nodeSize, size_t packetSize) {
+        if (file.size() < sizeof(AccelCacheHeader)) {
+            return NULL;
+        }
+
+        const AccelCacheHeader* header = (const AccelCacheHeader*)file.data();
+        if (strncmp(header->magic, format, sizeof(header->magic)) != 0 ||
+            header->version != cacheVersion || header->key != key) {
+            return NULL;
+        }
+
+        const size_t expected = sizeof(AccelCacheHeader) + nodeSize * header->numNodes + packetSize * header->numPackets;
+        if (header->numNodes <= 0 || header->numPackets < 0 || file.size() != expected) {
+            return NULL;
+        }
+        return header;
+    }
+
+    bool makeCacheDirectory(const std::string& directory) {
+        std::string path = directory;
+        while (!path.empty() && (path[path.size() - 1] == '/' || path[path.size() - 1] == '\\')) {
+            path.erase(path.size() - 1);
+        }
+        if (path.empty()) {
+            return true;
+        }
+
+#if defined(_WIN32) || defined(__WIN32__)
+        return CreateDirectoryA(path.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+        return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+    }
+
+}  // namespace accel
@@ -0,0 +1,77 @@
+#ifndef _ACCEL_CACHE_H_
+#define _ACCEL_CACHE_H_
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "accel_interface.h"
+
+// --------------------------------------------------
+// File mapped into memory
+// --------------------------------------------------
+// Pages are mapped copy-on-write, so the mapped data can be modified
+// (e.g. by refitting) without changing the file.
+class MappedFile {
+private:
+    char* _data;
+    size_t _size;
+#if defined(_WIN32) || defined(__WIN32__)
+    void* _file;
+    void* _mapping;
+#endif
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Map the whole file
+    // @return false if the file cannot be opened or mapped
+    bool open(const std::string& filename);
+    void close();
+
+    inline char* data() const { return _data; }
+    inline size_t size() const { return _size; }
+
+private:
+    // Prohibit copying
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+// Header placed at the top of a cached tree
+// Node and packet arrays follow it, so it keeps them aligned to 64 bytes.
+struct AccelCacheHeader {
+    char magic[8];               // Name of the tree format
+    unsigned int version;
+    unsigned int buildType;
+    unsigned long long key;      // Hash of the triangles and the build settings
+    int numTriangles;
+    int numNodes;
+    int numPackets;
+    int stackSize;
+    double buildCost;
+    char padding[16];
+};
+
+namespace accel {
+
+    // Version of the cache file layout (bump it when node or packet formats change)
+    static const unsigned int cacheVersion = 2;    // 2: packets store vertices instead of edges
+
+    // Key of a cached tree (64-bit FNV-1a hash)
+    // @param[in] format: name of the tree format
+    unsigned long long cacheKey(const std::vector<Triangle>& triangles, AccelBuildType buildType, const char* format);
+
+    // Check that a mapped file holds a tree for the key and the array sizes
+    // @return the header of the file, or NULL if it does not match
+    const AccelCacheHeader* checkCache(const MappedFile& file, const char* format, unsigned long long key,
+                                       size_t nodeSize, size_t packetSize);
+
+    // Create the cache directory if it does not exist (its parent must exist)
+    // @return false if the directory cannot be created
+    bool makeCacheDirectory(const std::string& directory);
+
+}  // namespace accel
+
+#endif  // _ACCEL_CACHE_H_
@@ -0,0 +1,131 @@
+#ifndef _ACCEL_INTERFACE_H_
+#define _ACCEL_INTERFACE_H_
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "common.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "triangle.h"
+
+enum AccelBuildType {
+    ACCEL_BUILD_MEDIAN_SPLIT,
+    ACCEL_BUILD_SAH,
+    ACCEL_BUILD_LBVH,    // Linear BVH over Morton codes (fastest build, for previews)
+    ACCEL_BUILD_SBVH     // SAH with spatial splits (for large or skinny triangles)
+};
+
+enum AccelType {
+    ACCEL_TYPE_AUTO,    // OBVH if the CPU supports AVX, otherwise QBVH
+    ACCEL_TYPE_QBVH,
+    ACCEL_TYPE_OBVH,
+    ACCEL_TYPE_COMPRESSED_QBVH    // QBVH with 8-bit child boxes (for trees larger than the caches)
+};
+
+// Counters accumulated during traversal (for profiling only)
+struct AccelStats {
+    long long numRays;
+    long long numNodeVisits;
+    long long numTriangleTests;
+
+    AccelStats()
+        : numRays(0)
+        , numNodeVisits(0)
+        , numTriangleTests(0)
+    {
+    }
+};
+
+namespace accel {
+
+    // Spread the lower 21 bits so that two zero bits are put between each bit
+    inline unsigned long long expandBits(unsigned long long v) {
+        v &= 0x1fffffULL;
+        v = (v | (v << 32)) & 0x1f00000000ffffULL;
+        v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+        v = (v | (v << 8))  & 0x100f00f00f00f00fULL;
+        v = (v | (v << 4))  & 0x10c30c30c30c30c3ULL;
+        v = (v | (v << 2))  & 0x1249249249249249ULL;
+        return v;
+    }
+
+    // Bound of the distance between a hit position computed from the float
+    // ray-triangle tests and the triangle, where the magnitude is the largest
+    // coordinate of the triangle and the position. It covers the rounding of
+    // the vertices and the ray origin to floats with a margin.
+    inline double hitError(double magnitude) {
+        return magnitude * (1.0 / (1 << 20));
+    }
+
+    // Bound of the relative rounding error of n float operations (n * 2^-24 / (1 - n * 2^-24))
+    inline float errorGamma(int n) {
+        const float eps = 0.5f * std::numeric_limits<float>::epsilon();
+        return (n * eps) / (1.0f - n * eps);
+    }
+
+    // Far distances of the float slab tests are scaled by this so that boxes
+    // touched by the rays (e.g., at shared edges of triangles) are never culled
+    inline float boxErrorScale() {
+        return 1.0f + 2.0f * errorGamma(3);
+    }
+
+    // Axes and shear constants of the watertight ray-triangle test
+    // The axis along which the direction is the longest becomes z, and x and y
+    // are swapped for negative z to keep the winding of triangles. Vertices are
+    // mapped to the space where the ray goes along +z from the origin by
+    // x' = x - Sx * z, y' = y - Sy * z and z' = Sz * z.
+    // @param[out] axes: permuted axes (x-y-z)
+    // @param[out] shear: shear and scale (Sx, Sy, Sz)
+    inline void shearRay(const Vector3D& dir, int axes[3], float shear[3]) {
+        int kz = 0;
+        for (int d = 1; d < 3; d++) {
+            if (std::abs(dir[d]) > std::abs(dir[kz])) kz = d;
+        }
+        int kx = (kz + 1) % 3;
+        int ky = (kx + 1) % 3;
+        if (dir[kz] < 0.0) std::swap(kx, ky);
+
+        axes[0] = kx;
+        axes[1] = ky;
+        axes[2] = kz;
+        shear[0] = static_cast<float>(dir[kx] / dir[kz]);
+        shear[1] = static_cast<float>(dir[ky] / dir[kz]);
+        shear[2] = static_cast<float>(1.0 / dir[kz]);
+    }
+
+    // 2D edge function of the sheared vertices recomputed in double
+    // The float kernels use it only when the float result is exactly zero,
+    // which makes the signs consistent between the triangles sharing the edge.
+    inline float edgeFunction(float ax, float ay, float bx, float by) {
+        return static_cast<float>((double)ax * (double)by - (double)ay * (double)bx);
+    }
+
+}
+
+// --------------------------------------------------
+// Interface class for acceleration structures
+// --------------------------------------------------
+class IAccel {
+public:
+    IAccel() {}
+    virtual ~IAccel() {}
+    virtual void construct(const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) = 0;
+    virtual bool refit(const std::vector<Triangle>& triangles, double maxCostRatio = 1.5) = 0;
+    virtual int intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats = NULL) const = 0;
+    virtual int intersect(RayPacket& packet, AccelStats* stats = NULL) const = 0;
+    virtual bool occluded(const Ray& ray, double tMax = INFTY, AccelStats* stats = NULL) const = 0;
+    virtual double sahCost() const = 0;
+    virtual size_t memoryUsage() const = 0;
+    virtual int numNodes() const = 0;
+    virtual const char* name() const = 0;
+
+    // Cache the tree in a file which load() can map into memory
+    virtual bool save(const std::string& filename) const = 0;
+    virtual bool load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) = 0;
+};
+
+#endif  // _ACCEL_INTERFACE_H_
@@ -0,0 +1,1160 @@
+#include "../renderer.h"
+
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//! Hard-coded benchmark scene (bundled meshes and the floor of appmain)
+void setScene(std::vector<Triangle>* triangles, Camera* camera, int imageWidth, int imageHeight);
+
+//! Rays shot through every pixel of the camera
+void cameraRays(const Camera& camera, std::vector<Ray>* rays);
+
+//! Rays with random origins inside the scene and random directions
+void randomRays(const std::vector<Triangle>& triangles, int numRays, std::vector<Ray>* rays);
+
+//! Benchmarks
+void benchQBVHBuild(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary);
+void benchQBVHParallelBuild(const std::vector<Triangle>& triangles);
+void benchQBVHOcclusion(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary);
+void benchQBVHPacket(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, int imageWidth, int imageHeight);
+void benchOBVH(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary, int imageWidth, int imageHeight);
+void benchInstancing(int imageWidth, int imageHeight);
+void benchRefit(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary);
+void benchCache(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary);
+void benchSBVH(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary);
+void benchCompressed(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary);
+void benchWatertight(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary, int imageWidth, int imageHeight);
+void benchKdTree(const std::vector<Triangle>& triangles);
+void benchGather(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary);
+void benchHashGrid(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, int imageWidth, int imageHeight);
+
+//! Main
+int main(int argc, char** argv) {
+    const std::string target = argc >= 2 ? argv[1] : "all";
+    const int imageWidth  = argc >= 3 ? atoi(argv[2]) : 640;
+    const int imageHeight = argc >= 4 ? atoi(argv[3]) : 360;
+
+    std::vector<Triangle> triangles;
+    Camera camera;
+    setScene(&triangles, &camera, imageWidth, imageHeight);
+
+    std::vector<Ray> primary, secondary;
+    cameraRays(camera, &primary);
+    randomRays(triangles, imageWidth * imageHeight, &secondary);
+
+    printf("%d triangles, %d camera rays, %d random rays\n\n",
+           (int)triangles.size(), (int)primary.size(), (int)secondary.size());
+
+    if (target == "all" || target == "qbvh_build") {
+        benchQBVHBuild(triangles, primary, secondary);
+    }
+
+    if (target == "all" || target == "qbvh_parallel_build") {
+        benchQBVHParallelBuild(triangles);
+    }
+
+    if (target == "all" || target == "qbvh_occlusion") {
+        benchQBVHOcclusion(triangles, primary, secondary);
+    }
+
+    if (target == "all" || target == "qbvh_packet") {
+        benchQBVHPacket(triangles, primary, imageWidth, imageHeight);
+    }
+
+    if (target == "all" || target == "obvh") {
+        benchOBVH(triangles, primary, secondary, imageWidth, imageHeight);
+    }
+
+    if (target == "all" || target == "instancing") {
+        benchInstancing(imageWidth, imageHeight);
+    }
+
+    if (target == "all" || target == "refit") {
+        benchRefit(triangles, primary);
+    }
+
+    if (target == "all" || target == "cache") {
+        benchCache(triangles, primary);
+    }
+
+    if (target == "all" || target == "sbvh") {
+        benchSBVH(triangles, primary, secondary);
+    }
+
+    if (target == "all" || target == "compressed") {
+        benchCompressed(triangles, primary, secondary);
+    }
+
+    if (target == "all" || target == "watertight") {
+        benchWatertight(triangles, primary, secondary, imageWidth, imageHeight);
+    }
+
+    if (target == "all" || target == "kdtree") {
+        benchKdTree(triangles);
+    }
+
+    if (target == "all" || target == "gather") {
+        benchGather(triangles, primary);
+    }
+
+    if (target == "all" || target == "hashgrid") {
+        benchHashGrid(triangles, primary, imageWidth, imageHeight);
+    }
+}
+
+namespace {
+
+    // Numbers of threads from 1 to OMP_NUM_CORE (powers of two and OMP_NUM_CORE itself)
+    std::vector<int> threadCounts() {
+        std::vector<int> ret;
+        for (int t = 1; t < OMP_NUM_CORE; t *= 2) {
+            ret.push_back(t);
+        }
+        ret.push_back(OMP_NUM_CORE);
+        return ret;
+    }
+
+    void setNumThreads(int numThreads) {
+#ifdef _OPENMP
+        omp_set_num_threads(numThreads);
+#endif
+    }
+
+    // Trace all the rays and return the throughput in million rays per second
+    // (best of a few trials, statistics are taken from the first one)
+    // @param[in] anyHit: use occlusion queries instead of closest hit queries
+    double traceRays(const IAccel& accel, const std::vector<Ray>& rays, AccelStats* stats, bool anyHit = false) {
+        static const int numTrials = 3;
+        const int numRays = (int)rays.size();
+
+        double best = 0.0;
+        for (int k = 0; k < numTrials; k++) {
+            AccelStats* trialStats = k == 0 ? stats : NULL;
+            Timer timer;
+            timer.start();
+            for (int i = 0; i < numRays; i++) {
+                if (anyHit) {
+                    accel.occluded(rays[i], INFTY, trialStats);
+                } else {
+                    Hitpoint hitpoint;
+                    accel.intersect(rays[i], &hitpoint, trialStats);
+                }
+            }
+            const double elapsed = std::max(timer.stop(), 1.0e-3);
+            best = std::max(best, numRays / elapsed * 1.0e-6);
+        }
+        return best;
+    }
+
+    // Trace camera rays in packets of tileW x tileH pixels and return the throughput
+    double tracePackets(const IAccel& accel, const std::vector<Ray>& rays, int imageWidth, int imageHeight, int tileW, int tileH, AccelStats* stats) {
+        static const int numTrials = 3;
+        const int numRays = (int)rays.size();
+
+        double best = 0.0;
+        for (int k = 0; k < numTrials; k++) {
+            AccelStats* trialStats = k == 0 ? stats : NULL;
+            Timer timer;
+            timer.start();
+            RayPacket packet;
+            for (int y0 = 0; y0 < imageHeight; y0 += tileH) {
+                for (int x0 = 0; x0 < imageWidth; x0 += tileW) {
+                    packet.clear();
+                    for (int y = y0; y < std::min(y0 + tileH, imageHeight); y++) {
+                        for (int x = x0; x < std::min(x0 + tileW, imageWidth); x++) {
+                            packet.add(rays[y * imageWidth + x]);
+                        }
+                    }
+                    accel.intersect(packet, trialStats);
+                }
+            }
+            const double elapsed = std::max(timer.stop(), 1.0e-3);
+            best = std::max(best, numRays / elapsed * 1.0e-6);
+        }
+        return best;
+    }
+
+}
+
+void benchQBVHBuild(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary) {
+    printf("*** QBVH builder ***\n");
+    printf("%-8s %10s %10s %10s %12s %12s %12s %12s\n", "builder", "build[s]", "SAH cost", "mem[MB]", "nodes/ray", "tris/ray", "camera[Mr/s]", "random[Mr/s]");
+
+    const AccelBuildType types[4] = { ACCEL_BUILD_MEDIAN_SPLIT, ACCEL_BUILD_SAH, ACCEL_BUILD_LBVH, ACCEL_BUILD_SBVH };
+    const char* names[4] = { "median", "SAH", "LBVH", "SBVH" };
+    for (int t = 0; t < 4; t++) {
+        QBVHAccel accel;
+        Timer timer;
+        timer.start();
+        accel.construct(triangles, types[t]);
+        const double buildTime = timer.stop();
+
+        AccelStats stats;
+        const double mraysPrimary = traceRays(accel, primary, &stats);
+        const double mraysRandom  = traceRays(accel, secondary, &stats);
+
+        printf("%-8s %10.3f %10.2f %10.2f %12.2f %12.2f %12.3f %12.3f\n", names[t], buildTime, accel.sahCost(), accel.memoryUsage() / (1024.0 * 1024.0),
+               (double)stats.numNodeVisits / stats.numRays, (double)stats.numTriangleTests / stats.numRays,
+               mraysPrimary, mraysRandom);
+    }
+    printf("\n");
+}
+
+void benchQBVHParallelBuild(const std::vector<Triangle>& triangles) {
+    static const int numTrials = 3;
+
+    printf("*** QBVH parallel build (SAH, best of %d) ***\n", numTrials);
+    printf("%8s %10s %10s %10s %10s\n", "threads", "build[s]", "speedup", "nodes", "SAH cost");
+
+    const std::vector<int> threads = threadCounts();
+    double baseTime = 0.0;
+    for (int t = 0; t < (int)threads.size(); t++) {
+        setNumThreads(threads[t]);
+
+        QBVHAccel accel;
+        double buildTime = INFTY;
+        for (int k = 0; k < numTrials; k++) {
+            Timer timer;
+            timer.start();
+            accel.construct(triangles, ACCEL_BUILD_SAH);
+            buildTime = std::min(buildTime, timer.stop());
+        }
+
+        if (t == 0) baseTime = buildTime;
+        printf("%8d %10.3f %10.2f %10d %10.4f\n", threads[t], buildTime, baseTime / std::max(buildTime, 1.0e-3), accel.numNodes(), accel.sahCost());
+    }
+    setNumThreads(OMP_NUM_CORE);
+    printf("\n");
+}
+
+void benchOBVH(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary, int imageWidth, int imageHeight) {
+    printf("*** OBVH (8-wide, AVX) vs QBVH (4-wide, SSE) ***\n");
+    if (!OBVHAccel::isSupported()) {
+        printf("AVX is not supported on this CPU\n\n");
+        return;
+    }
+    printf("%-8s %-8s %12s %12s %10s %12s %12s\n", "mesh", "rays", "QBVH[Mr/s]", "OBVH[Mr/s]", "speedup", "QBVH nodes", "OBVH nodes");
+
+    // The whole scene and each bundled mesh alone
+    std::vector<std::string> names;
+    std::vector<std::vector<Triangle> > meshes;
+    names.push_back("scene");
+    meshes.push_back(triangles);
+    const char* files[2] = { "rt3.ply", "bunny.ply" };
+    for (int m = 0; m < 2; m++) {
+        Trimesh mesh(ASSET_DIRECTORY + files[m]);
+        mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+        names.push_back(std::string(files[m]).substr(0, std::string(files[m]).find('.')));
+        meshes.push_back(mesh.triangulate());
+    }
+
+    for (int m = 0; m < (int)meshes.size(); m++) {
+        QBVHAccel qbvh;
+        qbvh.construct(meshes[m], ACCEL_BUILD_SAH);
+        OBVHAccel obvh;
+        obvh.construct(meshes[m], ACCEL_BUILD_SAH);
+
+        std::vector<Ray> randoms;
+        const std::vector<Ray>* rays[3] = { &primary, m == 0 ? &secondary : &randoms, &primary };
+        const char* rayNames[3] = { "camera", "random", "4x2" };
+        if (m != 0) randomRays(meshes[m], imageWidth * imageHeight, &randoms);
+
+        for (int r = 0; r < 3; r++) {
+            if (m != 0 && r != 1) continue;    // Camera only looks at the scene
+
+            AccelStats qstats, ostats;
+            double mraysQBVH, mraysOBVH;
+            if (r == 2) {
+                mraysQBVH = tracePackets(qbvh, *rays[r], imageWidth, imageHeight, 4, 2, &qstats);
+                mraysOBVH = tracePackets(obvh, *rays[r], imageWidth, imageHeight, 4, 2, &ostats);
+            } else {
+                mraysQBVH = traceRays(qbvh, *rays[r], &qstats);
+                mraysOBVH = traceRays(obvh, *rays[r], &ostats);
+            }
+            printf("%-8s %-8s %12.3f %12.3f %10.2f %12.2f %12.2f\n", names[m].c_str(), rayNames[r], mraysQBVH, mraysOBVH, mraysOBVH / mraysQBVH,
+                   (double)qstats.numNodeVisits / qstats.numRays, (double)ostats.numNodeVisits / ostats.numRays);
+        }
+        printf("%-8s nodes: %d -> %d, memory: %.1f -> %.1f MB, SAH cost: %.3f -> %.3f\n", names[m].c_str(),
+               qbvh.numNodes(), obvh.numNodes(), qbvh.memoryUsage() / 1.0e6, obvh.memoryUsage() / 1.0e6, qbvh.sahCost(), obvh.sahCost());
+    }
+    printf("\n");
+}
+
+void benchInstancing(int imageWidth, int imageHeight) {
+    printf("*** Instancing (grid of bunnies, flattened vs two-level) ***\n");
+    printf("%-8s %-10s %10s %12s %10s %12s\n", "copies", "tree", "build[s]", "memory[MB]", "Mrays/s", "triangles");
+
+    Trimesh mesh(ASSET_DIRECTORY + "bunny.ply");
+    mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+    const std::vector<Triangle> triangles = mesh.triangulate();
+
+    BBox box;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        box.merge(triangles[i]);
+    }
+
+    const int grids[3] = { 2, 4, 8 };
+    for (int g = 0; g < 3; g++) {
+        const int n = grids[g];
+        std::vector<Transform> transforms;
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                const double angle = 0.3 * (i * n + j);
+                transforms.push_back(Transform::translate(Vector3D((i - 0.5 * (n - 1)) * 2.5, 0.0, (j - 0.5 * (n - 1)) * 2.5)) *
+                                     Transform::rotate(Vector3D(0.0, 1.0, 0.0), angle));
+            }
+        }
+
+        Vector3D eye(0.0, 1.5 * n, 2.0 * n);
+        Camera camera(eye, -eye.normalized(), Vector3D(0.0, 1.0, 0.0), 45.0, imageWidth, imageHeight, 1.0);
+        std::vector<Ray> rays;
+        cameraRays(camera, &rays);
+
+        // Flattened: every copy is transformed and put into one tree
+        Timer timer;
+        timer.start();
+        std::vector<Triangle> flattened;
+        for (int k = 0; k < (int)transforms.size(); k++) {
+            for (int i = 0; i < (int)triangles.size(); i++) {
+                flattened.push_back(transforms[k].applyToTriangle(triangles[i]));
+            }
+        }
+        std::shared_ptr<IAccel> flat = accel::create();
+        flat->construct(flattened, ACCEL_BUILD_SAH);
+        const double flatBuild = timer.stop();
+        const double mraysFlat = traceRays(*flat, rays, NULL);
+        printf("%-8d %-10s %10.3f %12.1f %10.3f %12d\n", n * n, "flattened", flatBuild, flat->memoryUsage() / 1.0e6, mraysFlat, (int)flattened.size());
+        std::vector<Triangle>().swap(flattened);
+        flat.reset();
+
+        // Two-level: one tree of the mesh shared by all the copies
+        timer.start();
+        Trimesh copy(mesh);
+        copy.buildAccel();
+        std::vector<Instance> instances(transforms.size());
+        for (int k = 0; k < (int)transforms.size(); k++) {
+            instances[k].accel = copy.accel();
+            instances[k].transform = transforms[k];
+            instances[k].objectBox = box;
+            instances[k].idOffset = k * (int)triangles.size();
+        }
+        InstanceAccel twoLevel;
+        twoLevel.construct(instances);
+        const double twoLevelBuild = timer.stop();
+
+        double mraysTwoLevel = 0.0;
+        for (int k = 0; k < 3; k++) {
+            timer.start();
+            for (int i = 0; i < (int)rays.size(); i++) {
+                Hitpoint hitpoint;
+                twoLevel.intersect(rays[i], &hitpoint);
+            }
+            mraysTwoLevel = std::max(mraysTwoLevel, rays.size() / std::max(timer.stop(), 1.0e-3) * 1.0e-6);
+        }
+        const size_t twoLevelMemory = copy.accel()->memoryUsage() + twoLevel.memoryUsage();
+        printf("%-8d %-10s %10.3f %12.1f %10.3f %12d\n", n * n, "two-level", twoLevelBuild, twoLevelMemory / 1.0e6, mraysTwoLevel, (int)triangles.size());
+    }
+    printf("\n");
+}
+
+void benchRefit(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary) {
+    printf("*** Refit (turntable, 3 degrees per frame, rebuild over 1.5x SAH cost) ***\n");
+    printf("%-6s %12s %10s %12s %12s %12s %12s\n", "frame", "rebuild[ms]", "refit[ms]", "rebuilt", "SAH ratio", "Mr/s(build)", "Mr/s(refit)");
+
+    BBox bbox;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bbox.merge(triangles[i]);
+    }
+    const Vector3D center = (bbox.posMin() + bbox.posMax()) * 0.5;
+
+    QBVHAccel refitted;
+    refitted.construct(triangles, ACCEL_BUILD_SAH);
+
+    static const int numFrames = 10;
+    std::vector<Triangle> moved(triangles.size());
+    for (int f = 1; f <= numFrames; f++) {
+        const Transform motion = Transform::translate(center) * Transform::rotate(Vector3D(0.0, 1.0, 0.0), f * PI / 60.0) * Transform::translate(-center);
+        for (int i = 0; i < (int)triangles.size(); i++) {
+            moved[i] = motion.applyToTriangle(triangles[i]);
+        }
+
+        Timer timer;
+        timer.start();
+        QBVHAccel rebuilt;
+        rebuilt.construct(moved, ACCEL_BUILD_SAH);
+        const double rebuildTime = timer.stop() * 1.0e3;
+
+        timer.start();
+        const bool isRebuilt = refitted.refit(moved, 1.5);
+        const double refitTime = timer.stop() * 1.0e3;
+
+        const double mraysRebuilt = traceRays(rebuilt, primary, NULL);
+        const double mraysRefitted = traceRays(refitted, primary, NULL);
+        printf("%-6d %12.1f %10.1f %12s %12.3f %12.3f %12.3f\n", f, rebuildTime, refitTime, isRebuilt ? "yes" : "no",
+               refitted.sahCost() / rebuilt.sahCost(), mraysRebuilt, mraysRefitted);
+    }
+    printf("\n");
+}
+
+void benchCache(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary) {
+    printf("*** BVH cache (cold: construct + save, warm: mmap) ***\n");
+    printf("%-6s %10s %10s %10s %14s %14s %10s\n", "accel", "cold[ms]", "warm[ms]", "file[MB]", "1st pass(cold)", "1st pass(warm)", "same hits");
+
+    const int numRays = (int)primary.size();
+    const AccelType types[] = { ACCEL_TYPE_QBVH, ACCEL_TYPE_OBVH };
+    for (int t = 0; t < 2; t++) {
+        if (types[t] == ACCEL_TYPE_OBVH && !OBVHAccel::isSupported()) {
+            continue;
+        }
+
+        std::shared_ptr<IAccel> cold = accel::create(types[t]);
+        const std::string filename = accel::cacheFilename(*cold, triangles, ACCEL_BUILD_SAH, CACHE_DIRECTORY);
+        std::remove(filename.c_str());
+
+        Timer timer;
+        timer.start();
+        accel::constructCached(cold.get(), triangles, ACCEL_BUILD_SAH, CACHE_DIRECTORY);
+        const double coldTime = timer.stop() * 1.0e3;
+
+        std::shared_ptr<IAccel> warm = accel::create(types[t]);
+        timer.start();
+        const bool loaded = accel::constructCached(warm.get(), triangles, ACCEL_BUILD_SAH, CACHE_DIRECTORY);
+        const double warmTime = timer.stop() * 1.0e3;
+
+        // The first pass over the mapped tree also pays for page faults
+        std::vector<int> coldHits(numRays), warmHits(numRays);
+        double passTimes[2];
+        for (int k = 0; k < 2; k++) {
+            const IAccel& accel = k == 0 ? *cold : *warm;
+            std::vector<int>& hits = k == 0 ? coldHits : warmHits;
+            timer.start();
+            for (int i = 0; i < numRays; i++) {
+                Hitpoint hitpoint;
+                hits[i] = accel.intersect(primary[i], &hitpoint);
+            }
+            passTimes[k] = timer.stop() * 1.0e3;
+        }
+
+        FILE* fp = fopen(filename.c_str(), "rb");
+        fseek(fp, 0, SEEK_END);
+        const double fileSize = ftell(fp) / (1024.0 * 1024.0);
+        fclose(fp);
+
+        printf("%-6s %10.1f %10.1f %10.1f %12.1fms %12.1fms %10s\n", cold->name(), coldTime, warmTime, fileSize, passTimes[0], passTimes[1],
+               loaded && coldHits == warmHits ? "yes" : "no");
+    }
+    printf("\n");
+}
+
+void benchSBVH(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary) {
+    // Long diagonal slivers (like scanned hair or grass) are added to the scene,
+    // whose boxes overlap with most of the other triangles.
+    BBox bbox;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bbox.merge(triangles[i]);
+    }
+    const Vector3D bsize = bbox.posMax() - bbox.posMin();
+
+    std::vector<Triangle> slivers(triangles);
+    Random rng(1);
+    for (int i = 0; i < 2000; i++) {
+        const Vector3D p0 = bbox.posMin() + Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * bsize;
+        const Vector3D p1 = bbox.posMin() + Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * bsize;
+        const Vector3D offset = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.01;
+        slivers.push_back(Triangle(p0, p1, p1 + offset));
+    }
+
+    const std::vector<Triangle>* scenes[2] = { &triangles, &slivers };
+    const char* sceneNames[2] = { "scene", "+slivers" };
+    for (int s = 0; s < 2; s++) {
+        printf("*** SBVH (%s, %d triangles) ***\n", sceneNames[s], (int)scenes[s]->size());
+        printf("%-8s %10s %10s %10s %12s %12s %12s %12s\n", "builder", "build[s]", "SAH cost", "mem[MB]", "nodes/ray", "tris/ray", "camera[Mr/s]", "random[Mr/s]");
+
+        const AccelBuildType types[2] = { ACCEL_BUILD_SAH, ACCEL_BUILD_SBVH };
+        const char* names[2] = { "SAH", "SBVH" };
+        for (int t = 0; t < 2; t++) {
+            QBVHAccel accel;
+            Timer timer;
+            timer.start();
+            accel.construct(*scenes[s], types[t]);
+            const double buildTime = timer.stop();
+
+            AccelStats stats;
+            const double mraysPrimary = traceRays(accel, primary, NULL);
+            const double mraysRandom  = traceRays(accel, secondary, &stats);
+
+            printf("%-8s %10.3f %10.2f %10.2f %12.2f %12.2f %12.3f %12.3f\n", names[t], buildTime, accel.sahCost(), accel.memoryUsage() / (1024.0 * 1024.0),
+                   (double)stats.numNodeVisits / stats.numRays, (double)stats.numTriangleTests / stats.numRays,
+                   mraysPrimary, mraysRandom);
+        }
+        printf("\n");
+    }
+}
+
+void benchCompressed(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary) {
+    // The large scene is a flattened grid of bunnies whose nodes do not fit in the caches
+    Trimesh mesh(ASSET_DIRECTORY + "bunny.ply");
+    mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+    const std::vector<Triangle> bunny = mesh.triangulate();
+
+    static const int gridSize = 5;
+    std::vector<Triangle> large;
+    for (int i = 0; i < gridSize; i++) {
+        for (int j = 0; j < gridSize; j++) {
+            const Transform transform = Transform::translate(Vector3D((i - 0.5 * (gridSize - 1)) * 2.5, 0.0, (j - 0.5 * (gridSize - 1)) * 2.5)) *
+                                        Transform::rotate(Vector3D(0.0, 1.0, 0.0), 0.3 * (i * gridSize + j));
+            for (int k = 0; k < (int)bunny.size(); k++) {
+                large.push_back(transform.applyToTriangle(bunny[k]));
+            }
+        }
+    }
+    std::vector<Ray> largeRays;
+    randomRays(large, (int)secondary.size(), &largeRays);
+
+    const std::vector<Triangle>* scenes[2] = { &triangles, &large };
+    const char* sceneNames[2] = { "scene", "bunny grid" };
+    for (int s = 0; s < 2; s++) {
+        printf("*** Compressed QBVH (%s, %d triangles) ***\n", sceneNames[s], (int)scenes[s]->size());
+        printf("%-8s %10s %10s %10s %10s %12s %12s %12s\n", "tree", "nodes[MB]", "total[MB]", "SAH cost", "nodes/ray", "tris/ray", "camera[Mr/s]", "random[Mr/s]");
+
+        const std::vector<Ray>& randoms = s == 0 ? secondary : largeRays;
+        for (int t = 0; t < 2; t++) {
+            std::shared_ptr<IAccel> accel;
+            size_t nodeMemory = 0;
+            if (t == 0) {
+                QBVHAccel* qbvh = new QBVHAccel();
+                qbvh->construct(*scenes[s], ACCEL_BUILD_SAH);
+                nodeMemory = qbvh->nodeMemoryUsage();
+                accel = std::shared_ptr<IAccel>(qbvh);
+            } else {
+                CompressedQBVHAccel* cqbvh = new CompressedQBVHAccel();
+                cqbvh->construct(*scenes[s], ACCEL_BUILD_SAH);
+                nodeMemory = cqbvh->nodeMemoryUsage();
+                accel = std::shared_ptr<IAccel>(cqbvh);
+            }
+
+            // Camera rays are only for the benchmark scene
+            AccelStats stats;
+            char mraysPrimary[32] = "-";
+            if (s == 0) sprintf(mraysPrimary, "%.3f", traceRays(*accel, primary, NULL));
+            const double mraysRandom = traceRays(*accel, randoms, &stats);
+            printf("%-8s %10.2f %10.2f %10.2f %10.2f %12.2f %12s %12.3f\n", accel->name(), nodeMemory / (1024.0 * 1024.0),
+                   accel->memoryUsage() / (1024.0 * 1024.0), accel->sahCost(),
+                   (double)stats.numNodeVisits / stats.numRays, (double)stats.numTriangleTests / stats.numRays,
+                   mraysPrimary, mraysRandom);
+        }
+        printf("\n");
+    }
+}
+
+void benchWatertight(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary, int imageWidth, int imageHeight) {
+    std::vector<std::shared_ptr<IAccel> > accels;
+    accels.push_back(std::shared_ptr<IAccel>(new QBVHAccel()));
+    if (OBVHAccel::isSupported()) accels.push_back(std::shared_ptr<IAccel>(new OBVHAccel()));
+    accels.push_back(std::shared_ptr<IAccel>(new CompressedQBVHAccel()));
+
+    printf("*** Watertight ray-triangle test (throughput) ***\n");
+    printf("%-8s %-8s", "mesh", "rays");
+    for (int a = 0; a < (int)accels.size(); a++) {
+        printf(" %8s[Mr/s]", accels[a]->name());
+    }
+    printf("\n");
+
+    std::vector<std::string> names;
+    std::vector<std::vector<Triangle> > meshes;
+    names.push_back("scene");
+    meshes.push_back(triangles);
+    const char* files[2] = { "rt3.ply", "bunny.ply" };
+    for (int m = 0; m < 2; m++) {
+        Trimesh mesh(ASSET_DIRECTORY + files[m]);
+        mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+        names.push_back(std::string(files[m]).substr(0, std::string(files[m]).find('.')));
+        meshes.push_back(mesh.triangulate());
+    }
+
+    for (int m = 0; m < (int)meshes.size(); m++) {
+        std::vector<Ray> randoms;
+        if (m != 0) randomRays(meshes[m], imageWidth * imageHeight, &randoms);
+        const std::vector<Ray>* rays[2] = { &primary, m == 0 ? &secondary : &randoms };
+        const char* rayNames[2] = { "camera", "random" };
+
+        for (int a = 0; a < (int)accels.size(); a++) {
+            accels[a]->construct(meshes[m], ACCEL_BUILD_SAH);
+        }
+        for (int r = 0; r < 2; r++) {
+            if (m != 0 && r == 0) continue;    // Camera only looks at the scene
+            printf("%-8s %-8s", names[m].c_str(), rayNames[r]);
+            for (int a = 0; a < (int)accels.size(); a++) {
+                printf(" %14.3f", traceRays(*accels[a], *rays[r], NULL));
+            }
+            printf("\n");
+        }
+    }
+    printf("\n");
+
+    // Rays aimed exactly at the shared vertices of a tessellated plane must
+    // never pass through it. The spacing is not representable in floats.
+    static const int gridSize = 128;
+    const double spacing = 1.0 / 3.0;
+    const double height = 0.1;
+    std::vector<Triangle> plane;
+    for (int i = 0; i < gridSize; i++) {
+        for (int j = 0; j < gridSize; j++) {
+            const Vector3D p00(i * spacing, height, j * spacing);
+            const Vector3D p01((i + 1) * spacing, height, j * spacing);
+            const Vector3D p10(i * spacing, height, (j + 1) * spacing);
+            const Vector3D p11((i + 1) * spacing, height, (j + 1) * spacing);
+            plane.push_back(Triangle(p00, p11, p01));
+            plane.push_back(Triangle(p00, p10, p11));
+        }
+    }
+
+    Random rng(2);
+    std::vector<Ray> vertexRays;
+    for (int i = 1; i < gridSize; i++) {
+        for (int j = 1; j < gridSize; j++) {
+            const Vector3D target(i * spacing, height, j * spacing);
+            const Vector3D orig = target + Vector3D(rng.nextReal() * 2.0 - 1.0, rng.nextReal() * 0.5 + 0.01, rng.nextReal() * 2.0 - 1.0) * (gridSize * spacing);
+            vertexRays.push_back(Ray(orig, (target - orig).normalized()));
+        }
+    }
+
+    // Rays spawned on the hitpoints of the camera rays must not hit the same triangles again
+    std::vector<Ray> spawnOrigins;
+    for (int i = 0; i < (int)primary.size(); i += 4) {
+        spawnOrigins.push_back(primary[i]);
+    }
+
+    printf("*** Watertight ray-triangle test (robustness) ***\n");
+    printf("%-8s %16s %16s\n", "tree", "vertex misses", "self hits");
+    for (int a = 0; a < (int)accels.size(); a++) {
+        accels[a]->construct(plane, ACCEL_BUILD_SAH);
+        int misses = 0;
+        for (int i = 0; i < (int)vertexRays.size(); i++) {
+            Hitpoint hitpoint;
+            if (accels[a]->intersect(vertexRays[i], &hitpoint) < 0) misses += 1;
+        }
+
+        accels[a]->construct(triangles, ACCEL_BUILD_SAH);
+        int selfHits = 0;
+        int numSpawned = 0;
+        for (int i = 0; i < (int)spawnOrigins.size(); i++) {
+            Hitpoint hitpoint;
+            const int id = accels[a]->intersect(spawnOrigins[i], &hitpoint);
+            if (id < 0) continue;
+
+            // Random direction on the side the camera ray came from
+            const Vector3D normal = Vector3D::dot(hitpoint.normal(), spawnOrigins[i].direction()) < 0.0 ? hitpoint.normal() : -hitpoint.normal();
+            Vector3D dir;
+            do {
+                dir = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+            } while (dir.squaredNorm() > 1.0 || dir.squaredNorm() < EPS);
+            if (Vector3D::dot(dir, normal) < 0.0) dir = -dir;
+
+            Hitpoint next;
+            if (accels[a]->intersect(hitpoint.spawnRay(dir.normalized()), &next) == id) selfHits += 1;
+            numSpawned += 1;
+        }
+        printf("%-8s %9d / %5d %9d / %5d\n", accels[a]->name(), misses, (int)vertexRays.size(), selfHits, numSpawned);
+    }
+    printf("\n");
+}
+
+namespace {
+
+    // Random points on the triangles (chosen uniformly, not by area) as photons and queries
+    void surfacePhotons(const std::vector<Triangle>& triangles, int numPhotons, unsigned int seed, std::vector<Photon>* photons) {
+        Random rng(seed);
+        photons->resize(numPhotons);
+        for (int i = 0; i < numPhotons; i++) {
+            const Triangle& tri = triangles[rng.nextInt((int)triangles.size())];
+            double u = rng.nextReal();
+            double v = rng.nextReal();
+            if (u + v > 1.0) {
+                u = 1.0 - u;
+                v = 1.0 - v;
+            }
+            const Vector3D pos = (1.0 - u - v) * tri.p0() + u * tri.p1() + v * tri.p2();
+            (*photons)[i] = Photon(pos, Vector3D(1.0, 1.0, 1.0), Vector3D(0.0, 1.0, 0.0), tri.normal());
+        }
+    }
+
+}
+
+namespace {
+
+    // Flux of the gathered photons
+    class FluxSum {
+    private:
+        const PhotonMap& _photonMap;
+        Vector3D _flux;
+        long long _count;
+
+    public:
+        explicit FluxSum(const PhotonMap& photonMap)
+            : _photonMap(photonMap)
+            , _flux(0.0, 0.0, 0.0)
+            , _count(0)
+        {
+        }
+
+        void operator()(int index, double dist2) {
+            _flux += _photonMap.flux(index);
+            _count++;
+        }
+
+        inline Vector3D flux() const { return _flux; }
+        inline long long count() const { return _count; }
+    };
+
+}
+
+void benchKdTree(const std::vector<Triangle>& triangles) {
+    static const int numPhotons = 2000000;
+    static const int numQueries = 100000;
+    static const int gatherPhotons = 128;
+
+    std::vector<Photon> photons, queries;
+    surfacePhotons(triangles, numPhotons, 3, &photons);
+    surfacePhotons(triangles, numQueries, 4, &queries);
+
+    BBox bbox;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bbox.merge(triangles[i]);
+    }
+    const double radius = (bbox.posMax() - bbox.posMin()).norm() * 0.01;
+
+    printf("*** Photon kd-tree (%d photons, %d queries, k = %d, radius = %.3f) ***\n", numPhotons, numQueries, gatherPhotons, radius);
+
+    KdTree<Photon> kdtree;
+    Timer timer;
+    timer.start();
+    kdtree.construct(photons);
+    const double buildTime = timer.stop();
+
+    // Photons packed as the photon map stores them (packing time included)
+    KdTree<CompactPhoton> compactTree;
+    timer.start();
+    compactTree.construct(photons);
+    const double compactBuildTime = timer.stop();
+
+    printf("%-12s %10s %12s %12s\n", "tree", "build[s]", "memory[MB]", "B/photon");
+    printf("%-12s %10.3f %12.2f %12.2f\n", "photon", buildTime, kdtree.memoryUsage() / (1024.0 * 1024.0), (double)kdtree.memoryUsage() / numPhotons);
+    printf("%-12s %10.3f %12.2f %12.2f\n", "compact", compactBuildTime, compactTree.memoryUsage() / (1024.0 * 1024.0), (double)compactTree.memoryUsage() / numPhotons);
+    printf("\n");
+
+    // Copying the photons out, reusing one query context for their indices,
+    // or decoding the positions and the fluxes of the compact photons
+    const KnnQuery query(K_NEAREST | EPSILON_BALL, radius, gatherPhotons);
+    printf("%-12s %14s %12s\n", "kNN results", "kNN[kq/s]", "found/query");
+    for (int m = 0; m < 3; m++) {
+        long long numFound = 0;
+        KnnQueryContext context;
+        Vector3D totalFlux;
+        timer.start();
+        for (int i = 0; i < numQueries; i++) {
+            if (m == 0) {
+                std::vector<Photon> results;
+                kdtree.knnSearch(queries[i], query, &results);
+                numFound += results.size();
+            } else if (m == 1) {
+                kdtree.knnSearch(queries[i], query, &context);
+                numFound += context.size();
+            } else {
+                compactTree.knnSearch(queries[i], query, &context);
+                for (int j = 0; j < context.size(); j++) {
+                    const int index = context.index(j);
+                    const Vector3D position(compactTree.position(index, 0), compactTree.position(index, 1), compactTree.position(index, 2));
+                    totalFlux += compactTree.point(index).flux() * (position - queries[i]).squaredNorm();
+                }
+                numFound += context.size();
+            }
+        }
+        const double queryTime = timer.stop();
+        const char* names[3] = { "copy", "context", "compact" };
+        printf("%-12s %14.2f %12.2f\n", names[m], numQueries / queryTime * 1.0e-3, (double)numFound / numQueries);
+    }
+    printf("\n");
+
+    // Gathering the flux through the photon map, with the k nearest photons
+    // or with all the photons within the radius of PPM-APA at some passes.
+    // The radius starts as ProgressivePhotonMappingProb::render() does and
+    // shrinks by R_{t+1}^2 = R_t^2 * (t + alpha) / (t + 1). The photons here
+    // are uniform per triangle rather than per area, so the range gather
+    // finds more than k photons on the finely tessellated meshes.
+    double area = 0.0;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        area += triangles[i].area();
+    }
+    static const int numPasses = 4;
+    static const int passes[numPasses] = { 1, 16, 256, 4096 };
+    double passRadii[numPasses];
+    double passRadius = ProgressivePhotonMappingProb::initialRadius(area, numPhotons, gatherPhotons);
+    for (int t = 1, p = 0; p < numPasses; t++) {
+        if (t == passes[p]) passRadii[p++] = passRadius;
+        passRadius *= sqrt((t + 0.7) / (t + 1.0));
+    }
+
+    PhotonMap photonMap;
+    photonMap.construct(photons);
+    printf("*** Photon gather (PPM-APA radius, alpha = 0.7) ***\n");
+    printf("%-12s %6s %10s %14s %14s\n", "gather", "pass", "radius", "gather[kq/s]", "photons/query");
+    for (int m = 0; m <= numPasses; m++) {
+        const double gatherRadius = m == 0 ? passRadii[0] : passRadii[m - 1];
+        FluxSum sum(photonMap);
+        KnnQueryContext context;
+        timer.start();
+        for (int i = 0; i < numQueries; i++) {
+            if (m == 0) {
+                photonMap.findKNN(queries[i], &context, gatherPhotons, gatherRadius);
+                for (int j = 0; j < context.size(); j++) {
+                    sum(context.index(j), context.squaredDistance(j));
+                }
+            } else {
+                photonMap.rangeQuery(queries[i], gatherRadius * gatherRadius, sum);
+            }
+        }
+        const double gatherTime = timer.stop();
+        printf("%-12s %6d %10.4f %14.2f %14.2f\n", m == 0 ? "kNN" : "range", m == 0 ? passes[0] : passes[m - 1], gatherRadius, numQueries / gatherTime * 1.0e-3, (double)sum.count() / numQueries);
+    }
+    printf("\n");
+
+    // Construction is repeated for every pass of progressive photon mapping
+    printf("*** Photon kd-tree parallel construction (%d photons) ***\n", numPhotons);
+    printf("%-8s %10s %10s\n", "threads", "build[s]", "speedup");
+    const std::vector<int> counts = threadCounts();
+    double serialTime = 0.0;
+    for (int t = 0; t < (int)counts.size(); t++) {
+        setNumThreads(counts[t]);
+        double best = INFTY;
+        for (int k = 0; k < 3; k++) {
+            timer.start();
+            kdtree.construct(photons);
+            best = std::min(best, timer.stop());
+        }
+        if (t == 0) serialTime = best;
+        printf("%-8d %10.3f %10.2f\n", counts[t], best, serialTime / best);
+    }
+    setNumThreads(OMP_NUM_CORE);
+    printf("\n");
+}
+
+void benchGather(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary) {
+    static const int numPhotons = 2000000;
+    static const int batchSize = 256;
+
+    // Photons are gathered at the camera hits (as the radiance pass of PPM-APA)
+    QBVHAccel qbvh;
+    qbvh.construct(triangles);
+    std::vector<Vector3D> positions;
+    for (int i = 0; i < (int)primary.size(); i++) {
+        Hitpoint hitpoint;
+        if (qbvh.intersect(primary[i], &hitpoint) >= 0) {
+            positions.push_back(hitpoint.position());
+        }
+    }
+    const int numQueries = (int)positions.size();
+
+    std::vector<Photon> photons;
+    surfacePhotons(triangles, numPhotons, 3, &photons);
+    PhotonMap photonMap;
+    photonMap.construct(photons);
+
+    BBox bbox;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bbox.merge(triangles[i]);
+    }
+    const double radius = (bbox.posMax() - bbox.posMin()).norm() * 0.005;
+
+    printf("*** Photon gather order (%d photons, %d queries, radius = %.3f) ***\n", numPhotons, numQueries, radius);
+    printf("%-12s %10s %14s %14s %10s\n", "order", "sort[s]", "gather[kq/s]", "photons/query", "speedup");
+    Timer timer;
+    double scanlineRate = 0.0;
+    const char* names[3] = { "scanline", "shuffled", "morton" };
+    for (int m = 0; m < 3; m++) {
+        // Scanline order of the pixels, random order (like the hits after
+        // specular bounces), or the Morton order of the hits (sorting time included)
+        std::vector<int> order(numQueries);
+        for (int i = 0; i < numQueries; i++) order[i] = i;
+        if (m == 1) {
+            Random rng(5);
+            for (int i = numQueries - 1; i > 0; i--) {
+                std::swap(order[i], order[rng.nextInt(i + 1)]);
+            }
+        }
+
+        timer.start();
+        if (m == 2) {
+            PhotonMap::sortQueries(positions, &order);
+        }
+        const double sortTime = timer.stop();
+
+        const int numBatches = (numQueries + batchSize - 1) / batchSize;
+        std::vector<long long> counts(numBatches);
+        double gatherTime = INFTY;
+        for (int t = 0; t < 5; t++) {
+            timer.start();
+            ompfor_dynamic (int b = 0; b < numBatches; b++) {
+                FluxSum sum(photonMap);
+                const int endID = std::min(numQueries, (b + 1) * batchSize);
+                for (int k = b * batchSize; k < endID; k++) {
+                    photonMap.rangeQuery(positions[order[k]], radius * radius, sum);
+                }
+                counts[b] = sum.count();
+            }
+            gatherTime = std::min(gatherTime, timer.stop() + sortTime);
+        }
+
+        long long numFound = 0;
+        for (int b = 0; b < numBatches; b++) {
+            numFound += counts[b];
+        }
+        const double rate = numQueries / gatherTime * 1.0e-3;
+        if (m == 0) scanlineRate = rate;
+        printf("%-12s %10.3f %14.2f %14.2f %10.2f\n", names[m], sortTime, rate, (double)numFound / numQueries, rate / scanlineRate);
+    }
+    printf("\n");
+}
+
+void benchHashGrid(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, int imageWidth, int imageHeight) {
+    static const int numPhotons = 2000000;
+
+    // Render points at the camera hits with the initial radius of PPM
+    QBVHAccel qbvh;
+    qbvh.construct(triangles);
+    std::vector<Vector3D> points;
+    BBox bbox;
+    for (int i = 0; i < (int)primary.size(); i++) {
+        Hitpoint hitpoint;
+        if (qbvh.intersect(primary[i], &hitpoint) >= 0) {
+            points.push_back(hitpoint.position());
+            bbox.merge(hitpoint.position());
+        }
+    }
+    const int numPoints = (int)points.size();
+
+    const Vector3D boxsize = bbox.posMax() - bbox.posMin();
+    const double irad = ((boxsize.x() + boxsize.y() + boxsize.z()) / 3.0) / ((imageWidth + imageHeight) / 2.0) * 8.0;
+    const Vector3D iradv(irad, irad, irad);
+    bbox.merge(bbox.posMin() - iradv);
+    bbox.merge(bbox.posMax() + iradv);
+
+    // Cells filled one by one (looked up by copying under a lock as before)
+    // and the flattened grid (looked up without locks)
+    HashGrid<int> grid, flatGrid;
+    grid.init(numPoints, 1.0 / (irad * 2.0), bbox);
+    flatGrid.init(numPoints, 1.0 / (irad * 2.0), bbox);
+    std::vector<int> items(numPoints);
+    std::vector<BBox> boxes(numPoints);
+    for (int i = 0; i < numPoints; i++) {
+        grid.add(i, points[i] - iradv, points[i] + iradv);
+        items[i] = i;
+        boxes[i] = BBox(points[i] - iradv, points[i] + iradv);
+    }
+    flatGrid.construct(items, boxes);
+
+    std::vector<Photon> photons;
+    surfacePhotons(triangles, numPhotons, 3, &photons);
+
+    printf("*** Hash grid lookups of the photon pass (%d render points, %d photons) ***\n", numPoints, numPhotons);
+    printf("%-8s %16s %16s %12s %10s\n", "threads", "locked[Mp/s]", "span[Mp/s]", "points/hit", "speedup");
+    Timer timer;
+    const std::vector<int> counts = threadCounts();
+    double serialRate = 0.0;
+    for (int t = 0; t < (int)counts.size(); t++) {
+        setNumThreads(counts[t]);
+        double rates[2];
+        long long numFound = 0;
+        for (int m = 0; m < 2; m++) {
+            std::vector<long long> founds(numPhotons);
+            timer.start();
+            ompfor (int i = 0; i < numPhotons; i++) {
+                int count = 0;
+                if (m == 0) {
+                    std::vector<int> results;
+                    omplock {
+                        results = grid[photons[i]];
+                    }
+                    for (int k = 0; k < (int)results.size(); k++) {
+                        if ((points[results[k]] - photons[i]).squaredNorm() <= irad * irad) count++;
+                    }
+                } else {
+                    const HashGrid<int>::Span results = flatGrid.cell(photons[i]);
+                    for (int k = 0; k < results.size(); k++) {
+                        if ((points[results[k]] - photons[i]).squaredNorm() <= irad * irad) count++;
+                    }
+                }
+                founds[i] = count;
+            }
+            rates[m] = numPhotons / timer.stop() * 1.0e-6;
+
+            numFound = 0;
+            for (int i = 0; i < numPhotons; i++) {
+                numFound += founds[i];
+            }
+        }
+        if (t == 0) serialRate = rates[1];
+        printf("%-8d %16.2f %16.2f %12.2f %10.2f\n", counts[t], rates[0], rates[1], (double)numFound / numPhotons, rates[1] / serialRate);
+    }
+    printf("\n");
+
+    // Construction for as many points as a full HD image (photons stand in for render points)
+    std::vector<int> photonItems(numPhotons);
+    std::vector<BBox> photonBoxes(numPhotons);
+    for (int i = 0; i < numPhotons; i++) {
+        photonItems[i] = i;
+        photonBoxes[i] = BBox(photons[i] - iradv, photons[i] + iradv);
+    }
+
+    printf("*** Hash grid construction (%d points) ***\n", numPhotons);
+    printf("%-8s %16s %16s %10s\n", "threads", "add[ms]", "construct[ms]", "speedup");
+    double serialTime = 0.0;
+    for (int t = 0; t < (int)counts.size(); t++) {
+        setNumThreads(counts[t]);
+        double times[2] = { 1.0e20, 1.0e20 };
+        for (int trial = 0; trial < 3; trial++) {
+            HashGrid<int> addGrid;
+            timer.start();
+            addGrid.init(numPhotons, 1.0 / (irad * 2.0), bbox);
+            for (int i = 0; i < numPhotons; i++) {
+                addGrid.add(i, photonBoxes[i].posMin(), photonBoxes[i].posMax());
+            }
+            times[0] = std::min(times[0], timer.stop() * 1000.0);
+
+            HashGrid<int> constructGrid;
+            timer.start();
+            constructGrid.init(numPhotons, 1.0 / (irad * 2.0), bbox);
+            constructGrid.construct(photonItems, photonBoxes);
+            times[1] = std::min(times[1], timer.stop() * 1000.0);
+        }
+        if (t == 0) serialTime = times[1];
+        printf("%-8d %16.1f %16.1f %10.2f\n", counts[t], times[0], times[1], serialTime / times[1]);
+    }
+    setNumThreads(OMP_NUM_CORE);
+    printf("\n");
+}
+
+void setScene(std::vector<Triangle>* triangles, Camera* camera, int imageWidth, int imageHeight) {
+    std::cout << "Preparing the scene -> ";
+
+    // Parameters
+    const int tiles = 8;
+    const double tileSize = 8.0;
+
+    // Title mesh
+    Trimesh titleMesh;
+    titleMesh.load(ASSET_DIRECTORY + "rt3.ply");
+    titleMesh.fitToBBox(BBox(-10.0, -10.0, -10.0, 10.0, 10.0, 10.0));
+    titleMesh.scale(1.5);
+    titleMesh.putOnPlane(Plane(10.0, Vector3D(0.0, 1.0, 0.0)));
+    titleMesh.translate(Vector3D(20.0, 0.0, -5.0));
+
+    // Bunny mesh
+    Trimesh bunnyMesh;
+    bunnyMesh.load(ASSET_DIRECTORY + "bunny.ply");
+    bunnyMesh.fitToBBox(BBox(-5.0, -5.0, -5.0, 5.0, 5.0, 5.0));
+    bunnyMesh.scale(0.8);
+    bunnyMesh.putOnPlane(Plane(10.0, Vector3D(0.0, 1.0, 0.0)));
+    bunnyMesh.translate(Vector3D(5.0, 0.0, -10.0));
+
+    std::vector<Triangle> titleTris = titleMesh.triangulate();
+    std::vector<Triangle> bunnyTris = bunnyMesh.triangulate();
+    triangles->insert(triangles->end(), titleTris.begin(), titleTris.end());
+    triangles->insert(triangles->end(), bunnyTris.begin(), bunnyTris.end());
+
+    // Floor
+    for (int i = 0; i < tiles; i++) {
+        for (int j = 0; j < tiles; j++) {
+            double ii = (i - tiles / 2) * tileSize;
+            double jj = (j - tiles / 2) * tileSize;
+            Vector3D p00(ii, -10.0, jj);
+            Vector3D p01(ii + tileSize, -10.0, jj);
+            Vector3D p10(ii, -10.0, jj + tileSize);
+            Vector3D p11(ii + tileSize, -10.0, jj + tileSize);
+            triangles->push_back(Triangle(p00, p11, p01));
+            triangles->push_back(Triangle(p00, p10, p11));
+        }
+    }
+
+    // Camera
+    Vector3D eye(-25.0, 5.0, -18.0);
+    *camera = Camera(eye, -eye.normalized(), Vector3D(0.0, 1.0, 0.0), 45.0, imageWidth, imageHeight, 1.0);
+
+    std::cout << "OK" << std::endl;
+}
+
+void cameraRays(const Camera& camera, std::vector<Ray>* rays) {
+    const int width  = camera.imagesize().width();
+    const int height = camera.imagesize().height();
+    rays->resize(width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            (*rays)[y * width + x] = camera.getRay(x, y);
+        }
+    }
+}
+
+void randomRays(const std::vector<Triangle>& triangles, int numRays, std::vector<Ray>* rays) {
+    BBox bbox;
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        bbox.merge(triangles[i]);
+    }
+    const Vector3D bsize = bbox.posMax() - bbox.posMin();
+
+    Random rng(0);
+    rays->resize(numRays);
+    for (int i = 0; i < numRays; i++) {
+        const Vector3D orig = bbox.posMin() + Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * bsize;
+        Vector3D dir;
+        do {
+            dir = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        } while (dir.squaredNorm() > 1.0 || dir.squaredNorm() < EPS);
+        (*rays)[i] = Ray(orig, dir.normalized());
+    }
+}
+
+void benchQBVHOcclusion(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, const std::vector<Ray>& secondary) {
+    printf("*** QBVH occlusion query ***\n");
+    printf("%-8s %14s %14s %10s %14s %14s\n", "rays", "intersect[Mr/s]", "occluded[Mr/s]", "speedup", "nodes/isect", "nodes/occl");
+
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    const std::vector<Ray>* rays[2] = { &primary, &secondary };
+    const char* names[2] = { "camera", "random" };
+    for (int r = 0; r < 2; r++) {
+        AccelStats isectStats, occlStats;
+        const double mraysIsect = traceRays(accel, *rays[r], &isectStats);
+        const double mraysOccl  = traceRays(accel, *rays[r], &occlStats, true);
+
+        printf("%-8s %14.3f %14.3f %10.2f %14.2f %14.2f\n", names[r], mraysIsect, mraysOccl, mraysOccl / mraysIsect,
+               (double)isectStats.numNodeVisits / isectStats.numRays, (double)occlStats.numNodeVisits / occlStats.numRays);
+    }
+    printf("\n");
+}
+
+void benchQBVHPacket(const std::vector<Triangle>& triangles, const std::vector<Ray>& primary, int imageWidth, int imageHeight) {
+    printf("*** QBVH ray packets (%dx%d camera rays) ***\n", imageWidth, imageHeight);
+    printf("%-8s %12s %10s %12s\n", "packet", "Mrays/s", "speedup", "nodes/ray");
+
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    AccelStats singleStats;
+    const double mraysSingle = traceRays(accel, primary, &singleStats);
+    printf("%-8s %12.3f %10.2f %12.2f\n", "1x1", mraysSingle, 1.0, (double)singleStats.numNodeVisits / singleStats.numRays);
+
+    const int tileWs[2] = { 2, 4 };
+    const int tileHs[2] = { 2, 2 };
+    for (int t = 0; t < 2; t++) {
+        AccelStats stats;
+        const double mrays = tracePackets(accel, primary, imageWidth, imageHeight, tileWs[t], tileHs[t], &stats);
+
+        char name[16];
+        sprintf(name, "%dx%d", tileWs[t], tileHs[t]);
+        printf("%-8s %12.3f %10.2f %12.2f\n", name, mrays, mrays / mraysSingle, (double)stats.numNodeVisits / stats.numRays);
+    }
+    printf("\n");
+}
@@ -53,16 +53,22 @@ inline T clamp(T v, T lo, T hi) {
     #include <omp.h>
     #if defined(_WIN32) || defined(__WIN32__)
         #define ompfor __pragma(omp parallel for) for
+        #define ompfor_dynamic __pragma(omp parallel for schedule(dynamic)) for
         #define omplock __pragma(omp critical)
+        #define ompatomic __pragma(omp atomic)
     #else
         #define ompfor _Pragma("omp parallel for") for
+        #define ompfor_dynamic _Pragma("omp parallel for schedule(dynamic)") for
         #define omplock _Pragma("omp critical")
+        #define ompatomic _Pragma("omp atomic")
     #endif
     const int OMP_NUM_CORE = omp_get_max_threads();
     inline int omp_thread_id() { return omp_get_thread_num(); }
 #else  // _OPENMP
     #define ompfor for
+    #define ompfor_dynamic for
     #define omplock
+    #define ompatomic
     const int OMP_NUM_CORE = 1;
     inline int omp_thread_id() { return 0; }
 #endif  // _OPENMP
@@ -78,6 +84,14 @@ inline T clamp(T v, T lo, T hi) {
 #endif
 
 
+// Functions using AVX intrinsics independently of the compiler flags
+// They must be called only when the CPU supports AVX.
+#if defined(_MSC_VER)
+    #define avx_target
+#else
+    #define avx_target __attribute__((target("avx")))
+#endif
+
 #if defined(_WIN32) || defined(__WIN32__)
 inline void* align_alloc(size_t size, size_t alignsize) {
     return _aligned_malloc(size, alignsize);
@@ -0,0 +1,99 @@
+#define COMPACT_PHOTON_EXPORT
+#include "compact_photon.h"
+#include "common.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace {
+
+    // Unit vectors at the centers of the angle bins
+    struct DirectionTable {
+        double cosTheta[256], sinTheta[256];
+        double cosPhi[256], sinPhi[256];
+
+        DirectionTable() {
+            for (int i = 0; i < 256; i++) {
+                const double theta = (i + 0.5) * PI / 256.0;
+                const double phi = (i + 0.5) * 2.0 * PI / 256.0;
+                cosTheta[i] = cos(theta);
+                sinTheta[i] = sin(theta);
+                cosPhi[i] = cos(phi);
+                sinPhi[i] = sin(phi);
+            }
+        }
+    };
+
+    const DirectionTable& directionTable() {
+        static const DirectionTable table;
+        return table;
+    }
+
+}
+
+CompactPhoton::CompactPhoton()
+    : _flux()
+    , _direction()
+    , _normal()
+{
+}
+
+CompactPhoton::CompactPhoton(const Photon& photon)
+    : _flux()
+    , _direction()
+    , _normal()
+{
+    // Mantissas share the exponent of the largest channel (truncated as the Radiance format)
+    const Vector3D flux = photon.flux();
+    const double d = std::max(flux.x(), std::max(flux.y(), flux.z()));
+    if (d > 1.0e-32) {
+        int e;
+        const double scale = frexp(d, &e) * 256.0 / d;
+        _flux[0] = static_cast<unsigned char>(std::max(0.0, flux.x() * scale));
+        _flux[1] = static_cast<unsigned char>(std::max(0.0, flux.y() * scale));
+        _flux[2] = static_cast<unsigned char>(std::max(0.0, flux.z() * scale));
+        _flux[3] = static_cast<unsigned char>(e + 128);
+    }
+
+    encodeDirection(photon.direction(), _direction);
+    encodeDirection(photon.normal(), _normal);
+}
+
+Vector3D CompactPhoton::flux() const {
+    if (_flux[3] == 0) {
+        return Vector3D(0.0, 0.0, 0.0);
+    }
+
+    // Mantissas are decoded at the centers of their bins (zero is kept zero)
+    const double f = ldexp(1.0, static_cast<int>(_flux[3]) - (128 + 8));
+    return Vector3D(_flux[0] != 0 ? (_flux[0] + 0.5) * f : 0.0,
+                    _flux[1] != 0 ? (_flux[1] + 0.5) * f : 0.0,
+                    _flux[2] != 0 ? (_flux[2] + 0.5) * f : 0.0);
+}
+
+Vector3D CompactPhoton::direction() const {
+    return decodeDirection(_direction);
+}
+
+Vector3D CompactPhoton::normal() const {
+    return decodeDirection(_normal);
+}
+
+Photon CompactPhoton::decode(const Vector3D& position) const {
+    return Photon(position, flux(), direction(), normal());
+}
+
+void CompactPhoton::encodeDirection(const Vector3D& dir, unsigned char angles[2]) {
+    const double cosTheta = std::max(-1.0, std::min(dir.z(), 1.0));
+    double phi = atan2(dir.y(), dir.x());
+    if (phi < 0.0) phi += 2.0 * PI;
+
+    angles[0] = static_cast<unsigned char>(std::min(static_cast<int>(acos(cosTheta) * (256.0 / PI)), 255));
+    angles[1] = static_cast<unsigned char>(std::min(static_cast<int>(phi * (256.0 / (2.0 * PI))), 255));
+}
+
+Vector3D CompactPhoton::decodeDirection(const unsigned char angles[2]) {
+    const DirectionTable& table = directionTable();
+    const double sinTheta = table.sinTheta[angles[0]];
+    return Vector3D(sinTheta * table.cosPhi[angles[1]], sinTheta * table.sinPhi[angles[1]], table.cosTheta[angles[0]]);
+}
@@ -0,0 +1,55 @@
+#ifndef _COMPACT_PHOTON_H_
+#define _COMPACT_PHOTON_H_
+
+#if defined(_WIN32) || defined(__WIN32__)
+    #ifdef COMPACT_PHOTON_EXPORT
+        #define COMPACT_PHOTON_DLL __declspec(dllexport)
+    #else
+        #define COMPACT_PHOTON_DLL __declspec(dllimport)
+    #endif
+#else
+    #define COMPACT_PHOTON_DLL
+#endif
+
+#include "photon.h"
+#include "kdtree.h"
+
+// --------------------------------------------------
+// Photon packed into 8 bytes
+// --------------------------------------------------
+// The flux is stored in the shared-exponent RGBE format, and the direction
+// and the normal as quantized spherical angles (one byte for each of theta
+// and phi, like Jensen's photon map). The position is not stored here but
+// in the kd-tree of the photon map, which keeps it as floats.
+// Photons are packed when the photon map is constructed and are decoded
+// only when they are gathered.
+class COMPACT_PHOTON_DLL CompactPhoton {
+private:
+    unsigned char _flux[4];         // RGBE
+    unsigned char _direction[2];    // theta-phi
+    unsigned char _normal[2];       // theta-phi
+
+public:
+    CompactPhoton();
+    explicit CompactPhoton(const Photon& photon);
+
+    Vector3D flux() const;
+    Vector3D direction() const;
+    Vector3D normal() const;
+
+    // Unpack all the attributes
+    // @param[in] position: position of the photon (kept by the kd-tree)
+    Photon decode(const Vector3D& position) const;
+
+private:
+    static void encodeDirection(const Vector3D& dir, unsigned char angles[2]);
+    static Vector3D decodeDirection(const unsigned char angles[2]);
+};
+
+// Positions of the compact photons are kept only by the kd-tree
+template <>
+struct KdTreePointTraits<CompactPhoton> {
+    static const bool hasCoordinates = false;
+};
+
+#endif  // _COMPACT_PHOTON_H_
@@ -0,0 +1,500 @@
+#include "compressed_qbvh_accel.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "common.h"
+#include "bbox.h"
+
+namespace {
+
+    const int maxStep = 255;
+
+    // Same arithmetic as the SIMD decoding, so that rounding is checked exactly
+    inline float decodeStep(float origin, float scale, int q) {
+        return origin + static_cast<float>(q) * scale;
+    }
+
+    // Convert four bytes to four floats
+    inline __m128 unpackSteps(const unsigned char steps[4]) {
+        int packed;
+        memcpy(&packed, steps, sizeof(int));
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bytes = _mm_cvtsi32_si128(packed);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+    }
+
+}
+
+CompressedQBVHAccel::CompressedQBVHAccel()
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+}
+
+CompressedQBVHAccel::CompressedQBVHAccel(const CompressedQBVHAccel& cqbvh)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+    this->operator=(cqbvh);
+}
+
+CompressedQBVHAccel::CompressedQBVHAccel(CompressedQBVHAccel&& cqbvh)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+    this->operator=(std::move(cqbvh));
+}
+
+CompressedQBVHAccel::~CompressedQBVHAccel()
+{
+    release();
+}
+
+CompressedQBVHAccel& CompressedQBVHAccel::operator=(const CompressedQBVHAccel& cqbvh) {
+    if (this == &cqbvh) return *this;
+
+    release();
+
+    if (cqbvh._numNodes > 0) {
+        _nodes = (CompressedNode*)align_alloc(sizeof(CompressedNode) * cqbvh._numNodes, 64);
+        memcpy((void*)_nodes, (void*)cqbvh._nodes, sizeof(CompressedNode) * cqbvh._numNodes);
+    }
+    _numNodes = cqbvh._numNodes;
+
+    if (cqbvh._numPackets > 0) {
+        _packets = (TrianglePacket*)align_alloc(sizeof(TrianglePacket) * cqbvh._numPackets, 16);
+        memcpy((void*)_packets, (void*)cqbvh._packets, sizeof(TrianglePacket) * cqbvh._numPackets);
+    }
+    _numPackets = cqbvh._numPackets;
+    _stackSize = cqbvh._stackSize;
+    _buildType = cqbvh._buildType;
+    _buildCost = cqbvh._buildCost;
+    _triangles = cqbvh._triangles;
+
+    return *this;
+}
+
+CompressedQBVHAccel& CompressedQBVHAccel::operator=(CompressedQBVHAccel&& cqbvh) {
+    if (this == &cqbvh) return *this;
+
+    release();
+
+    _nodes = cqbvh._nodes;
+    _numNodes = cqbvh._numNodes;
+    _packets = cqbvh._packets;
+    _numPackets = cqbvh._numPackets;
+    _stackSize = cqbvh._stackSize;
+    _buildType = cqbvh._buildType;
+    _buildCost = cqbvh._buildCost;
+    _triangles = std::move(cqbvh._triangles);
+    _mappedFile = std::move(cqbvh._mappedFile);
+    cqbvh._nodes = NULL;
+    cqbvh._numNodes = 0;
+    cqbvh._packets = NULL;
+    cqbvh._numPackets = 0;
+
+    return *this;
+}
+
+void CompressedQBVHAccel::release() {
+    // Nodes and packets loaded from a cache are unmapped with the file
+    if (_mappedFile == NULL) {
+        align_free(_nodes);
+        align_free(_packets);
+    }
+    _mappedFile.reset();
+    _nodes = NULL;
+    _numNodes = 0;
+    _packets = NULL;
+    _numPackets = 0;
+    _stackSize = 0;
+    _triangles.clear();
+}
+
+void CompressedQBVHAccel::construct(const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    static_assert(sizeof(CompressedNode) == 64, "CompressedNode must fit into a cache line");
+
+    release();
+
+    QBVHAccel qbvh;
+    qbvh.construct(triangles, buildType);
+
+    // Node IDs and leaf entries are kept, and only the boxes are quantized
+    _numNodes = qbvh._numNodes;
+    _nodes = (CompressedNode*)align_alloc(sizeof(CompressedNode) * _numNodes, 64);
+    ompfor (int i = 0; i < _numNodes; i++) {
+        BBox boxes[4];
+        for (int c = 0; c < 4; c++) {
+            _nodes[i].children[c] = qbvh._nodes[i].children[c];
+            if (_nodes[i].children[c] != QBVHAccel::_emptyLeaf) {
+                boxes[c] = QBVHAccel::childBox(qbvh._nodes[i], c);
+            }
+        }
+        quantizeNode(boxes, &_nodes[i]);
+    }
+
+    // Packets are taken over from the QBVH
+    _packets = qbvh._packets;
+    _numPackets = qbvh._numPackets;
+    qbvh._packets = NULL;
+    qbvh._numPackets = 0;
+    _triangles = std::move(qbvh._triangles);
+
+    _stackSize = 3 * depthRec(0) + 1;
+    _buildType = buildType;
+    _buildCost = sahCost();
+}
+
+bool CompressedQBVHAccel::refit(const std::vector<Triangle>& triangles, double maxCostRatio) {
+    Assertion(triangles.size() == _triangles.size(), "Number of triangles is changed after construction");
+
+    _triangles = triangles;
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    ompfor (int i = 0; i < _numPackets; i++) {
+        int ids[4];
+        int count = 0;
+        for (; count < 4 && _packets[i].ids[count] >= 0; count++) {
+            ids[count] = _packets[i].ids[count];
+        }
+        QBVHAccel::setPacket(_triangles, ids, count, &_packets[i]);
+    }
+
+    // Children are always stored after their parents (as QBVH), and
+    // each node is quantized again in its new box.
+    std::vector<BBox> nodeBoxes(_numNodes);
+    for (int i = _numNodes - 1; i >= 0; i--) {
+        BBox boxes[4];
+        for (int c = 0; c < 4; c++) {
+            const unsigned int entry = _nodes[i].children[c];
+            if (entry == QBVHAccel::_emptyLeaf) continue;
+
+            if (QBVHAccel::isLeaf(entry)) {
+                const TrianglePacket& packet = _packets[QBVHAccel::leafStart(entry)];
+                for (int k = 0; k < QBVHAccel::leafCount(entry); k++) {
+                    boxes[c].merge(BBox::fromTriangle(_triangles[packet.ids[k]]));
+                }
+            } else {
+                boxes[c] = nodeBoxes[entry];
+            }
+            nodeBoxes[i].merge(boxes[c]);
+        }
+        quantizeNode(boxes, &_nodes[i]);
+    }
+
+    if (sahCost() > maxCostRatio * _buildCost) {
+        construct(triangles, _buildType);
+        return true;
+    }
+    return false;
+}
+
+void CompressedQBVHAccel::quantizeNode(const BBox boxes[4], CompressedNode* node) {
+    // Child boxes are rounded to floats outward first
+    float lo[4][3], hi[4][3];
+    float nodeLo[3] = { (float)INFTY, (float)INFTY, (float)INFTY };
+    float nodeHi[3] = { -(float)INFTY, -(float)INFTY, -(float)INFTY };
+    bool isEmpty[4];
+    for (int c = 0; c < 4; c++) {
+        isEmpty[c] = node->children[c] == QBVHAccel::_emptyLeaf;
+        if (isEmpty[c]) continue;
+
+        for (int d = 0; d < 3; d++) {
+            lo[c][d] = static_cast<float>(boxes[c].posMin()[d]);
+            hi[c][d] = static_cast<float>(boxes[c].posMax()[d]);
+            if (lo[c][d] > boxes[c].posMin()[d]) lo[c][d] = std::nextafter(lo[c][d], -(float)INFTY);
+            if (hi[c][d] < boxes[c].posMax()[d]) hi[c][d] = std::nextafter(hi[c][d], (float)INFTY);
+            nodeLo[d] = std::min(nodeLo[d], lo[c][d]);
+            nodeHi[d] = std::max(nodeHi[d], hi[c][d]);
+        }
+    }
+
+    for (int d = 0; d < 3; d++) {
+        // A flat (or empty) node keeps a positive step so that empty slots stay inverted
+        const float origin = nodeLo[d] <= nodeHi[d] ? nodeLo[d] : 0.0f;
+        float scale = nodeLo[d] < nodeHi[d] ? (nodeHi[d] - nodeLo[d]) / maxStep : 1.0f;
+        if (scale <= 0.0f) scale = 1.0f;
+        while (nodeLo[d] < nodeHi[d] && decodeStep(origin, scale, maxStep) < nodeHi[d]) {
+            scale = std::nextafter(scale, (float)INFTY);
+        }
+        node->origin[d] = origin;
+        node->scale[d] = scale;
+
+        for (int c = 0; c < 4; c++) {
+            if (isEmpty[c]) {
+                node->childBoxes[0][d][c] = (unsigned char)maxStep;
+                node->childBoxes[1][d][c] = 0;
+                continue;
+            }
+
+            int qlo = std::max(0, std::min(maxStep, static_cast<int>(std::floor((lo[c][d] - origin) / scale))));
+            while (qlo > 0 && decodeStep(origin, scale, qlo) > lo[c][d]) qlo--;
+            int qhi = std::max(0, std::min(maxStep, static_cast<int>(std::ceil((hi[c][d] - origin) / scale))));
+            while (qhi < maxStep && decodeStep(origin, scale, qhi) < hi[c][d]) qhi++;
+            node->childBoxes[0][d][c] = (unsigned char)qlo;
+            node->childBoxes[1][d][c] = (unsigned char)qhi;
+        }
+    }
+}
+
+void CompressedQBVHAccel::decodeBoxes(const CompressedNode& node, __m128 boxes[2][3]) {
+    for (int d = 0; d < 3; d++) {
+        const __m128 origin = _mm_set1_ps(node.origin[d]);
+        const __m128 scale = _mm_set1_ps(node.scale[d]);
+        boxes[0][d] = _mm_add_ps(origin, _mm_mul_ps(unpackSteps(node.childBoxes[0][d]), scale));
+        boxes[1][d] = _mm_add_ps(origin, _mm_mul_ps(unpackSteps(node.childBoxes[1][d]), scale));
+    }
+}
+
+BBox CompressedQBVHAccel::childBox(const CompressedNode& node, int i) {
+    float ret[2][3];
+    for (int k = 0; k < 2; k++) {
+        for (int d = 0; d < 3; d++) {
+            ret[k][d] = decodeStep(node.origin[d], node.scale[d], node.childBoxes[k][d][i]);
+        }
+    }
+    return BBox(ret[0][0], ret[0][1], ret[0][2], ret[1][0], ret[1][1], ret[1][2]);
+}
+
+double CompressedQBVHAccel::sahCost() const {
+    if (_numNodes == 0) {
+        return 0.0;
+    }
+
+    BBox rootBox;
+    for (int i = 0; i < 4; i++) {
+        if (_nodes[0].children[i] != QBVHAccel::_emptyLeaf) {
+            rootBox.merge(childBox(_nodes[0], i));
+        }
+    }
+    const double rootArea = rootBox.area();
+    return sahCostRec(0, rootArea, rootArea);
+}
+
+double CompressedQBVHAccel::sahCostRec(int nodeID, double nodeArea, double rootArea) const {
+    const CompressedNode& node = _nodes[nodeID];
+    double cost = QBVHAccel::_traversalCost * nodeArea / rootArea;
+    for (int i = 0; i < 4; i++) {
+        const unsigned int child = node.children[i];
+        if (child == QBVHAccel::_emptyLeaf) continue;
+
+        const double childArea = childBox(node, i).area();
+        if (QBVHAccel::isLeaf(child)) {
+            cost += QBVHAccel::_intersectCost * QBVHAccel::leafCount(child) * childArea / rootArea;
+        } else {
+            cost += sahCostRec(child, childArea, rootArea);
+        }
+    }
+    return cost;
+}
+
+int CompressedQBVHAccel::depthRec(int nodeID) const {
+    int depth = 0;
+    for (int i = 0; i < 4; i++) {
+        const unsigned int child = _nodes[nodeID].children[i];
+        if (!QBVHAccel::isLeaf(child)) {
+            depth = std::max(depth, depthRec(child));
+        }
+    }
+    return depth + 1;
+}
+
+size_t CompressedQBVHAccel::memoryUsage() const {
+    return sizeof(CompressedNode) * _numNodes + sizeof(TrianglePacket) * _numPackets + sizeof(Triangle) * _triangles.capacity();
+}
+
+bool CompressedQBVHAccel::save(const std::string& filename) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    AccelCacheHeader header;
+    memset((void*)&header, 0, sizeof(AccelCacheHeader));
+    strncpy(header.magic, name(), sizeof(header.magic));
+    header.version = accel::cacheVersion;
+    header.buildType = (unsigned int)_buildType;
+    header.key = accel::cacheKey(_triangles, _buildType, name());
+    header.numTriangles = (int)_triangles.size();
+    header.numNodes = _numNodes;
+    header.numPackets = _numPackets;
+    header.stackSize = _stackSize;
+    header.buildCost = _buildCost;
+
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    ofs.write((const char*)&header, sizeof(AccelCacheHeader));
+    ofs.write((const char*)_nodes, sizeof(CompressedNode) * _numNodes);
+    ofs.write((const char*)_packets, sizeof(TrianglePacket) * _numPackets);
+    ofs.close();
+    return !ofs.fail();
+}
+
+bool CompressedQBVHAccel::load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    release();
+
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename)) {
+        return false;
+    }
+
+    const unsigned long long key = accel::cacheKey(triangles, buildType, name());
+    const AccelCacheHeader* header = accel::checkCache(*file, name(), key, sizeof(CompressedNode), sizeof(TrianglePacket));
+    if (header == NULL || header->numTriangles != (int)triangles.size()) {
+        return false;
+    }
+
+    // The mapping is page-aligned and the header keeps both arrays aligned
+    char* data = file->data() + sizeof(AccelCacheHeader);
+    _nodes = (CompressedNode*)data;
+    _numNodes = header->numNodes;
+    _packets = (TrianglePacket*)(data + sizeof(CompressedNode) * _numNodes);
+    _numPackets = header->numPackets;
+    _stackSize = header->stackSize;
+    _buildType = buildType;
+    _buildCost = header->buildCost;
+    _triangles = triangles;
+    _mappedFile = file;
+    return true;
+}
+
+template <bool anyHit>
+void CompressedQBVHAccel::traverse(const SimdRay& ray, HitRecord* record, AccelStats* stats) const {
+    if (stats != NULL) {
+        stats->numRays += 1;
+    }
+
+    StackItem localStack[_maxStackSize];
+    std::vector<StackItem> heapStack;
+    StackItem* stack = localStack;
+    if (_stackSize > _maxStackSize) {
+        heapStack.resize(_stackSize);
+        stack = &heapStack[0];
+    }
+
+    int stackTop = 0;
+    stack[stackTop].entry = 0;
+    stack[stackTop].tNear = 0.0f;
+    stackTop++;
+    while (stackTop > 0) {
+        const StackItem item = stack[--stackTop];
+        if (item.tNear > record->t) continue;    // Culled by a closer hit found after the push
+        const unsigned int entry = item.entry;
+
+        if (stats != NULL) {
+            stats->numNodeVisits += 1;
+            if (QBVHAccel::isLeaf(entry)) stats->numTriangleTests += QBVHAccel::leafCount(entry);
+        }
+
+        if (QBVHAccel::isLeaf(entry)) {
+            if (entry != QBVHAccel::_emptyLeaf) {
+                QBVHAccel::intersectPacket(_packets[QBVHAccel::leafStart(entry)], ray, record);
+                if (anyHit && record->id >= 0) return;
+            }
+            continue;
+        }
+
+        // Decode child boxes and test ray-bbox intersection
+        const CompressedNode& node = _nodes[entry];
+        __m128 boxes[2][3];
+        decodeBoxes(node, boxes);
+
+        __m128 tMin = _mm_setzero_ps();
+        __m128 tMax = _mm_set1_ps(record->t);
+        for (int d = 0; d < 3; d++) {
+            tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(boxes[ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+            tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(boxes[1 - ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+        }
+
+        const int hitMask = _mm_movemask_ps(_mm_cmpge_ps(_mm_mul_ps(tMax, _mm_set1_ps(accel::boxErrorScale())), tMin));
+        if (hitMask == 0) continue;
+
+        // Push hit children so that the nearest one is popped first
+        align_attrib(float, 16) tNears[4];
+        _mm_store_ps(tNears, tMin);
+        const int stackBottom = stackTop;
+        for (int i = 0; i < 4; i++) {
+            if ((hitMask & (1 << i)) == 0) continue;
+
+            StackItem child = { node.children[i], tNears[i] };
+            int k = stackTop++;
+            for (; k > stackBottom && stack[k - 1].tNear < child.tNear; k--) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+int CompressedQBVHAccel::intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return -1;
+    }
+
+    SimdRay simdRay;
+    QBVHAccel::setSimdRay(ray, &simdRay);
+
+    HitRecord record = { -1, static_cast<float>(hitpoint->distance()), 0.0f, 0.0f };
+    traverse<false>(simdRay, &record, stats);
+    if (record.id < 0) {
+        return -1;
+    }
+
+    QBVHAccel::resolveHit(_triangles[record.id], ray, record, hitpoint);
+    return record.id;
+}
+
+int CompressedQBVHAccel::intersect(RayPacket& packet, AccelStats* stats) const {
+    int hitMask = 0;
+    for (int r = 0; r < packet.size(); r++) {
+        Hitpoint hitpoint;
+        hitpoint.setDistance(packet.intersection(r).hittingDistance());
+        const int triID = intersect(packet.ray(r), &hitpoint, stats);
+        if (triID >= 0) {
+            packet.setIntersection(r, triID, hitpoint);
+            hitMask |= 1 << r;
+        }
+    }
+    return hitMask;
+}
+
+bool CompressedQBVHAccel::occluded(const Ray& ray, double tMax, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    SimdRay simdRay;
+    QBVHAccel::setSimdRay(ray, &simdRay);
+
+    HitRecord record = { -1, static_cast<float>(tMax), 0.0f, 0.0f };
+    traverse<true>(simdRay, &record, stats);
+    return record.id >= 0;
+}
@@ -0,0 +1,120 @@
+#ifndef _COMPRESSED_QBVH_ACCEL_H_
+#define _COMPRESSED_QBVH_ACCEL_H_
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "accel_interface.h"
+#include "accel_cache.h"
+#include "qbvh_accel.h"
+
+// --------------------------------------------------
+// QBVH with quantized child boxes
+// --------------------------------------------------
+// The tree is the same as QBVH, but each node stores the boxes of its children
+// as 8-bit steps from the minimum corner of its own box, which halves the node
+// size to one cache line. Quantized boxes are rounded outward and never miss
+// the triangles. Boxes are decoded on every visit, so this is for meshes whose
+// trees are much larger than the CPU caches.
+class CompressedQBVHAccel : public IAccel {
+private:
+
+    // Child entries are encoded in the same way as QBVH.
+    struct CompressedNode {
+        float origin[3];                     // Minimum corner of the node box
+        float scale[3];                      // Size of a quantization step along each axis
+        unsigned char childBoxes[2][3][4];   // [min-max][x-y-z][child] in steps from origin
+        unsigned int children[4];            // Child node IDs or leaf entries
+    };
+
+    typedef QBVHAccel::TrianglePacket TrianglePacket;
+    typedef QBVHAccel::SimdRay SimdRay;
+    typedef QBVHAccel::StackItem StackItem;
+    typedef QBVHAccel::HitRecord HitRecord;
+
+    static const int _maxStackSize = 256;    // Traversal stack kept on the call stack
+
+    CompressedNode* _nodes;
+    int _numNodes;
+    TrianglePacket* _packets;
+    int _numPackets;
+    int _stackSize;    // Traversal stack size required by the tree depth
+    AccelBuildType _buildType;
+    double _buildCost;    // SAH cost right after the last construction
+    std::vector<Triangle> _triangles;    // Original triangles to compute hitpoints
+    std::shared_ptr<MappedFile> _mappedFile;    // Owner of the nodes and packets when loaded from a cache
+
+public:
+    CompressedQBVHAccel();
+    CompressedQBVHAccel(const CompressedQBVHAccel& cqbvh);
+    CompressedQBVHAccel(CompressedQBVHAccel&& cqbvh);
+    virtual ~CompressedQBVHAccel();
+
+    CompressedQBVHAccel& operator=(const CompressedQBVHAccel& cqbvh);
+    CompressedQBVHAccel& operator=(CompressedQBVHAccel&& cqbvh);
+
+    // Construct the tree
+    // A QBVH is built with the given strategy and its nodes are quantized.
+    // @param[in] triangles: triangles stored in the tree
+    // @param[in] buildType: split strategy (object median, binned SAH, Morton codes or spatial splits)
+    void construct(const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
+
+    // Update the bounds for moved triangles without changing the topology
+    // The tree is rebuilt with the last build type instead when the refitted
+    // tree is expected to be more than maxCostRatio times as costly (by SAH).
+    // @param[in] triangles: moved triangles in the same order as construction
+    // @return true if the tree was rebuilt
+    bool refit(const std::vector<Triangle>& triangles, double maxCostRatio = 1.5) override;
+
+    // Intersection test
+    // If ray is intersected, then return the index of the triangle.
+    // If not, then return -1.
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    int intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats = NULL) const override;
+
+    // Intersection test for a packet of rays (each ray is traversed separately)
+    // @return bit mask of the rays which hit triangles
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    int intersect(RayPacket& packet, AccelStats* stats = NULL) const override;
+
+    // Occlusion test (any hit)
+    // @param[in] tMax: distance to the end of the ray segment
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    bool occluded(const Ray& ray, double tMax = INFTY, AccelStats* stats = NULL) const override;
+
+    // Expected cost of a ray query estimated with the surface area heuristic (of the quantized boxes)
+    double sahCost() const override;
+
+    // Memory consumed by the nodes and the triangle buffers (in bytes)
+    size_t memoryUsage() const override;
+
+    inline int numNodes() const override { return _numNodes; }
+    inline const char* name() const override { return "cqbvh"; }
+
+    // Write the nodes and the packets to a cache file
+    // @return false if the file cannot be written
+    bool save(const std::string& filename) const override;
+
+    // Map a cache file written by save() instead of construction
+    // @return false (and the tree is left empty) if the file is missing or stale
+    bool load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
+
+    // Memory consumed by the nodes only (in bytes)
+    inline size_t nodeMemoryUsage() const { return sizeof(CompressedNode) * _numNodes; }
+
+private:
+    void release();
+
+    double sahCostRec(int nodeID, double nodeArea, double rootArea) const;
+    int depthRec(int nodeID) const;
+
+    template <bool anyHit>
+    void traverse(const SimdRay& ray, HitRecord* record, AccelStats* stats) const;
+
+    static void quantizeNode(const BBox boxes[4], CompressedNode* node);
+    static void decodeBoxes(const CompressedNode& node, __m128 boxes[2][3]);
+    static BBox childBox(const CompressedNode& node, int i);
+};
+
+#endif  // _COMPRESSED_QBVH_ACCEL_H_
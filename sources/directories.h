@@ -1,9 +0,0 @@
-#ifndef _DIRECTORIES_H_
-#define _DIRECTORIES_H_
-
-#include <string>
-
-static const std::string ASSET_DIRECTORY = "assets/";
-static const std::string RESULT_DIRECTORY = "./";
-
-#endif  // _DIRECTORIES_H_
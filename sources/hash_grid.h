@@ -3,42 +3,89 @@
 
 #include <vector>
 
+#include "common.h"
+#include "parallel.h"
 #include "bbox.h"
 
+// --------------------------------------------------
+// Hash grid
+// --------------------------------------------------
+// Items are registered to the cells overlapping their bounding boxes.
+// A grid is filled either one item at a time with add() (and looked up with
+// operator[]), or all at once with construct(), which stores the cells in
+// a flattened layout (offsets of the cells and one array of the items).
+// The flattened grid is immutable, and cell() returns a span of it without
+// copies or locks, so that it can be shared by threads.
+// The two ways are exclusive: construct() discards the cells filled by add(),
+// and add()/operator[] cannot be used until the grid is initialized again.
 template <class Ty>
 class HashGrid {
+public:
+    // Items in a cell of the flattened grid
+    class Span {
+    private:
+        const Ty* _begin;
+        const Ty* _end;
+
+    public:
+        Span(const Ty* begin, const Ty* end)
+            : _begin(begin)
+            , _end(end)
+        {
+        }
+
+        inline const Ty* begin() const { return _begin; }
+        inline const Ty* end() const { return _end; }
+        inline int size() const { return static_cast<int>(_end - _begin); }
+        inline bool empty() const { return _begin == _end; }
+        inline const Ty& operator[](int i) const { return _begin[i]; }
+    };
+
 private:
     int _hashSize;
     BBox _bbox;
     double _hashScale;
-    std::vector<std::vector<Ty> > _data;
+    std::vector<std::vector<Ty> > _data;    // Cells filled by add()
+    std::vector<int> _offsets;              // Start of the items of each cell (flattened grid)
+    std::vector<Ty> _items;                 // Items of all the cells (flattened grid)
 
 public:
     HashGrid();
     ~HashGrid();
 
-    // Construct hash grid
-    // @param[in] points: points stored to the grid
-    // @param[in] imageW: image width used to determine the initial grid size (option)
-    // @param[in] imageH: image height used to determine the initial grid size (option)
-    void construct(std::vector<Ty>& points, const int imageW = -1, const int imageH = -1);
+    // Construct the flattened grid
+    // Items are counted per cell in one shared array, and scattered to the
+    // offsets given by the prefix sum of the counts, where each chunk fills
+    // its own range of the cells. Items in each cell are in the order of the
+    // input. Work memory grows with the cells and the items, not the threads.
+    // The grid must be initialized with init() beforehand.
+    // @param[in] items: items stored to the grid
+    // @param[in] boxes: bounding boxes of the items
+    void construct(const std::vector<Ty>& items, const std::vector<BBox>& boxes);
 
     // Initialize grid
     void init(const int hashSize, const double hashScale, const BBox& bbox);
 
     // Set point data for the cells inside the specifed bounding box
+    // This cannot be used for the flattened grid.
     void add(const Ty& p, const Vector3D& boxMin, const Vector3D& boxMax);
 
     // Clear grid data
     void clear();
 
+    // Items of the cell added with add()
+    // This cannot be used for the flattened grid (use cell() instead).
     std::vector<Ty>& operator[](const Vector3D& v);
 
+    // Items of the cell of the flattened grid
+    Span cell(const Vector3D& v) const;
+
 private:
     unsigned int hash(const int ix, const int iy, const int iz) const;
+    unsigned int cellIndex(const Vector3D& v) const;
+    void cellRange(const Vector3D& boxMin, const Vector3D& boxMax, int lo[3], int hi[3]) const;
 };
 
 #include "hash_grid_detail.h"
 
 #endif  // _HASH_GRID_H_
-
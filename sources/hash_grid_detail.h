@@ -9,6 +9,8 @@ HashGrid<Ty>::HashGrid()
     , _bbox()
     , _hashScale(0.0)
     , _data()
+    , _offsets()
+    , _items()
 {
 }
 
@@ -18,8 +20,67 @@ HashGrid<Ty>::~HashGrid()
 }
 
 template <class Ty>
-void HashGrid<Ty>::construct(std::vector<Ty>& points, const int imageW, const int imageH) {
-        
+void HashGrid<Ty>::construct(const std::vector<Ty>& items, const std::vector<BBox>& boxes) {
+    Assertion(items.size() == boxes.size(), "the numbers of items and boxes are different");
+
+    // Cells of the flattened grid replace those filled by add()
+    std::vector<std::vector<Ty> >().swap(_data);
+
+    // Each item is referred to by the cells overlapping its box
+    const int numItems = (int)items.size();
+    std::vector<int> refStarts(numItems + 1, 0);
+    ompfor (int i = 0; i < numItems; i++) {
+        int cellLo[3], cellHi[3];
+        cellRange(boxes[i].posMin(), boxes[i].posMax(), cellLo, cellHi);
+        refStarts[i + 1] = (cellHi[0] - cellLo[0] + 1) * (cellHi[1] - cellLo[1] + 1) * (cellHi[2] - cellLo[2] + 1);
+    }
+
+    for (int i = 0; i < numItems; i++) {
+        refStarts[i + 1] += refStarts[i];
+    }
+
+    // Hash the cells of the items, and count the items in each cell in one shared array
+    const int numRefs = refStarts[numItems];
+    std::vector<unsigned int> cells(numRefs);
+    _offsets.assign(_hashSize + 1, 0);
+    ompfor (int i = 0; i < numItems; i++) {
+        int cellLo[3], cellHi[3];
+        cellRange(boxes[i].posMin(), boxes[i].posMax(), cellLo, cellHi);
+        int r = refStarts[i];
+        for (int iz = cellLo[2]; iz <= cellHi[2]; iz++) {
+            for (int iy = cellLo[1]; iy <= cellHi[1]; iy++) {
+                for (int ix = cellLo[0]; ix <= cellHi[0]; ix++) {
+                    const unsigned int h = hash(ix, iy, iz);
+                    cells[r++] = h;
+                    ompatomic
+                    _offsets[h + 1] += 1;
+                }
+            }
+        }
+    }
+
+    for (int h = 0; h < _hashSize; h++) {
+        _offsets[h + 1] += _offsets[h];
+    }
+
+    // Each chunk owns a range of the cells and scatters the items falling in
+    // it. Items are visited in the order of the input, which keeps them in
+    // order in each cell, and the cursors of the chunks do not overlap.
+    std::vector<int> cursors(_offsets.begin(), _offsets.end() - 1);
+    _items.resize(numRefs);
+    const int numChunks = parallel::numChunks();
+    ompfor (int c = 0; c < numChunks; c++) {
+        const unsigned int lo = static_cast<unsigned int>((long long)_hashSize * c / numChunks);
+        const unsigned int hi = static_cast<unsigned int>((long long)_hashSize * (c + 1) / numChunks);
+        for (int i = 0; i < numItems; i++) {
+            for (int r = refStarts[i]; r < refStarts[i + 1]; r++) {
+                const unsigned int h = cells[r];
+                if (lo <= h && h < hi) {
+                    _items[cursors[h]++] = items[i];
+                }
+            }
+        }
+    }
 }
 
 template <class Ty>
@@ -27,23 +88,19 @@ void HashGrid<Ty>::init(const int hashSize, const double hashScale, const BBox&
     this->_hashSize = hashSize;
     this->_hashScale = hashScale;
     this->_bbox = bbox;
-    this->_data.resize(hashSize);
+    this->_data.assign(hashSize, std::vector<Ty>());
+    this->_offsets.clear();
+    this->_items.clear();
 }
 
 template <class Ty>
 void HashGrid<Ty>::add(const Ty& p, const Vector3D& boxMin, const Vector3D& boxMax) {
-    const Vector3D bMin = (boxMin - _bbox.posMin()) * _hashScale;
-    const Vector3D bMax = (boxMax - _bbox.posMin()) * _hashScale;
-
-    const int minZ = std::abs(static_cast<int>(bMin.z()));
-    const int maxZ = std::abs(static_cast<int>(bMax.z()));
-    const int minY = std::abs(static_cast<int>(bMin.y()));
-    const int maxY = std::abs(static_cast<int>(bMax.y()));
-    const int minX = std::abs(static_cast<int>(bMin.x()));
-    const int maxX = std::abs(static_cast<int>(bMax.x()));
-    for (int iz = minZ; iz <= maxZ; iz++) {
-        for (int iy = minY; iy <= maxY; iy++) {
-            for (int ix = minX; ix <= maxX; ix++) {
+    Assertion(_offsets.empty(), "items cannot be added to the flattened grid");
+    int lo[3], hi[3];
+    cellRange(boxMin, boxMax, lo, hi);
+    for (int iz = lo[2]; iz <= hi[2]; iz++) {
+        for (int iy = lo[1]; iy <= hi[1]; iy++) {
+            for (int ix = lo[0]; ix <= hi[0]; ix++) {
                 unsigned int h = hash(ix, iy, iz);
                 _data[h].push_back(p);
             }
@@ -54,6 +111,8 @@ void HashGrid<Ty>::add(const Ty& p, const Vector3D& boxMin, const Vector3D& boxM
 template <class Ty>
 void HashGrid<Ty>::clear() {
     _data.clear();
+    _offsets.clear();
+    _items.clear();
 }
 
 template <class Ty>
@@ -63,13 +122,35 @@ unsigned int HashGrid<Ty>::hash(const int ix, const int iy, const int iz) const
 }
 
 template <class Ty>
-typename std::vector<Ty>& HashGrid<Ty>::operator[](const Vector3D& v) {
+unsigned int HashGrid<Ty>::cellIndex(const Vector3D& v) const {
     Vector3D b = (v - _bbox.posMin()) * _hashScale;
     const int ix = std::abs(static_cast<int>(b.x()));
     const int iy = std::abs(static_cast<int>(b.y()));
     const int iz = std::abs(static_cast<int>(b.z()));
-    return _data[hash(ix, iy, iz)];
+    return hash(ix, iy, iz);
 }
 
-#endif  // _SPICA_HASH_GRID_DETAIL_H_
+template <class Ty>
+void HashGrid<Ty>::cellRange(const Vector3D& boxMin, const Vector3D& boxMax, int lo[3], int hi[3]) const {
+    const Vector3D bMin = (boxMin - _bbox.posMin()) * _hashScale;
+    const Vector3D bMax = (boxMax - _bbox.posMin()) * _hashScale;
+    for (int d = 0; d < 3; d++) {
+        lo[d] = std::abs(static_cast<int>(bMin[d]));
+        hi[d] = std::abs(static_cast<int>(bMax[d]));
+    }
+}
 
+template <class Ty>
+typename std::vector<Ty>& HashGrid<Ty>::operator[](const Vector3D& v) {
+    Assertion(_offsets.empty(), "cells of the flattened grid must be looked up with cell()");
+    return _data[cellIndex(v)];
+}
+
+template <class Ty>
+typename HashGrid<Ty>::Span HashGrid<Ty>::cell(const Vector3D& v) const {
+    Assertion(!_offsets.empty(), "flattened grid is not constructed");
+    const unsigned int h = cellIndex(v);
+    return Span(_items.data() + _offsets[h], _items.data() + _offsets[h + 1]);
+}
+
+#endif  // _SPICA_HASH_GRID_DETAIL_H_
@@ -0,0 +1,230 @@
+#include "instance_accel.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+
+namespace {
+
+    class CentroidComparator {
+    private:
+        int d;
+    public:
+        CentroidComparator(int dim) : d(dim) {}
+
+        template <class Ty>
+        bool operator()(const Ty& r1, const Ty& r2) const {
+            return r1.worldBox.posMin()[d] + r1.worldBox.posMax()[d] < r2.worldBox.posMin()[d] + r2.worldBox.posMax()[d];
+        }
+    };
+
+}
+
+InstanceAccel::InstanceAccel()
+    : _records()
+    , _nodes()
+{
+}
+
+InstanceAccel::~InstanceAccel()
+{
+}
+
+void InstanceAccel::construct(const std::vector<Instance>& instances) {
+    const int numInstances = (int)instances.size();
+    _records.resize(numInstances);
+    for (int i = 0; i < numInstances; i++) {
+        Assertion(instances[i].accel != NULL, "Acceleration structure of the instance is not constructed");
+
+        _records[i].instance = instances[i];
+        _records[i].worldToObject = instances[i].transform.inverted();
+        _records[i].worldBox = instances[i].transform.applyToBBox(instances[i].objectBox);
+        _records[i].identity = instances[i].transform.isIdentity();
+    }
+
+    _nodes.clear();
+    if (numInstances > 0) {
+        constructRec(0, numInstances);
+    }
+}
+
+int InstanceAccel::constructRec(int startID, int endID) {
+    const int nodeID = (int)_nodes.size();
+    _nodes.push_back(InstanceNode());
+
+    BBox box;
+    for (int i = startID; i < endID; i++) {
+        box.merge(_records[i].worldBox);
+    }
+
+    InstanceNode node;
+    node.box = box;
+    node.left = node.right = -1;
+    node.start = startID;
+    node.count = endID - startID;
+    if (endID - startID > _maxNodeSize) {
+        // Object median split along the longest axis of the box
+        const int midID = (startID + endID) / 2;
+        std::nth_element(_records.begin() + startID, _records.begin() + midID, _records.begin() + endID,
+                         CentroidComparator(box.maximumExtent()));
+        node.count = 0;
+        node.left = constructRec(startID, midID);
+        node.right = constructRec(midID, endID);
+    }
+
+    _nodes[nodeID] = node;
+    return nodeID;
+}
+
+bool InstanceAccel::intersectBox(const BBox& box, const double orig[3], const double invdir[3], double tFar, double* tNear) {
+    const Vector3D posMin = box.posMin();
+    const Vector3D posMax = box.posMax();
+    double tMin = 0.0;
+    double tMax = tFar;
+    for (int d = 0; d < 3; d++) {
+        double t0 = (posMin[d] - orig[d]) * invdir[d];
+        double t1 = (posMax[d] - orig[d]) * invdir[d];
+        if (t0 > t1) std::swap(t0, t1);
+        tMin = std::max(tMin, t0);
+        tMax = std::min(tMax, t1);
+    }
+    *tNear = tMin;
+    return tMin <= tMax;
+}
+
+template <bool anyHit>
+int InstanceAccel::traverse(const Ray& ray, Hitpoint* hitpoint) const {
+    if (_nodes.empty()) {
+        return -1;
+    }
+
+    // Ray is copied to arrays once for the box tests
+    const Vector3D rayOrig = ray.origin();
+    const Vector3D rayInvdir = ray.invdir();
+    const double orig[3] = { rayOrig.x(), rayOrig.y(), rayOrig.z() };
+    const double invdir[3] = { rayInvdir.x(), rayInvdir.y(), rayInvdir.z() };
+
+    double tRoot;
+    if (!intersectBox(_nodes[0].box, orig, invdir, hitpoint->distance(), &tRoot)) {
+        return -1;
+    }
+
+    int triID = -1;
+    StackItem stack[_maxStackSize];
+    int stackTop = 0;
+    stack[stackTop].nodeID = 0;
+    stack[stackTop].tNear = tRoot;
+    stackTop++;
+    while (stackTop > 0) {
+        const StackItem item = stack[--stackTop];
+        if (item.tNear > hitpoint->distance()) continue;    // Culled by a closer hit found after the push
+        const InstanceNode& node = _nodes[item.nodeID];
+
+        if (node.count == 0) {
+            // The nearer child is pushed last to be traversed first
+            StackItem children[2];
+            int numHits = 0;
+            const int childIDs[2] = { node.left, node.right };
+            for (int c = 0; c < 2; c++) {
+                double tNear;
+                if (intersectBox(_nodes[childIDs[c]].box, orig, invdir, hitpoint->distance(), &tNear)) {
+                    children[numHits].nodeID = childIDs[c];
+                    children[numHits].tNear = tNear;
+                    numHits++;
+                }
+            }
+            if (numHits == 2 && children[0].tNear < children[1].tNear) {
+                std::swap(children[0], children[1]);
+            }
+
+            Assertion(stackTop + numHits <= _maxStackSize, "Instance tree is too deep");
+            for (int c = 0; c < numHits; c++) {
+                stack[stackTop++] = children[c];
+            }
+            continue;
+        }
+
+        for (int i = node.start; i < node.start + node.count; i++) {
+            const InstanceRecord& record = _records[i];
+            const IAccel& accel = *record.instance.accel;
+            if (record.identity) {
+                if (anyHit) {
+                    if (accel.occluded(ray, hitpoint->distance())) return record.instance.idOffset;
+                    continue;
+                }
+
+                Hitpoint hp;
+                hp.setDistance(hitpoint->distance());
+                const int id = accel.intersect(ray, &hp);
+                if (id >= 0 && hp.distance() < hitpoint->distance()) {
+                    *hitpoint = hp;
+                    triID = record.instance.idOffset + id;
+                }
+                continue;
+            }
+
+            // Object-space distances are scaled by the length of the transformed direction
+            const Vector3D dir = record.worldToObject.applyToVector(ray.direction());
+            const double scale = dir.norm();
+            const Ray objectRay(record.worldToObject.applyToPoint(ray.origin()), dir / scale);
+            if (anyHit) {
+                if (accel.occluded(objectRay, hitpoint->distance() * scale)) return record.instance.idOffset;
+                continue;
+            }
+
+            Hitpoint hp;
+            hp.setDistance(hitpoint->distance() * scale);
+            const int id = accel.intersect(objectRay, &hp);
+            if (id >= 0 && hp.distance() / scale < hitpoint->distance()) {
+                const Transform& transform = record.instance.transform;
+                const Vector3D position = transform.applyToPoint(hp.position());
+                hitpoint->setDistance(hp.distance() / scale);
+                hitpoint->setPosition(position);
+                hitpoint->setNormal(transform.applyToNormal(hp.normal()).normalized());
+
+                // The object-space error bound is stretched by the transform at most
+                // by the sum of the lengths of the transformed axes, and the world
+                // position adds its own rounding.
+                double stretch = 0.0;
+                double magnitude = 0.0;
+                for (int d = 0; d < 3; d++) {
+                    const Vector3D axis(d == 0 ? 1.0 : 0.0, d == 1 ? 1.0 : 0.0, d == 2 ? 1.0 : 0.0);
+                    stretch += transform.applyToVector(axis).norm();
+                    magnitude = std::max(magnitude, std::abs(position[d]));
+                }
+                hitpoint->setError(hp.error() * stretch + accel::hitError(magnitude));
+                triID = record.instance.idOffset + id;
+            }
+        }
+    }
+    return triID;
+}
+
+int InstanceAccel::intersect(const Ray& ray, Hitpoint* hitpoint) const {
+    return traverse<false>(ray, hitpoint);
+}
+
+int InstanceAccel::intersect(RayPacket& packet) const {
+    int hitMask = 0;
+    for (int r = 0; r < packet.size(); r++) {
+        Hitpoint hitpoint;
+        hitpoint.setDistance(packet.intersection(r).hittingDistance());
+        const int triID = traverse<false>(packet.ray(r), &hitpoint);
+        if (triID < 0) continue;
+
+        packet.setIntersection(r, triID, hitpoint);
+        hitMask |= 1 << r;
+    }
+    return hitMask;
+}
+
+bool InstanceAccel::occluded(const Ray& ray, double tMax) const {
+    Hitpoint hitpoint;
+    hitpoint.setDistance(tMax);
+    return traverse<true>(ray, &hitpoint) >= 0;
+}
+
+size_t InstanceAccel::memoryUsage() const {
+    return sizeof(InstanceRecord) * _records.capacity() + sizeof(InstanceNode) * _nodes.capacity();
+}
@@ -0,0 +1,97 @@
+#ifndef _INSTANCE_ACCEL_H_
+#define _INSTANCE_ACCEL_H_
+
+#include <memory>
+#include <vector>
+
+#include "accel_interface.h"
+#include "transform.h"
+#include "bbox.h"
+
+// Mesh placed in the scene with a transform
+// The acceleration structure is built in the object space of the mesh,
+// so it can be shared by all the instances of the mesh.
+struct Instance {
+    std::shared_ptr<IAccel> accel;
+    Transform transform;    // Object space to world space
+    BBox objectBox;         // Bounding box in the object space
+    int idOffset;           // Scene-wide index of the first triangle
+
+    Instance()
+        : accel()
+        , transform()
+        , objectBox()
+        , idOffset(0)
+    {
+    }
+};
+
+// --------------------------------------------------
+// Top-level BVH over instances
+// --------------------------------------------------
+// Rays are transformed into the object space of each instance whose box
+// they enter, and traced with the acceleration structure of the instance.
+// Returned triangle indices are shifted by the offsets of the instances.
+class InstanceAccel {
+private:
+    struct InstanceRecord {
+        Instance instance;
+        Transform worldToObject;
+        BBox worldBox;
+        bool identity;    // Rays are traced without transformation
+    };
+
+    // Binary node (a leaf if count > 0)
+    struct InstanceNode {
+        BBox box;
+        int left, right;
+        int start, count;
+    };
+
+    struct StackItem {
+        int nodeID;
+        double tNear;
+    };
+
+    static const int _maxNodeSize = 2;
+    static const int _maxStackSize = 64;
+
+    std::vector<InstanceRecord> _records;
+    std::vector<InstanceNode> _nodes;
+
+public:
+    InstanceAccel();
+    ~InstanceAccel();
+
+    // Construct the top-level tree
+    // @param[in] instances: instances whose acceleration structures are already built
+    void construct(const std::vector<Instance>& instances);
+
+    // Intersection test
+    // If ray is intersected, then return the scene-wide index of the triangle.
+    // If not, then return -1.
+    int intersect(const Ray& ray, Hitpoint* hitpoint) const;
+
+    // Intersection test of the rays in a packet (traced one by one)
+    // @return bit mask of the rays which hit triangles
+    int intersect(RayPacket& packet) const;
+
+    // Occlusion test (any hit)
+    // @param[in] tMax: distance to the end of the ray segment
+    bool occluded(const Ray& ray, double tMax = INFTY) const;
+
+    // Memory consumed by the top-level tree (in bytes), not including the instanced trees
+    size_t memoryUsage() const;
+
+    inline int numInstances() const { return (int)_records.size(); }
+
+private:
+    int constructRec(int startID, int endID);
+
+    template <bool anyHit>
+    int traverse(const Ray& ray, Hitpoint* hitpoint) const;
+
+    static bool intersectBox(const BBox& box, const double orig[3], const double invdir[3], double tFar, double* tNear);
+};
+
+#endif  // _INSTANCE_ACCEL_H_
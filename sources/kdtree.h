@@ -2,8 +2,8 @@
 #define _KDTREE_H_
 
 #include <vector>
-#include <queue>
-#include <functional>
+#include <algorithm>
+#include <type_traits>
 
 enum KnnSearchType {
     EPSILON_BALL = 0x01,
@@ -22,53 +22,130 @@ struct KnnQuery {
     }
 };
 
-template <class Ty>
-class KdTree {
-private:
-    struct OrderedType {
-        double dist;
-        Ty t;
-        OrderedType(const double dist_, const Ty& t_)
-            : dist(dist_)
-            , t(t_)
-        {
-        }
+// --------------------------------------------------
+// Neighbours found by a kNN search
+// --------------------------------------------------
+// Indices of the points in the tree and their squared distances are kept in
+// a max-heap bounded by k. The buffer is reused across queries, so keep one
+// context per thread to search without heap allocations.
+class KnnQueryContext {
+public:
+    struct Neighbor {
+        double dist2;
+        int index;
 
-        bool operator<(const OrderedType& t) const {
-            return this->dist < t.dist;
-        }
-        bool operator>(const OrderedType& t) const {
-            return this->dist > t.dist;
+        bool operator<(const Neighbor& n) const {
+            return this->dist2 < n.dist2;
         }
     };
 
-    typedef std::priority_queue<OrderedType, std::vector<OrderedType>, std::less<OrderedType> > PriorityQueue;
+private:
+    std::vector<Neighbor> _neighbors;
 
-    struct KdTreeNode {
-        Ty point;
-        KdTreeNode* left;
-        KdTreeNode* right;
-        int axis;
+public:
+    KnnQueryContext()
+        : _neighbors()
+    {
+    }
 
-        KdTreeNode()
-            : point()
-            , left(NULL)
-            , right(NULL)
-            , axis(0)
-        {
+    inline void clear() { _neighbors.clear(); }
+    inline void reserve(int k) { _neighbors.reserve(k); }
+
+    inline int size() const { return (int)_neighbors.size(); }
+    inline int index(int i) const { return _neighbors[i].index; }
+    inline double squaredDistance(int i) const { return _neighbors[i].dist2; }
+
+    // Squared distance of the farthest neighbour
+    inline double maxSquaredDistance() const { return _neighbors.empty() ? 0.0 : _neighbors[0].dist2; }
+
+    // Add a neighbour, and drop the farthest one when there are more than k
+    // (k <= 0 for unbounded). The heap is not reordered otherwise.
+    inline void push(double dist2, int index, int k) {
+        const Neighbor n = { dist2, index };
+        if (k <= 0 || size() < k) {
+            _neighbors.push_back(n);
+            std::push_heap(_neighbors.begin(), _neighbors.end());
+        } else if (dist2 < _neighbors[0].dist2) {
+            std::pop_heap(_neighbors.begin(), _neighbors.end());
+            _neighbors.back() = n;
+            std::push_heap(_neighbors.begin(), _neighbors.end());
         }
-    };
+    }
+};
 
+// --------------------------------------------------
+// Points stored in the kd-tree
+// --------------------------------------------------
+// Points keep their own coordinates (operator[]) by default, and the points
+// passing the float test of a bucket are checked again with them in double.
+// Specialize it for the points which leave their positions to the tree
+// (such as CompactPhoton); they are searched at the float positions.
+template <class Ty>
+struct KdTreePointTraits {
+    static const bool hasCoordinates = true;
+};
+
+// --------------------------------------------------
+// Bucketed kd-tree
+// --------------------------------------------------
+// Points are stored in leaf buckets of 8 to 16 points. The tree over the
+// buckets is complete, i.e., children of the node i are 2i+1 and 2i+2, and
+// the buckets follow the split nodes in the same array order, so that no
+// child pointers are needed. Each node splits its subtree along the axis of
+// the largest extent of the subtree. Positions are also kept as floats in
+// three 16-byte aligned arrays (x, y and z) in the order of the buckets, and
+// the points of a bucket are tested four at a time with aligned SSE loads.
+template <class Ty>
+class KdTree {
+private:
+    template <class Point>
     struct AxisComparator {
         int dim;
         explicit AxisComparator(int d) : dim(d) {}
-        bool operator()(const Ty* t1, const Ty* t2) {
+        bool operator()(const Point* t1, const Point* t2) const {
             return (*t1)[dim] < (*t2)[dim];
         }
     };
 
-    KdTreeNode* _nodes;
-    int* _numCopies;
+    typedef std::integral_constant<bool, KdTreePointTraits<Ty>::hasCoordinates> HasCoordinates;
+
+    // Subtree whose construction is deferred to the parallel phase
+    struct BuildTask {
+        int nodeID;
+        int startLeaf, endLeaf;
+    };
+
+    // Node waiting for traversal with the squared distance to its split plane
+    struct StackItem {
+        int nodeID;
+        double dist2;
+    };
+
+    // Visitor of the k nearest search, which shrinks the radius once k points are found
+    struct KnnCollector {
+        KnnQueryContext* context;
+        int k;
+        double* epsilon2;
+
+        void operator()(int index, double dist2) const {
+            context->push(dist2, index, k);
+            if (k > 0 && context->size() == k) {
+                *epsilon2 = context->maxSquaredDistance();
+            }
+        }
+    };
+
+    static const int _maxLeafSize = 16;
+    static const int _maxStackSize = 64;    // Enough for 2^31 points
+    static const int _parallelGrain = 8192;
+
+    int _numLeaves;                         // Power of two
+    std::vector<Ty> _points;                // Points in the order of the buckets
+    float* _positions;                      // Float positions (x, y, z arrays of _numPadded each)
+    int _numPadded;                         // Number of the points rounded up to a multiple of 4
+    std::vector<double> _splits;            // Split positions of the nodes
+    std::vector<unsigned char> _axes;       // Split axes of the nodes
+    double _maxCoord;                       // Largest absolute coordinate (for the error of float positions)
 
 public:
     KdTree();
@@ -77,14 +154,77 @@ public:
 
     KdTree& operator=(const KdTree<Ty>& kdtree);
 
-    void construct(const std::vector<Ty>& points);
-    void knnSearch(const Ty& point, const KnnQuery& query, std::vector<Ty>* results) const;
+    // Construct the tree
+    // Each node takes the median of its subtree along the longest axis of
+    // the bounding box, where the median is chosen (with nth_element) so that
+    // the buckets get the same number of points. Top levels are split with
+    // parallel partitioning, and smaller subtrees are built concurrently.
+    // @param[in] points: any type with operator[] for coordinates, which is
+    //                    converted to Ty when it is stored in a bucket
+    template <class Point>
+    void construct(const std::vector<Point>& points);
+
+    // Search the k nearest points within the epsilon ball
+    // The indices of the points are set to the context (refer to them with point()).
+    // @param[in] query: KnnQuery with K_NEAREST and/or EPSILON_BALL
+    // @param[in] point: query position (any type with operator[] for coordinates)
+    // @param[out] context: found neighbours (cleared before the search)
+    template <class Point>
+    void knnSearch(const Point& point, const KnnQuery& query, KnnQueryContext* context) const;
+
+    // Search the nearest points and copy them
+    template <class Point>
+    void knnSearch(const Point& point, const KnnQuery& query, std::vector<Ty>* results) const;
+
+    // Visit all the points closer than the radius (in no particular order)
+    // The visitor is called as visitor(index, squared distance), where the
+    // index refers to point(). Nothing is allocated during the search.
+    // @param[in] radius2: squared search radius
+    template <class Point, class Visitor>
+    void rangeSearch(const Point& point, double radius2, Visitor& visitor) const;
 
     void release();
 
+    inline int size() const { return (int)_points.size(); }
+    inline const Ty& point(int index) const { return _points[index]; }
+
+    // Coordinate of the point rounded to float
+    inline float position(int index, int d) const { return _positions[d * _numPadded + index]; }
+
+    // Memory consumed by the points, their float positions, and the nodes (in bytes)
+    inline size_t memoryUsage() const {
+        return _points.size() * sizeof(Ty) + (size_t)_numPadded * 3 * sizeof(float) + _splits.size() * (sizeof(double) + sizeof(unsigned char));
+    }
+
 private:
-    KdTreeNode* constructRec(std::vector<const Ty*>& points, const int nodeID, const int startID, const int endID, const int dim);
-    void knnSearchRec(KdTreeNode* node, const Ty& point, KnnQuery& query, PriorityQueue* results) const;
+    template <class Point>
+    void constructRec(std::vector<const Point*>& points, const int nodeID, const int startLeaf, const int endLeaf, std::vector<BuildTask>* tasks);
+    // Visit the points closer than sqrt(*epsilon2), where the visitor may shrink epsilon2
+    template <class Point, class Visitor>
+    void search(const Point& point, double* epsilon2, Visitor& visitor) const;
+    template <class Point, class Visitor>
+    void searchLeaf(int leafID, const Point& point, const float query[3], double error, double* epsilon2, Visitor& visitor) const;
+
+    // Squared distance in double from the coordinates of the point, or from its float position
+    template <class Point>
+    inline double squaredDistance(int index, const Point& point, std::true_type) const {
+        const double dx = _points[index][0] - point[0];
+        const double dy = _points[index][1] - point[1];
+        const double dz = _points[index][2] - point[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+    template <class Point>
+    inline double squaredDistance(int index, const Point& point, std::false_type) const {
+        const double dx = position(index, 0) - point[0];
+        const double dy = position(index, 1) - point[1];
+        const double dz = position(index, 2) - point[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // First point of the bucket (or the end of the points when leafID == _numLeaves)
+    inline int leafStart(int leafID) const {
+        return static_cast<int>((long long)_points.size() * leafID / _numLeaves);
+    }
 };
 
 #include "kdtree_detail.h"
@@ -2,21 +2,36 @@
 #define _KDTREE_DETAIL_H_
 
 #include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <limits>
 #include <algorithm>
+#include <xmmintrin.h>
 
 #include "common.h"
+#include "parallel.h"
 
 template <class Ty>
 KdTree<Ty>::KdTree()
-    : _nodes(NULL)
-    , _numCopies(NULL)
+    : _numLeaves(0)
+    , _points()
+    , _positions(NULL)
+    , _numPadded(0)
+    , _splits()
+    , _axes()
+    , _maxCoord(0.0)
 {
 }
 
 template <class Ty>
 KdTree<Ty>::KdTree(const KdTree& kdtree)
-    : _nodes(NULL)
-    , _numCopies(NULL)
+    : _numLeaves(0)
+    , _points()
+    , _positions(NULL)
+    , _numPadded(0)
+    , _splits()
+    , _axes()
+    , _maxCoord(0.0)
 {
     this->operator=(kdtree);
 }
@@ -29,106 +44,297 @@ KdTree<Ty>::~KdTree()
 
 template <class Ty>
 KdTree<Ty>& KdTree<Ty>::operator=(const KdTree& kdtree) {
+    if (this == &kdtree) {
+        return *this;
+    }
+
     release();
-    _numCopies = kdtree._numCopies;
-    (*_numCopies) += 1;
-    _nodes = kdtree._nodes;
+    _numLeaves = kdtree._numLeaves;
+    _points = kdtree._points;
+    _numPadded = kdtree._numPadded;
+    if (kdtree._positions != NULL) {
+        _positions = (float*)align_alloc(sizeof(float) * _numPadded * 3, 16);
+        memcpy(_positions, kdtree._positions, sizeof(float) * _numPadded * 3);
+    }
+    _splits = kdtree._splits;
+    _axes = kdtree._axes;
+    _maxCoord = kdtree._maxCoord;
+    return *this;
 }
 
 template <class Ty>
 void KdTree<Ty>::release() {
-    if (_numCopies != NULL) {
-        if ((*_numCopies) == 0) {
-            delete[] _nodes;
-            delete _numCopies;
-            _nodes = NULL;
-            _numCopies = NULL;
-        } else {
-            (*_numCopies) -= 1;
-        }
-    }
+    _numLeaves = 0;
+    std::vector<Ty>().swap(_points);
+    align_free(_positions);
+    _positions = NULL;
+    _numPadded = 0;
+    std::vector<double>().swap(_splits);
+    std::vector<unsigned char>().swap(_axes);
+    _maxCoord = 0.0;
 }
 
 template <class Ty>
-void KdTree<Ty>::construct(const std::vector<Ty>& points) {
+template <class Point>
+void KdTree<Ty>::construct(const std::vector<Point>& points) {
     // Release previous tree
     release();
 
-    // Compute tree size
     const int numPoints = static_cast<int>(points.size());
-    int numNodes;
-    for (numNodes = 1; numNodes < numPoints; numNodes <<= 1) ;
+    if (numPoints == 0) {
+        return;
+    }
 
-    _nodes = new KdTreeNode[numNodes];
+    // Buckets get numPoints / _numLeaves points, i.e., 8 to 16 points unless the tree is tiny
+    _numLeaves = 1;
+    while ((long long)_numLeaves * _maxLeafSize < numPoints) _numLeaves <<= 1;
 
-    std::vector<const Ty*> pointers(numPoints);
-    for (int i = 0; i < numPoints; i++) {
+    // Lanes past the last point are masked out in the search
+    _numPadded = (numPoints + 3) & ~3;
+    _positions = (float*)align_alloc(sizeof(float) * _numPadded * 3, 16);
+    memset(_positions, 0, sizeof(float) * _numPadded * 3);
+
+    _points.resize(numPoints);
+    _splits.resize(_numLeaves - 1);
+    _axes.resize(_numLeaves - 1);
+
+    std::vector<const Point*> pointers(numPoints);
+    ompfor (int i = 0; i < numPoints; i++) {
         pointers[i] = &points[i];
     }
-    constructRec(pointers, 0, 0, numPoints, 0);
-    _numCopies = new int(0);
+
+    std::vector<BuildTask> tasks;
+    constructRec(pointers, 0, 0, _numLeaves, numPoints > _parallelGrain ? &tasks : NULL);
+
+    // Subtrees are stored in disjoint nodes, so they are built independently.
+    // Larger subtrees are scheduled first.
+    const int numTasks = (int)tasks.size();
+    std::vector<std::pair<int, int> > order(numTasks);
+    for (int i = 0; i < numTasks; i++) {
+        order[i] = std::make_pair(-(tasks[i].endLeaf - tasks[i].startLeaf), i);
+    }
+    std::sort(order.begin(), order.end());
+
+    ompfor_dynamic (int k = 0; k < numTasks; k++) {
+        const BuildTask& task = tasks[order[k].second];
+        constructRec(pointers, task.nodeID, task.startLeaf, task.endLeaf, NULL);
+    }
+
+    for (int d = 0; d < 3; d++) {
+        for (int i = 0; i < numPoints; i++) {
+            _maxCoord = std::max(_maxCoord, std::abs(static_cast<double>(position(i, d))));
+        }
+    }
 }
 
+namespace kdtree {
+
+    // Bounding box of the points in the range
+    template <class Ty>
+    void mergePoints(const std::vector<const Ty*>& points, int startID, int endID, double posMin[3], double posMax[3]) {
+        for (int i = startID; i < endID; i++) {
+            for (int d = 0; d < 3; d++) {
+                posMin[d] = std::min(posMin[d], (*points[i])[d]);
+                posMax[d] = std::max(posMax[d], (*points[i])[d]);
+            }
+        }
+    }
+
+    // Axis of the largest extent of the points (computed in parallel for large ranges)
+    template <class Ty>
+    int longestAxis(const std::vector<const Ty*>& points, int startID, int endID, int grain) {
+        double posMin[3] = { INFTY, INFTY, INFTY };
+        double posMax[3] = { -INFTY, -INFTY, -INFTY };
+        if (endID - startID <= grain) {
+            mergePoints(points, startID, endID, posMin, posMax);
+        } else {
+            const int numChunks = parallel::numChunks();
+            std::vector<double> mins(numChunks * 3, INFTY);
+            std::vector<double> maxs(numChunks * 3, -INFTY);
+            ompfor (int c = 0; c < numChunks; c++) {
+                const int lo = startID + static_cast<int>((long long)(endID - startID) * c / numChunks);
+                const int hi = startID + static_cast<int>((long long)(endID - startID) * (c + 1) / numChunks);
+                mergePoints(points, lo, hi, &mins[c * 3], &maxs[c * 3]);
+            }
+
+            for (int c = 0; c < numChunks; c++) {
+                for (int d = 0; d < 3; d++) {
+                    posMin[d] = std::min(posMin[d], mins[c * 3 + d]);
+                    posMax[d] = std::max(posMax[d], maxs[c * 3 + d]);
+                }
+            }
+        }
+
+        int axis = 0;
+        for (int d = 1; d < 3; d++) {
+            if (posMax[d] - posMin[d] > posMax[axis] - posMin[axis]) axis = d;
+        }
+        return axis;
+    }
+
+}  // namespace kdtree
+
 template <class Ty>
-typename KdTree<Ty>::KdTreeNode* KdTree<Ty>::constructRec(std::vector<const Ty*>& points, const int nodeID, const int startID, const int endID, const int dim) {
-    if (startID >= endID) {
-        return NULL;
+template <class Point>
+void KdTree<Ty>::constructRec(std::vector<const Point*>& points, const int nodeID, const int startLeaf, const int endLeaf, std::vector<BuildTask>* tasks) {
+    const int startID = leafStart(startLeaf);
+    const int endID = leafStart(endLeaf);
+
+    // Copy the points of the bucket and their float positions
+    if (endLeaf - startLeaf == 1) {
+        for (int i = startID; i < endID; i++) {
+            _points[i] = Ty(*points[i]);
+            for (int d = 0; d < 3; d++) {
+                _positions[d * _numPadded + i] = static_cast<float>((*points[i])[d]);
+            }
+        }
+        return;
+    }
+
+    if (tasks != NULL && endID - startID <= _parallelGrain) {
+        BuildTask task = { nodeID, startLeaf, endLeaf };
+        tasks->push_back(task);
+        return;
     }
 
-    std::sort(points.begin() + startID, points.begin() + endID, AxisComparator(dim));
+    // Split along the longest axis of the bounding box
+    const int axis = kdtree::longestAxis(points, startID, endID, _parallelGrain);
+    const int midLeaf = (startLeaf + endLeaf) / 2;
+    const int mid = leafStart(midLeaf);
+    if (tasks != NULL && parallel::numChunks() > 1) {
+        parallel::nthElement(points.begin() + startID, points.begin() + mid, points.begin() + endID, AxisComparator<Point>(axis), _parallelGrain);
+    } else {
+        std::nth_element(points.begin() + startID, points.begin() + mid, points.begin() + endID, AxisComparator<Point>(axis));
+    }
 
-    int mid = (startID + endID) / 2;
-    KdTreeNode* node = &_nodes[nodeID];
-    node->axis = dim;
-    node->point = (*points[mid]);
-    node->left = constructRec(points, nodeID * 2 + 1, startID, mid, (dim + 1) % 3);
-    node->right = constructRec(points, nodeID * 2 + 2, mid + 1, endID, (dim + 1) % 3);
-    return node;
+    _splits[nodeID] = (*points[mid])[axis];
+    _axes[nodeID] = static_cast<unsigned char>(axis);
+    constructRec(points, nodeID * 2 + 1, startLeaf, midLeaf, tasks);
+    constructRec(points, nodeID * 2 + 2, midLeaf, endLeaf, tasks);
 }
 
 template <class Ty>
-void KdTree<Ty>::knnSearch(const Ty& point, const KnnQuery& query, std::vector<Ty>* results) const {
-    PriorityQueue que; 
-    KnnQuery qq = query;
-    if ((qq.type & EPSILON_BALL) == 0) qq.epsilon = INFTY;
+template <class Point>
+void KdTree<Ty>::knnSearch(const Point& point, const KnnQuery& query, KnnQueryContext* context) const {
+    context->clear();
 
-    knnSearchRec(&_nodes[0], point, qq, &que);
+    // The search radius shrinks to the farthest of the k neighbours once k are found
+    const int k = (query.type & K_NEAREST) != 0 ? query.k : 0;
+    double epsilon2 = (query.type & EPSILON_BALL) != 0 ? query.epsilon * query.epsilon : INFTY;
+    if (k > 0) context->reserve(k);
 
-    while (!que.empty()) {
-        results->push_back(que.top().t);
-        que.pop();
-    }
+    KnnCollector collector = { context, k, &epsilon2 };
+    search(point, &epsilon2, collector);
+}
+
+template <class Ty>
+template <class Point, class Visitor>
+void KdTree<Ty>::rangeSearch(const Point& point, double radius2, Visitor& visitor) const {
+    search(point, &radius2, visitor);
 }
 
 template <class Ty>
-void KdTree<Ty>::knnSearchRec(typename KdTree<Ty>::KdTreeNode* node, const Ty& point, KnnQuery& query, PriorityQueue* results) const {
-    if (node == NULL) {
+template <class Point, class Visitor>
+void KdTree<Ty>::search(const Point& point, double* epsilon2, Visitor& visitor) const {
+    if (_points.empty()) {
         return;
     }
 
-    const double dist = (node->point - point).norm();
-    if (dist < query.epsilon) {
-        results->push(OrderedType(dist, node->point));
-        if ((query.type & K_NEAREST) != 0 && results->size() > query.k) {
-            results->pop();
+    // Bound of the distance error caused by the float positions
+    double magnitude = _maxCoord;
+    float fpoint[3];
+    for (int d = 0; d < 3; d++) {
+        magnitude = std::max(magnitude, std::abs(point[d]));
+        fpoint[d] = static_cast<float>(point[d]);
+    }
+    const double error = std::ldexp(magnitude, -20);
 
-            query.epsilon = (results->top().t - point).norm();
+    // Nodes are numbered from the root, and the buckets follow the split nodes
+    const int numSplitNodes = _numLeaves - 1;
+    StackItem stack[_maxStackSize];
+    int stackSize = 0;
+    int nodeID = 0;
+    for (;;) {
+        if (nodeID < numSplitNodes) {
+            // Go down to the near side, and leave the far side if the ball crosses the plane
+            const int axis = _axes[nodeID];
+            const double delta = point[axis] - _splits[nodeID];
+            const double dist2 = delta * delta;
+            if (dist2 <= *epsilon2) {
+                stack[stackSize].nodeID = delta < 0.0 ? nodeID * 2 + 2 : nodeID * 2 + 1;
+                stack[stackSize].dist2 = dist2;
+                stackSize++;
+            }
+            nodeID = delta < 0.0 ? nodeID * 2 + 1 : nodeID * 2 + 2;
+            continue;
         }
-    }
 
-    int axis = node->axis;
-    double delta = point[axis] - node->point[axis];
-    if (delta < 0.0) {
-        knnSearchRec(node->left, point, query, results);
-        if (std::abs(delta) <= query.epsilon) {
-            knnSearchRec(node->right, point, query, results);
+        searchLeaf(nodeID - numSplitNodes, point, fpoint, error, epsilon2, visitor);
+
+        // Skip the nodes which got farther than the shrunk radius
+        nodeID = -1;
+        while (stackSize > 0) {
+            const StackItem& item = stack[--stackSize];
+            if (item.dist2 <= *epsilon2) {
+                nodeID = item.nodeID;
+                break;
+            }
         }
-    } else {
-        knnSearchRec(node->right, point, query, results);
-        if (std::abs(delta) <= query.epsilon) {
-            knnSearchRec(node->left, point, query, results);            
+
+        if (nodeID < 0) {
+            break;
         }
     }
 }
 
+template <class Ty>
+template <class Point, class Visitor>
+void KdTree<Ty>::searchLeaf(int leafID, const Point& point, const float query[3], double error, double* epsilon2, Visitor& visitor) const {
+    const int startID = leafStart(leafID);
+    const int endID = leafStart(leafID + 1);
+
+    // Float distances are compared with a slightly larger radius, and the
+    // points which pass are checked again in double, so that the result is
+    // the same as the search in double.
+    const double radius = std::sqrt(*epsilon2) + error;
+    const double threshold = radius * radius * (1.0 + std::ldexp(1.0, -18));
+    const __m128 simdThreshold = _mm_set1_ps(threshold < FLT_MAX ? static_cast<float>(threshold) : std::numeric_limits<float>::infinity());
+    const __m128 qx = _mm_set1_ps(query[0]);
+    const __m128 qy = _mm_set1_ps(query[1]);
+    const __m128 qz = _mm_set1_ps(query[2]);
+
+    // Groups of four start at multiples of 4, so the loads are aligned. The
+    // lanes of the neighbouring buckets (or past the last point) are masked out.
+    const float* xs = _positions;
+    const float* ys = _positions + _numPadded;
+    const float* zs = _positions + _numPadded * 2;
+    for (int i = startID & ~3; i < endID; i += 4) {
+        const __m128 dx = _mm_sub_ps(_mm_load_ps(xs + i), qx);
+        const __m128 dy = _mm_sub_ps(_mm_load_ps(ys + i), qy);
+        const __m128 dz = _mm_sub_ps(_mm_load_ps(zs + i), qz);
+        const __m128 dist2s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        const int lanes = ((1 << std::min(endID - i, 4)) - 1) & ~((1 << std::max(startID - i, 0)) - 1);
+        const int mask = _mm_movemask_ps(_mm_cmple_ps(dist2s, simdThreshold)) & lanes;
+
+        for (int j = 0; j < 4; j++) {
+            if ((mask & (1 << j)) == 0) continue;
+
+            const double dist2 = squaredDistance(i + j, point, HasCoordinates());
+            if (dist2 < *epsilon2) {
+                visitor(i + j, dist2);
+            }
+        }
+    }
+}
+
+template <class Ty>
+template <class Point>
+void KdTree<Ty>::knnSearch(const Point& point, const KnnQuery& query, std::vector<Ty>* results) const {
+    KnnQueryContext context;
+    knnSearch(point, query, &context);
+    for (int i = 0; i < context.size(); i++) {
+        results->push_back(_points[context.index(i)]);
+    }
+}
+
 #endif  // _KDTREE_DETAIL_H_
@@ -115,7 +115,8 @@ void setScene(Scene* scene, Camera* camera, int imageWidth, int imageHeight) {
         }
     }
 
-    // Set accelerator
+    // Set accelerator (cached for the next run)
+    scene->setAcceleratorCache(CACHE_DIRECTORY);
     scene->setAccelerator();
 
     // Set camera
@@ -0,0 +1,841 @@
+#include "obvh_accel.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "common.h"
+#include "bbox.h"
+
+namespace {
+
+    // Same constants as the 4-wide kernels, so that both find the same hits.
+    // 8-wide constants are made inside the kernels because initializing
+    // them statically would execute AVX instructions on any CPU.
+    const float inff = (float)1.0e20;
+
+
+    // Ray broadcast to eight lanes for SIMD arithmetic
+    struct SimdRay8 {
+        __m256 orig[3];     // origin
+        __m256 idir[3];     // inverse direction
+        __m256 shear[3];    // shear and scale which map the direction to +z (Sx, Sy, Sz)
+        int axes[3];        // axes permuted so that the direction is the longest along axes[2]
+        int sgn[3];         // signs of ray direction (pos -> 0, neg -> 1)
+    };
+
+    avx_target inline void setSimdRay8(const Ray& ray, SimdRay8* simdRay) {
+        const Vector3D orig = ray.origin();
+        const Vector3D dir = ray.direction();
+
+        for (int d = 0; d < 3; d++) {
+            const float idir = dir[d] == 0.0 ? inff : (float)(1.0 / dir[d]);
+            simdRay->orig[d] = _mm256_set1_ps(static_cast<float>(orig[d]));
+            simdRay->idir[d] = _mm256_set1_ps(idir);
+            simdRay->sgn[d] = idir > 0.0f ? 0 : 1;
+        }
+
+        float shear[3];
+        accel::shearRay(dir, simdRay->axes, shear);
+        for (int d = 0; d < 3; d++) {
+            simdRay->shear[d] = _mm256_set1_ps(shear[d]);
+        }
+    }
+
+    avx_target inline __m256 simdAbs8(const __m256& a) {
+        return _mm256_max_ps(a, _mm256_sub_ps(_mm256_setzero_ps(), a));
+    }
+
+    avx_target inline __m256 simdMax8(const __m256& a, const __m256& b, const __m256& c) {
+        return _mm256_max_ps(_mm256_max_ps(a, b), c);
+    }
+
+    // Slab test for the eight child boxes of a node
+    // The far distances are scaled by the error bound as the 4-wide test does.
+    // @return mask of the boxes hit closer than tFar
+    avx_target inline __m256 intersectBoxes8(const float childBoxes[2][3][8], const SimdRay8& ray, float tFar, __m256* tNear) {
+        __m256 tMin = _mm256_setzero_ps();
+        __m256 tMax = _mm256_set1_ps(tFar);
+        for (int d = 0; d < 3; d++) {
+            tMin = _mm256_max_ps(tMin, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(childBoxes[ray.sgn[d]][d]), ray.orig[d]), ray.idir[d]));
+            tMax = _mm256_min_ps(tMax, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(childBoxes[1 - ray.sgn[d]][d]), ray.orig[d]), ray.idir[d]));
+        }
+        *tNear = tMin;
+        return _mm256_cmp_ps(_mm256_mul_ps(tMax, _mm256_set1_ps(accel::boxErrorScale())), tMin, _CMP_GE_OQ);
+    }
+
+    // Watertight test for eight triangles at once
+    // Operations are in the same order as the 4-wide test to give the same results.
+    // @return bit mask of the triangles hit between the error bound and tFar
+    avx_target inline int intersectTriangles8(const float p0[3][8], const float p1[3][8], const float p2[3][8], const int ids[8],
+                                              const SimdRay8& ray, float tFar, float ts[8], float us[8], float vs[8]) {
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 zero = _mm256_setzero_ps();
+        const int kx = ray.axes[0];
+        const int ky = ray.axes[1];
+        const int kz = ray.axes[2];
+
+        const __m256 az = _mm256_sub_ps(_mm256_load_ps(p0[kz]), ray.orig[kz]);
+        const __m256 bz = _mm256_sub_ps(_mm256_load_ps(p1[kz]), ray.orig[kz]);
+        const __m256 cz = _mm256_sub_ps(_mm256_load_ps(p2[kz]), ray.orig[kz]);
+        const __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p0[kx]), ray.orig[kx]), _mm256_mul_ps(ray.shear[0], az));
+        const __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p0[ky]), ray.orig[ky]), _mm256_mul_ps(ray.shear[1], az));
+        const __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p1[kx]), ray.orig[kx]), _mm256_mul_ps(ray.shear[0], bz));
+        const __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p1[ky]), ray.orig[ky]), _mm256_mul_ps(ray.shear[1], bz));
+        const __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p2[kx]), ray.orig[kx]), _mm256_mul_ps(ray.shear[0], cz));
+        const __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(p2[ky]), ray.orig[ky]), _mm256_mul_ps(ray.shear[1], cz));
+
+        __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+        __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+        __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+        // Edge functions exactly zero are recomputed in double as the 4-wide test does
+        const __m256 valid = _mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_load_si256((const __m256i*)ids)), zero, _CMP_GE_OQ);
+        const __m256 onEdge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_EQ_OQ), _mm256_cmp_ps(e1, zero, _CMP_EQ_OQ)),
+                                           _mm256_cmp_ps(e2, zero, _CMP_EQ_OQ));
+        const int edgeMask = _mm256_movemask_ps(_mm256_and_ps(valid, onEdge));
+        if (edgeMask != 0) {
+            align_attrib(float, 32) vals[9][8];
+            const __m256 regs[9] = { ax, ay, bx, by, cx, cy, e0, e1, e2 };
+            for (int i = 0; i < 9; i++) {
+                _mm256_store_ps(vals[i], regs[i]);
+            }
+            for (int k = 0; k < 8; k++) {
+                if ((edgeMask & (1 << k)) == 0) continue;
+                vals[6][k] = accel::edgeFunction(vals[4][k], vals[5][k], vals[2][k], vals[3][k]);
+                vals[7][k] = accel::edgeFunction(vals[0][k], vals[1][k], vals[4][k], vals[5][k]);
+                vals[8][k] = accel::edgeFunction(vals[2][k], vals[3][k], vals[0][k], vals[1][k]);
+            }
+            e0 = _mm256_load_ps(vals[6]);
+            e1 = _mm256_load_ps(vals[7]);
+            e2 = _mm256_load_ps(vals[8]);
+        }
+
+        // Unused lanes have zero determinants and are rejected here
+        const __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+        const __m256 neg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ), _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+                                        _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+        const __m256 pos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ), _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+                                        _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+        __m256 mask = _mm256_andnot_ps(_mm256_and_ps(neg, pos), _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+        if (_mm256_movemask_ps(mask) == 0) {
+            return 0;
+        }
+
+        const __m256 azs = _mm256_mul_ps(ray.shear[2], az);
+        const __m256 bzs = _mm256_mul_ps(ray.shear[2], bz);
+        const __m256 czs = _mm256_mul_ps(ray.shear[2], cz);
+        const __m256 invdet = _mm256_div_ps(one, det);
+        const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, azs), _mm256_mul_ps(e1, bzs)), _mm256_mul_ps(e2, czs)), invdet);
+
+        // Conservative bound of the rounding error of t
+        const __m256 gamma2 = _mm256_set1_ps(accel::errorGamma(2));
+        const __m256 gamma3 = _mm256_set1_ps(accel::errorGamma(3));
+        const __m256 gamma5 = _mm256_set1_ps(accel::errorGamma(5));
+        const __m256 maxZ = simdMax8(simdAbs8(azs), simdAbs8(bzs), simdAbs8(czs));
+        const __m256 maxX = simdMax8(simdAbs8(ax), simdAbs8(bx), simdAbs8(cx));
+        const __m256 maxY = simdMax8(simdAbs8(ay), simdAbs8(by), simdAbs8(cy));
+        const __m256 maxE = simdMax8(simdAbs8(e0), simdAbs8(e1), simdAbs8(e2));
+        const __m256 deltaZ = _mm256_mul_ps(gamma3, maxZ);
+        const __m256 deltaX = _mm256_mul_ps(gamma5, _mm256_add_ps(maxX, maxZ));
+        const __m256 deltaY = _mm256_mul_ps(gamma5, _mm256_add_ps(maxY, maxZ));
+        const __m256 deltaE = _mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(gamma2, maxX), maxY),
+                                                                                          _mm256_mul_ps(deltaY, maxX)), _mm256_mul_ps(deltaX, maxY)));
+        const __m256 deltaT = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(3.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(gamma3, maxE), maxZ),
+                                                                                                    _mm256_mul_ps(deltaE, maxZ)), _mm256_mul_ps(deltaZ, maxE))),
+                                            simdAbs8(invdet));
+
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, deltaT, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(tFar), _CMP_LT_OQ));
+
+        const int hitMask = _mm256_movemask_ps(mask);
+        if (hitMask != 0) {
+            _mm256_storeu_ps(ts, t);
+            _mm256_storeu_ps(us, _mm256_mul_ps(e1, invdet));
+            _mm256_storeu_ps(vs, _mm256_mul_ps(e2, invdet));
+        }
+        return hitMask;
+    }
+
+}
+
+OBVHAccel::OBVHAccel()
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+}
+
+OBVHAccel::OBVHAccel(const OBVHAccel& obvh)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+    this->operator=(obvh);
+}
+
+OBVHAccel::OBVHAccel(OBVHAccel&& obvh)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
+{
+    this->operator=(std::move(obvh));
+}
+
+OBVHAccel::~OBVHAccel()
+{
+    release();
+}
+
+OBVHAccel& OBVHAccel::operator=(const OBVHAccel& obvh) {
+    if (this == &obvh) return *this;
+
+    release();
+
+    if (obvh._numNodes > 0) {
+        _nodes = (OBVHNode*)align_alloc(sizeof(OBVHNode) * obvh._numNodes, 64);
+        memcpy((void*)_nodes, (void*)obvh._nodes, sizeof(OBVHNode) * obvh._numNodes);
+    }
+    _numNodes = obvh._numNodes;
+
+    if (obvh._numPackets > 0) {
+        _packets = (TrianglePacket*)align_alloc(sizeof(TrianglePacket) * obvh._numPackets, 32);
+        memcpy((void*)_packets, (void*)obvh._packets, sizeof(TrianglePacket) * obvh._numPackets);
+    }
+    _numPackets = obvh._numPackets;
+    _stackSize = obvh._stackSize;
+    _buildType = obvh._buildType;
+    _buildCost = obvh._buildCost;
+    _triangles = obvh._triangles;
+
+    return *this;
+}
+
+OBVHAccel& OBVHAccel::operator=(OBVHAccel&& obvh) {
+    if (this == &obvh) return *this;
+
+    release();
+
+    _nodes = obvh._nodes;
+    _numNodes = obvh._numNodes;
+    _packets = obvh._packets;
+    _numPackets = obvh._numPackets;
+    _stackSize = obvh._stackSize;
+    _buildType = obvh._buildType;
+    _buildCost = obvh._buildCost;
+    _triangles = std::move(obvh._triangles);
+    _mappedFile = std::move(obvh._mappedFile);
+    obvh._nodes = NULL;
+    obvh._numNodes = 0;
+    obvh._packets = NULL;
+    obvh._numPackets = 0;
+
+    return *this;
+}
+
+void OBVHAccel::release() {
+    // Nodes and packets loaded from a cache are unmapped with the file
+    if (_mappedFile == NULL) {
+        align_free(_nodes);
+        align_free(_packets);
+    }
+    _mappedFile.reset();
+    _nodes = NULL;
+    _numNodes = 0;
+    _packets = NULL;
+    _numPackets = 0;
+    _stackSize = 0;
+    _triangles.clear();
+}
+
+bool OBVHAccel::isSupported() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx     = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    // The OS must save the upper halves of the YMM registers
+    return (_xgetbv(0) & 0x6) == 0x6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") != 0;
+#endif
+}
+
+void OBVHAccel::construct(const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    static_assert(sizeof(OBVHNode) == 256, "OBVHNode must fit into four cache lines");
+    static_assert(sizeof(TrianglePacket) % 32 == 0, "TrianglePacket must keep 32-byte alignment");
+
+    release();
+
+    QBVHAccel qbvh;
+    qbvh.construct(triangles, buildType);
+
+    // Number of triangles under each QBVH node decides which subtrees become single leaves
+    std::vector<int> subtreeSizes(qbvh._numNodes, 0);
+    subtreeSizeRec(qbvh, 0, subtreeSizes);
+
+    std::vector<OBVHNode> nodes;
+    std::vector<TrianglePacket> packets;
+    nodes.reserve(qbvh._numNodes / 2 + 1);
+    packets.reserve(qbvh._numPackets);
+    collapseRec(qbvh, 0, subtreeSizes, nodes, packets);
+
+    _numNodes = (int)nodes.size();
+    _nodes = (OBVHNode*)align_alloc(sizeof(OBVHNode) * _numNodes, 64);
+    memcpy((void*)_nodes, (void*)&nodes[0], sizeof(OBVHNode) * _numNodes);
+
+    _numPackets = (int)packets.size();
+    if (_numPackets > 0) {
+        _packets = (TrianglePacket*)align_alloc(sizeof(TrianglePacket) * _numPackets, 32);
+        memcpy((void*)_packets, (void*)&packets[0], sizeof(TrianglePacket) * _numPackets);
+    }
+
+    _triangles = std::move(qbvh._triangles);
+
+    // Each internal node on the path from the root leaves at most seven siblings on the stack
+    _stackSize = 7 * depthRec(0) + 1;
+
+    _buildType = buildType;
+    _buildCost = sahCost();
+}
+
+bool OBVHAccel::refit(const std::vector<Triangle>& triangles, double maxCostRatio) {
+    Assertion(triangles.size() == _triangles.size(), "Number of triangles is changed after construction");
+
+    _triangles = triangles;
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    ompfor (int i = 0; i < _numPackets; i++) {
+        std::vector<int> ids;
+        for (int k = 0; k < 8 && _packets[i].ids[k] >= 0; k++) {
+            ids.push_back(_packets[i].ids[k]);
+        }
+        setPacket(_triangles, ids, &_packets[i]);
+    }
+
+    // Children are always stored after their parents (see collapseRec)
+    std::vector<BBox> nodeBoxes(_numNodes);
+    for (int i = _numNodes - 1; i >= 0; i--) {
+        OBVHNode& node = _nodes[i];
+        for (int c = 0; c < 8; c++) {
+            const unsigned int entry = node.children[c];
+            if (entry == QBVHAccel::_emptyLeaf) continue;
+
+            BBox box;
+            if (QBVHAccel::isLeaf(entry)) {
+                const TrianglePacket& packet = _packets[QBVHAccel::leafStart(entry)];
+                for (int k = 0; k < QBVHAccel::leafCount(entry); k++) {
+                    box.merge(BBox::fromTriangle(_triangles[packet.ids[k]]));
+                }
+            } else {
+                box = nodeBoxes[entry];
+            }
+            nodeBoxes[i].merge(box);
+
+            for (int d = 0; d < 3; d++) {
+                node.childBoxes[0][d][c] = static_cast<float>(box.posMin()[d]);
+                node.childBoxes[1][d][c] = static_cast<float>(box.posMax()[d]);
+            }
+        }
+    }
+
+    if (sahCost() > maxCostRatio * _buildCost) {
+        construct(triangles, _buildType);
+        return true;
+    }
+    return false;
+}
+
+int OBVHAccel::subtreeSizeRec(const QBVHAccel& qbvh, unsigned int entry, std::vector<int>& subtreeSizes) {
+    if (QBVHAccel::isLeaf(entry)) {
+        return entry == QBVHAccel::_emptyLeaf ? 0 : QBVHAccel::leafCount(entry);
+    }
+
+    int count = 0;
+    for (int c = 0; c < 4; c++) {
+        count += subtreeSizeRec(qbvh, qbvh._nodes[entry].children[c], subtreeSizes);
+    }
+    subtreeSizes[entry] = count;
+    return count;
+}
+
+void OBVHAccel::gatherTriangles(const QBVHAccel& qbvh, unsigned int entry, std::vector<int>* ids) {
+    if (QBVHAccel::isLeaf(entry)) {
+        if (entry == QBVHAccel::_emptyLeaf) return;
+
+        const QBVHAccel::TrianglePacket& packet = qbvh._packets[QBVHAccel::leafStart(entry)];
+        for (int k = 0; k < QBVHAccel::leafCount(entry); k++) {
+            ids->push_back(packet.ids[k]);
+        }
+        return;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        gatherTriangles(qbvh, qbvh._nodes[entry].children[c], ids);
+    }
+}
+
+unsigned int OBVHAccel::collapseRec(const QBVHAccel& qbvh, unsigned int qnodeID, const std::vector<int>& subtreeSizes,
+                                    std::vector<OBVHNode>& nodes, std::vector<TrianglePacket>& packets) const {
+    // Children of the QBVH node are opened (replaced with their own children)
+    // while they fit into eight slots. Larger boxes are opened first,
+    // and subtrees which fit into a packet are never opened.
+    std::vector<std::pair<unsigned int, BBox> > items;
+    const QBVHAccel::QBVHNode& qnode = qbvh._nodes[qnodeID];
+    for (int c = 0; c < 4; c++) {
+        if (qnode.children[c] != QBVHAccel::_emptyLeaf) {
+            items.push_back(std::make_pair(qnode.children[c], QBVHAccel::childBox(qnode, c)));
+        }
+    }
+
+    for (;;) {
+        int bestID = -1;
+        double bestArea = -1.0;
+        for (int i = 0; i < (int)items.size(); i++) {
+            const unsigned int entry = items[i].first;
+            if (QBVHAccel::isLeaf(entry) || subtreeSizes[entry] <= _maxNodeSize) continue;
+
+            int numChildren = 0;
+            for (int c = 0; c < 4; c++) {
+                if (qbvh._nodes[entry].children[c] != QBVHAccel::_emptyLeaf) numChildren++;
+            }
+            if (items.size() - 1 + numChildren > 8) continue;
+
+            const double area = items[i].second.area();
+            if (area > bestArea) {
+                bestID = i;
+                bestArea = area;
+            }
+        }
+        if (bestID < 0) break;
+
+        const QBVHAccel::QBVHNode& opened = qbvh._nodes[items[bestID].first];
+        std::vector<std::pair<unsigned int, BBox> > children;
+        for (int c = 0; c < 4; c++) {
+            if (opened.children[c] != QBVHAccel::_emptyLeaf) {
+                children.push_back(std::make_pair(opened.children[c], QBVHAccel::childBox(opened, c)));
+            }
+        }
+        items.erase(items.begin() + bestID);
+        items.insert(items.begin() + bestID, children.begin(), children.end());
+    }
+
+    const unsigned int nodeID = static_cast<unsigned int>(nodes.size());
+    nodes.push_back(OBVHNode());
+
+    // Empty slots have inverted boxes and are never entered
+    OBVHNode node;
+    memset(&node, 0, sizeof(OBVHNode));
+    for (int i = 0; i < 8; i++) {
+        for (int d = 0; d < 3; d++) {
+            node.childBoxes[0][d][i] = inff;
+            node.childBoxes[1][d][i] = -inff;
+        }
+        node.children[i] = QBVHAccel::_emptyLeaf;
+    }
+
+    for (int i = 0; i < (int)items.size(); i++) {
+        const unsigned int entry = items[i].first;
+        const BBox& box = items[i].second;
+        for (int d = 0; d < 3; d++) {
+            node.childBoxes[0][d][i] = static_cast<float>(box.posMin()[d]);
+            node.childBoxes[1][d][i] = static_cast<float>(box.posMax()[d]);
+        }
+
+        if (QBVHAccel::isLeaf(entry) || subtreeSizes[entry] <= _maxNodeSize) {
+            // Spatial splits (SBVH) may put both parts of a triangle in the subtree
+            std::vector<int> ids;
+            gatherTriangles(qbvh, entry, &ids);
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            if (ids.empty()) continue;
+
+            packets.push_back(TrianglePacket());
+            setPacket(qbvh._triangles, ids, &packets.back());
+            node.children[i] = QBVHAccel::leafEntry(static_cast<int>(packets.size() - 1), (int)ids.size());
+        } else {
+            node.children[i] = collapseRec(qbvh, entry, subtreeSizes, nodes, packets);
+        }
+    }
+
+    nodes[nodeID] = node;
+    return nodeID;
+}
+
+void OBVHAccel::setPacket(const std::vector<Triangle>& triangles, const std::vector<int>& ids, TrianglePacket* packet) {
+    const int count = (int)ids.size();
+    Assertion(count <= 8, "Triangle packet can store at most 8 triangles");
+
+    memset(packet, 0, sizeof(TrianglePacket));
+    for (int k = 0; k < 8; k++) {
+        if (k >= count) {
+            packet->ids[k] = -1;
+            continue;
+        }
+
+        const Triangle& tri = triangles[ids[k]];
+        for (int d = 0; d < 3; d++) {
+            packet->p0[d][k] = static_cast<float>(tri.p0()[d]);
+            packet->p1[d][k] = static_cast<float>(tri.p1()[d]);
+            packet->p2[d][k] = static_cast<float>(tri.p2()[d]);
+        }
+        packet->ids[k] = ids[k];
+    }
+}
+
+int OBVHAccel::depthRec(int nodeID) const {
+    int depth = 0;
+    for (int i = 0; i < 8; i++) {
+        const unsigned int child = _nodes[nodeID].children[i];
+        if (!QBVHAccel::isLeaf(child)) {
+            depth = std::max(depth, depthRec(child));
+        }
+    }
+    return depth + 1;
+}
+
+BBox OBVHAccel::childBox(const OBVHNode& node, int i) {
+    return BBox(node.childBoxes[0][0][i], node.childBoxes[0][1][i], node.childBoxes[0][2][i],
+                node.childBoxes[1][0][i], node.childBoxes[1][1][i], node.childBoxes[1][2][i]);
+}
+
+double OBVHAccel::sahCost() const {
+    if (_numNodes == 0) {
+        return 0.0;
+    }
+
+    BBox rootBox;
+    for (int i = 0; i < 8; i++) {
+        if (_nodes[0].children[i] != QBVHAccel::_emptyLeaf) {
+            rootBox.merge(childBox(_nodes[0], i));
+        }
+    }
+    const double rootArea = rootBox.area();
+    return sahCostRec(0, rootArea, rootArea);
+}
+
+double OBVHAccel::sahCostRec(int nodeID, double nodeArea, double rootArea) const {
+    const OBVHNode& node = _nodes[nodeID];
+    double cost = QBVHAccel::_traversalCost * nodeArea / rootArea;
+    for (int i = 0; i < 8; i++) {
+        const unsigned int child = node.children[i];
+        if (child == QBVHAccel::_emptyLeaf) continue;
+
+        const double childArea = childBox(node, i).area();
+        if (QBVHAccel::isLeaf(child)) {
+            cost += QBVHAccel::_intersectCost * QBVHAccel::leafCount(child) * childArea / rootArea;
+        } else {
+            cost += sahCostRec(child, childArea, rootArea);
+        }
+    }
+    return cost;
+}
+
+size_t OBVHAccel::memoryUsage() const {
+    return sizeof(OBVHNode) * _numNodes + sizeof(TrianglePacket) * _numPackets + sizeof(Triangle) * _triangles.capacity();
+}
+
+bool OBVHAccel::save(const std::string& filename) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    AccelCacheHeader header;
+    memset((void*)&header, 0, sizeof(AccelCacheHeader));
+    strncpy(header.magic, name(), sizeof(header.magic));
+    header.version = accel::cacheVersion;
+    header.buildType = (unsigned int)_buildType;
+    header.key = accel::cacheKey(_triangles, _buildType, name());
+    header.numTriangles = (int)_triangles.size();
+    header.numNodes = _numNodes;
+    header.numPackets = _numPackets;
+    header.stackSize = _stackSize;
+    header.buildCost = _buildCost;
+
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    ofs.write((const char*)&header, sizeof(AccelCacheHeader));
+    ofs.write((const char*)_nodes, sizeof(OBVHNode) * _numNodes);
+    ofs.write((const char*)_packets, sizeof(TrianglePacket) * _numPackets);
+    ofs.close();
+    return !ofs.fail();
+}
+
+bool OBVHAccel::load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    release();
+
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename)) {
+        return false;
+    }
+
+    const unsigned long long key = accel::cacheKey(triangles, buildType, name());
+    const AccelCacheHeader* header = accel::checkCache(*file, name(), key, sizeof(OBVHNode), sizeof(TrianglePacket));
+    if (header == NULL || header->numTriangles != (int)triangles.size()) {
+        return false;
+    }
+
+    // The mapping is page-aligned and the header keeps both arrays aligned
+    char* data = file->data() + sizeof(AccelCacheHeader);
+    _nodes = (OBVHNode*)data;
+    _numNodes = header->numNodes;
+    _packets = (TrianglePacket*)(data + sizeof(OBVHNode) * _numNodes);
+    _numPackets = header->numPackets;
+    _stackSize = header->stackSize;
+    _buildType = buildType;
+    _buildCost = header->buildCost;
+    _triangles = triangles;
+    _mappedFile = file;
+    return true;
+}
+
+void OBVHAccel::traverse(const Ray& ray, bool anyHit, HitRecord* record, AccelStats* stats) const {
+    if (stats != NULL) {
+        stats->numRays += 1;
+    }
+
+    SimdRay8 simdRay;
+    setSimdRay8(ray, &simdRay);
+
+    StackItem localStack[_maxStackSize];
+    std::vector<StackItem> heapStack;
+    StackItem* stack = localStack;
+    if (_stackSize > _maxStackSize) {
+        heapStack.resize(_stackSize);
+        stack = &heapStack[0];
+    }
+
+    int stackTop = 0;
+    stack[stackTop].entry = 0;
+    stack[stackTop].tNear = 0.0f;
+    stackTop++;
+    while (stackTop > 0) {
+        const StackItem item = stack[--stackTop];
+        if (item.tNear > record->t) continue;    // Culled by a closer hit found after the push
+        const unsigned int entry = item.entry;
+
+        if (stats != NULL) {
+            stats->numNodeVisits += 1;
+            if (QBVHAccel::isLeaf(entry)) stats->numTriangleTests += QBVHAccel::leafCount(entry);
+        }
+
+        if (QBVHAccel::isLeaf(entry)) {
+            if (entry == QBVHAccel::_emptyLeaf) continue;
+
+            const TrianglePacket& packet = _packets[QBVHAccel::leafStart(entry)];
+            align_attrib(float, 32) ts[8], us[8], vs[8];
+            const int hitMask = intersectTriangles8(packet.p0, packet.p1, packet.p2, packet.ids, simdRay, record->t, ts, us, vs);
+            for (int k = 0; k < 8; k++) {
+                if ((hitMask & (1 << k)) != 0 && ts[k] < record->t) {
+                    record->id = packet.ids[k];
+                    record->t = ts[k];
+                    record->u = us[k];
+                    record->v = vs[k];
+                }
+            }
+            if (anyHit && record->id >= 0) return;
+            continue;
+        }
+
+        __m256 tMin;
+        const __m256 hit = intersectBoxes8(_nodes[entry].childBoxes, simdRay, record->t, &tMin);
+        const int hitMask = _mm256_movemask_ps(hit);
+        if (hitMask == 0) continue;
+
+        // Push hit children so that the nearest one is popped first
+        align_attrib(float, 32) tNears[8];
+        _mm256_store_ps(tNears, tMin);
+        const unsigned int* children = _nodes[entry].children;
+        const int stackBottom = stackTop;
+        for (int i = 0; i < 8; i++) {
+            if ((hitMask & (1 << i)) == 0) continue;
+
+            StackItem child = { children[i], tNears[i] };
+            int k = stackTop++;
+            for (; k > stackBottom && stack[k - 1].tNear < child.tNear; k--) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+int OBVHAccel::intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return -1;
+    }
+
+    HitRecord record = { -1, static_cast<float>(hitpoint->distance()), 0.0f, 0.0f };
+    traverse(ray, false, &record, stats);
+    if (record.id < 0) {
+        return -1;
+    }
+
+    QBVHAccel::resolveHit(_triangles[record.id], ray, record, hitpoint);
+    return record.id;
+}
+
+int OBVHAccel::intersect(RayPacket& packet, AccelStats* stats) const {
+    if (_numNodes == 0 || packet.size() == 0) {
+        return 0;
+    }
+
+    HitRecord records[RayPacket::maxSize];
+    for (int r = 0; r < packet.size(); r++) {
+        const HitRecord record = { -1, static_cast<float>(packet.intersection(r).hittingDistance()), 0.0f, 0.0f };
+        records[r] = record;
+    }
+
+    traversePacket(packet, records, stats);
+
+    int hitMask = 0;
+    Hitpoint hitpoint;
+    for (int r = 0; r < packet.size(); r++) {
+        if (records[r].id < 0) continue;
+
+        QBVHAccel::resolveHit(_triangles[records[r].id], packet.ray(r), records[r], &hitpoint);
+        packet.setIntersection(r, records[r].id, hitpoint);
+        hitMask |= 1 << r;
+    }
+    return hitMask;
+}
+
+void OBVHAccel::traversePacket(const RayPacket& packet, HitRecord* records, AccelStats* stats) const {
+    const int numRays = packet.size();
+    if (stats != NULL) {
+        stats->numRays += numRays;
+    }
+
+    SimdRay8 rays[RayPacket::maxSize];
+    __m256 rayBits[RayPacket::maxSize];
+    for (int r = 0; r < numRays; r++) {
+        setSimdRay8(packet.ray(r), &rays[r]);
+        rayBits[r] = _mm256_castsi256_ps(_mm256_set1_epi32(1 << r));
+    }
+    const __m256 simdInf = _mm256_set1_ps(inff);
+
+    PacketStackItem localStack[_maxStackSize];
+    std::vector<PacketStackItem> heapStack;
+    PacketStackItem* stack = localStack;
+    if (_stackSize > _maxStackSize) {
+        heapStack.resize(_stackSize);
+        stack = &heapStack[0];
+    }
+
+    int stackTop = 0;
+    stack[stackTop].entry = 0;
+    stack[stackTop].rayMask = (1 << numRays) - 1;
+    stack[stackTop].tNear = 0.0f;
+    stackTop++;
+    while (stackTop > 0) {
+        const PacketStackItem item = stack[--stackTop];
+
+        // Rays which already found closer hits are deactivated
+        int activeMask = 0;
+        for (int r = 0; r < numRays; r++) {
+            if ((item.rayMask & (1 << r)) && item.tNear <= records[r].t) activeMask |= 1 << r;
+        }
+        if (activeMask == 0) continue;
+
+        const unsigned int entry = item.entry;
+        if (QBVHAccel::isLeaf(entry)) {
+            if (entry == QBVHAccel::_emptyLeaf) continue;
+
+            const TrianglePacket& tris = _packets[QBVHAccel::leafStart(entry)];
+            align_attrib(float, 32) ts[8], us[8], vs[8];
+            for (int r = 0; r < numRays; r++) {
+                if ((activeMask & (1 << r)) == 0) continue;
+                if (stats != NULL) {
+                    stats->numNodeVisits += 1;
+                    stats->numTriangleTests += QBVHAccel::leafCount(entry);
+                }
+
+                HitRecord* record = &records[r];
+                const int hitMask = intersectTriangles8(tris.p0, tris.p1, tris.p2, tris.ids, rays[r], record->t, ts, us, vs);
+                for (int k = 0; k < 8; k++) {
+                    if ((hitMask & (1 << k)) != 0 && ts[k] < record->t) {
+                        record->id = tris.ids[k];
+                        record->t = ts[k];
+                        record->u = us[k];
+                        record->v = vs[k];
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Ray masks and minimum entry distances of the children are accumulated in lanes
+        const OBVHNode& node = _nodes[entry];
+        __m256 maskAcc = _mm256_setzero_ps();
+        __m256 nearAcc = simdInf;
+        for (int r = 0; r < numRays; r++) {
+            if ((activeMask & (1 << r)) == 0) continue;
+            if (stats != NULL) stats->numNodeVisits += 1;
+
+            __m256 tMin;
+            const __m256 hit = intersectBoxes8(node.childBoxes, rays[r], records[r].t, &tMin);
+            maskAcc = _mm256_or_ps(maskAcc, _mm256_and_ps(hit, rayBits[r]));
+            nearAcc = _mm256_min_ps(nearAcc, _mm256_blendv_ps(simdInf, tMin, hit));
+        }
+
+        align_attrib(int, 32) childMasks[8];
+        align_attrib(float, 32) childNears[8];
+        _mm256_store_ps((float*)childMasks, maskAcc);
+        _mm256_store_ps(childNears, nearAcc);
+
+        // Push children so that the nearest one is popped first
+        const int stackBottom = stackTop;
+        for (int i = 0; i < 8; i++) {
+            if (childMasks[i] == 0) continue;
+
+            PacketStackItem child = { node.children[i], childMasks[i], childNears[i] };
+            int k = stackTop++;
+            for (; k > stackBottom && stack[k - 1].tNear < child.tNear; k--) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+bool OBVHAccel::occluded(const Ray& ray, double tMax, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    HitRecord record = { -1, static_cast<float>(tMax), 0.0f, 0.0f };
+    traverse(ray, true, &record, stats);
+    return record.id >= 0;
+}
@@ -0,0 +1,143 @@
+#ifndef _OBVH_ACCEL_H_
+#define _OBVH_ACCEL_H_
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "accel_interface.h"
+#include "accel_cache.h"
+#include "qbvh_accel.h"
+
+// --------------------------------------------------
+// 8-wide BVH traversed with AVX
+// --------------------------------------------------
+// The tree is made by collapsing a QBVH, so it is built with the same split
+// strategies and hits exactly the same triangles. Node boxes and triangle
+// packets are stored as plain floats and loaded into 8-wide registers only
+// in the traversal kernels, which are compiled for AVX regardless of the
+// compiler flags. Use it only when OBVHAccel::isSupported() returns true.
+class OBVHAccel : public IAccel {
+private:
+
+    // Nodes are stored in one 64-byte-aligned array (four cache lines per node).
+    // Child entries are encoded in the same way as QBVH.
+    struct OBVHNode {
+        float childBoxes[2][3][8];    // [min-max][x-y-z][child]
+        unsigned int children[8];     // Child node IDs or leaf entries
+        char padding[32];
+    };
+
+    // Up to eight triangles of a leaf in SoA layout for 8-wide intersection tests.
+    // Unused lanes are degenerate (and never hit) and their IDs are -1.
+    struct TrianglePacket {
+        float p0[3][8];    // Vertices [x-y-z][lane]
+        float p1[3][8];
+        float p2[3][8];
+        int ids[8];        // Indices of the original triangles
+    };
+
+    struct StackItem {
+        unsigned int entry;
+        float tNear;
+    };
+
+    struct PacketStackItem {
+        unsigned int entry;
+        int rayMask;
+        float tNear;
+    };
+
+    typedef QBVHAccel::HitRecord HitRecord;
+
+    static const int _maxNodeSize = 8;
+    static const int _maxStackSize = 512;    // Traversal stack kept on the call stack
+
+    OBVHNode* _nodes;
+    int _numNodes;
+    TrianglePacket* _packets;
+    int _numPackets;
+    int _stackSize;    // Traversal stack size required by the tree depth
+    AccelBuildType _buildType;
+    double _buildCost;    // SAH cost right after the last construction
+    std::vector<Triangle> _triangles;    // Original triangles to compute hitpoints
+    std::shared_ptr<MappedFile> _mappedFile;    // Owner of the nodes and packets when loaded from a cache
+
+public:
+    OBVHAccel();
+    OBVHAccel(const OBVHAccel& obvh);
+    OBVHAccel(OBVHAccel&& obvh);
+    virtual ~OBVHAccel();
+
+    OBVHAccel& operator=(const OBVHAccel& obvh);
+    OBVHAccel& operator=(OBVHAccel&& obvh);
+
+    // Construct OBVH
+    // A QBVH is built with the given strategy and collapsed into 8-wide nodes.
+    // @param[in] triangles: triangles stored in the tree
+    // @param[in] buildType: split strategy (object median, binned SAH, Morton codes or spatial splits)
+    void construct(const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
+
+    // Update the bounds for moved triangles without changing the topology
+    // The tree is rebuilt with the last build type instead when the refitted
+    // tree is expected to be more than maxCostRatio times as costly (by SAH).
+    // @param[in] triangles: moved triangles in the same order as construction
+    // @return true if the tree was rebuilt
+    bool refit(const std::vector<Triangle>& triangles, double maxCostRatio = 1.5) override;
+
+    // Intersection test
+    // If ray is intersected, then return the index of the triangle.
+    // If not, then return -1.
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    int intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats = NULL) const override;
+
+    // Intersection test for a packet of coherent rays
+    // @return bit mask of the rays which hit triangles
+    // @param[out] stats: node visits (per ray) and triangle tests are added to it (option)
+    int intersect(RayPacket& packet, AccelStats* stats = NULL) const override;
+
+    // Occlusion test (any hit)
+    // @param[in] tMax: distance to the end of the ray segment
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    bool occluded(const Ray& ray, double tMax = INFTY, AccelStats* stats = NULL) const override;
+
+    // Expected cost of a ray query estimated with the surface area heuristic
+    double sahCost() const override;
+
+    // Memory consumed by the nodes and the triangle buffers (in bytes)
+    size_t memoryUsage() const override;
+
+    inline int numNodes() const override { return _numNodes; }
+    inline const char* name() const override { return "obvh"; }
+
+    // Write the nodes and the packets to a cache file
+    // The file is keyed by the hash of the triangles and the build type.
+    // @return false if the file cannot be written
+    bool save(const std::string& filename) const override;
+
+    // Map a cache file written by save() instead of construction
+    // The triangles and the build type must be the same as those of the cached tree.
+    // @return false (and the tree is left empty) if the file is missing or stale
+    bool load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
+
+    // Check if the CPU and the OS support AVX instructions
+    static bool isSupported();
+
+private:
+    void release();
+
+    unsigned int collapseRec(const QBVHAccel& qbvh, unsigned int qnodeID, const std::vector<int>& subtreeSizes,
+                             std::vector<OBVHNode>& nodes, std::vector<TrianglePacket>& packets) const;
+    double sahCostRec(int nodeID, double nodeArea, double rootArea) const;
+    int depthRec(int nodeID) const;
+
+    avx_target void traverse(const Ray& ray, bool anyHit, HitRecord* record, AccelStats* stats) const;
+    avx_target void traversePacket(const RayPacket& packet, HitRecord* records, AccelStats* stats) const;
+
+    static int subtreeSizeRec(const QBVHAccel& qbvh, unsigned int entry, std::vector<int>& subtreeSizes);
+    static void gatherTriangles(const QBVHAccel& qbvh, unsigned int entry, std::vector<int>* ids);
+    static void setPacket(const std::vector<Triangle>& triangles, const std::vector<int>& ids, TrianglePacket* packet);
+    static BBox childBox(const OBVHNode& node, int i);
+};
+
+#endif  // _OBVH_ACCEL_H_
@@ -0,0 +1,20 @@
+#define PARALLEL_EXPORT
+#include "parallel.h"
+
+namespace parallel {
+
+    namespace {
+
+        int chunkCount = OMP_NUM_CORE;
+
+    }
+
+    int numChunks() {
+        return chunkCount;
+    }
+
+    void setNumChunks(int n) {
+        chunkCount = n > 0 ? n : OMP_NUM_CORE;
+    }
+
+}  // namespace parallel
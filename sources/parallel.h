@@ -0,0 +1,191 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <vector>
+#include <iterator>
+#include <algorithm>
+
+#if defined(_WIN32) || defined(__WIN32__)
+    #ifdef PARALLEL_EXPORT
+        #define PARALLEL_DLL __declspec(dllexport)
+    #else
+        #define PARALLEL_DLL __declspec(dllimport)
+    #endif
+#else
+    #define PARALLEL_DLL
+#endif
+
+#include "common.h"
+
+namespace parallel {
+
+    // Number of chunks which parallel loops split their ranges into
+    // It is the number of cores by default. Results of the parallel helpers
+    // and the builders using them do not depend on it, which tests check by
+    // changing it independently of the number of threads.
+    PARALLEL_DLL int numChunks();
+
+    // @param[in] n: number of chunks (the number of cores if n <= 0)
+    PARALLEL_DLL void setNumChunks(int n);
+
+    // Stable partition executed with multiple threads.
+    // The result is the same as std::stable_partition regardless of the number of threads.
+    template <class RandomIterator, class Predicate>
+    RandomIterator stablePartition(RandomIterator first, RandomIterator last, Predicate pred) {
+        typedef typename std::iterator_traits<RandomIterator>::value_type ValueType;
+
+        const int n = static_cast<int>(last - first);
+        const int numChunks = parallel::numChunks();
+
+        // Count elements in each chunk
+        std::vector<int> numTrues(numChunks + 1, 0);
+        std::vector<int> numFalses(numChunks + 1, 0);
+        ompfor (int c = 0; c < numChunks; c++) {
+            const int lo = static_cast<int>((long long)n * c / numChunks);
+            const int hi = static_cast<int>((long long)n * (c + 1) / numChunks);
+            int count = 0;
+            for (int i = lo; i < hi; i++) {
+                if (pred(first[i])) count++;
+            }
+            numTrues[c + 1] = count;
+            numFalses[c + 1] = (hi - lo) - count;
+        }
+
+        for (int c = 0; c < numChunks; c++) {
+            numTrues[c + 1] += numTrues[c];
+            numFalses[c + 1] += numFalses[c];
+        }
+        const int numTotalTrues = numTrues[numChunks];
+
+        // Scatter elements to the temporary buffer, and then write them back
+        std::vector<ValueType> temp(n);
+        ompfor (int c = 0; c < numChunks; c++) {
+            const int lo = static_cast<int>((long long)n * c / numChunks);
+            const int hi = static_cast<int>((long long)n * (c + 1) / numChunks);
+            int t = numTrues[c];
+            int f = numTotalTrues + numFalses[c];
+            for (int i = lo; i < hi; i++) {
+                if (pred(first[i])) {
+                    temp[t++] = first[i];
+                } else {
+                    temp[f++] = first[i];
+                }
+            }
+        }
+
+        ompfor (int i = 0; i < n; i++) {
+            first[i] = temp[i];
+        }
+        return first + numTotalTrues;
+    }
+
+    // Stable LSD radix sort of unsigned integer keys executed with multiple threads.
+    // Values are reordered together with the keys.
+    // @param[in] numBits: number of the lower bits of the keys to be sorted by
+    template <class Key, class Value>
+    void radixSort(std::vector<Key>& keys, std::vector<Value>& values, int numBits) {
+        static const int radixBits = 8;
+        static const int numBuckets = 1 << radixBits;
+
+        const int n = (int)keys.size();
+        const int numChunks = parallel::numChunks();
+
+        std::vector<Key> tempKeys(n);
+        std::vector<Value> tempValues(n);
+        std::vector<int> offsets(numChunks * numBuckets);
+        for (int shift = 0; shift < numBits; shift += radixBits) {
+            // Count digits in each chunk
+            ompfor (int c = 0; c < numChunks; c++) {
+                const int lo = static_cast<int>((long long)n * c / numChunks);
+                const int hi = static_cast<int>((long long)n * (c + 1) / numChunks);
+                int* counts = &offsets[c * numBuckets];
+                std::fill(counts, counts + numBuckets, 0);
+                for (int i = lo; i < hi; i++) {
+                    counts[(keys[i] >> shift) & (numBuckets - 1)] += 1;
+                }
+            }
+
+            // Chunks write each bucket in order, which keeps the sort stable
+            int sum = 0;
+            for (int b = 0; b < numBuckets; b++) {
+                for (int c = 0; c < numChunks; c++) {
+                    const int count = offsets[c * numBuckets + b];
+                    offsets[c * numBuckets + b] = sum;
+                    sum += count;
+                }
+            }
+
+            ompfor (int c = 0; c < numChunks; c++) {
+                const int lo = static_cast<int>((long long)n * c / numChunks);
+                const int hi = static_cast<int>((long long)n * (c + 1) / numChunks);
+                int* pos = &offsets[c * numBuckets];
+                for (int i = lo; i < hi; i++) {
+                    const int k = pos[(keys[i] >> shift) & (numBuckets - 1)]++;
+                    tempKeys[k] = keys[i];
+                    tempValues[k] = values[i];
+                }
+            }
+
+            keys.swap(tempKeys);
+            values.swap(tempValues);
+        }
+    }
+
+    // Predicates of the elements before and after a pivot (for nthElement)
+    template <class Value, class Compare>
+    class LessThanPivot {
+    private:
+        Value pivot;
+        Compare comp;
+    public:
+        LessThanPivot(const Value& pivot_, Compare comp_) : pivot(pivot_), comp(comp_) {}
+        bool operator()(const Value& v) const { return comp(v, pivot); }
+    };
+
+    template <class Value, class Compare>
+    class NotGreaterThanPivot {
+    private:
+        Value pivot;
+        Compare comp;
+    public:
+        NotGreaterThanPivot(const Value& pivot_, Compare comp_) : pivot(pivot_), comp(comp_) {}
+        bool operator()(const Value& v) const { return !comp(pivot, v); }
+    };
+
+    // Partial sort like std::nth_element executed with multiple threads.
+    // Large ranges are narrowed down by parallel three-way partitions around
+    // pivots estimated from samples, and the rest is done by std::nth_element.
+    // The result does not depend on the number of threads.
+    // @param[in] grain: ranges smaller than this are processed serially
+    template <class RandomIterator, class Compare>
+    void nthElement(RandomIterator first, RandomIterator nth, RandomIterator last, Compare comp, int grain) {
+        typedef typename std::iterator_traits<RandomIterator>::value_type ValueType;
+        static const int numSamples = 127;
+
+        while (last - first > std::max(grain, numSamples)) {
+            // Pivot at the rank of nth among evenly spaced samples
+            const long long n = last - first;
+            std::vector<ValueType> samples(numSamples);
+            for (int i = 0; i < numSamples; i++) {
+                samples[i] = first[n * i / numSamples];
+            }
+            const int rank = static_cast<int>((nth - first) * numSamples / n);
+            std::nth_element(samples.begin(), samples.begin() + rank, samples.end(), comp);
+            const ValueType pivot = samples[rank];
+
+            RandomIterator lo = stablePartition(first, last, LessThanPivot<ValueType, Compare>(pivot, comp));
+            RandomIterator hi = stablePartition(lo, last, NotGreaterThanPivot<ValueType, Compare>(pivot, comp));
+            if (nth < lo) {
+                last = lo;
+            } else if (nth < hi) {
+                return;    // Elements equivalent to the pivot
+            } else {
+                first = hi;
+            }
+        }
+        std::nth_element(first, nth, last, comp);
+    }
+
+}  // namespace parallel
+
+#endif  // _PARALLEL_H_
@@ -83,12 +83,20 @@ void PathTracing::render(const Scene& scene, const Camera& camera, const RenderP
         // Tracing rays for each pixel
         for (int t = 0; t < taskPerThread; t++) {
             ompfor (int threadID = 0; threadID < OMP_NUM_CORE; threadID++) {
-                RandomSequence rseq;
+                RandomSequence rseqs[RayPacket::maxSize];
+                Vector3D colors[RayPacket::maxSize];
                 if (t < tasks[threadID].size()) {
                     const int y = tasks[threadID][t];
-                    for (int x = 0; x < width; x++) {
-                        rsamplers[threadID].request(200, &rseq);
-                        buffer.pixel(x, height - y - 1) += executePathTracing(scene, camera, params, x, y, rseq);
+                    for (int x = 0; x < width; x += RayPacket::maxSize) {
+                        const int numPixels = std::min(RayPacket::maxSize, width - x);
+                        for (int k = 0; k < numPixels; k++) {
+                            rsamplers[threadID].request(200, &rseqs[k]);
+                        }
+
+                        executePathTracing(scene, camera, params, x, y, numPixels, rseqs, colors);
+                        for (int k = 0; k < numPixels; k++) {
+                            buffer.pixel(x + k, height - y - 1) += colors[k];
+                        }
                     }
                 }
             }
@@ -125,18 +133,35 @@ void PathTracing::render(const Scene& scene, const Camera& camera, const RenderP
     delete[] rsamplers;
 }
 
-Vector3D PathTracing::executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, int bounceLimit) const {
-    const double px = pixelX + rseq.pop() - 0.5;
-    const double py = pixelY + rseq.pop() - 0.5;
-    Ray ray = camera.getRay(px, py);
+void PathTracing::executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, int numPixels,
+                                     RandomSequence* rseqs, Vector3D* colors, int bounceLimit) const {
+    RayPacket packet;
+    for (int k = 0; k < numPixels; k++) {
+        const double px = pixelX + k + rseqs[k].pop() - 0.5;
+        const double py = pixelY + rseqs[k].pop() - 0.5;
+        packet.add(camera.getRay(px, py));
+    }
+
+    if (bounceLimit > 0) {
+        scene.intersect(packet);
+    }
 
-    return radiance(scene, ray, params, rseq, 0, bounceLimit);
+    for (int k = 0; k < numPixels; k++) {
+        colors[k] = radiance(scene, packet.ray(k), packet.intersection(k), params, rseqs[k], 0, bounceLimit);
+    }
 }
 
 Vector3D PathTracing::radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit) const {
-    // Terminate trace if the bounces reach limit or not intersect the scene
     Intersection isect;
-    if (bounces >= bounceLimit || !scene.intersect(ray, isect)) {
+    if (bounces < bounceLimit) {
+        scene.intersect(ray, isect);
+    }
+    return radiance(scene, ray, isect, params, rseq, bounces, bounceLimit);
+}
+
+Vector3D PathTracing::radiance(const Scene& scene, const Ray& ray, const Intersection& isect, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit) const {
+    // Terminate trace if the bounces reach limit or not intersect the scene
+    if (bounces >= bounceLimit || isect.objectID() < 0) {
         return scene.envmap().sampleFromDir(ray.direction());
     }
 
@@ -167,13 +192,13 @@ Vector3D PathTracing::radiance(const Scene& scene, const Ray& ray, const RenderP
             Vector3D reflectDir, transmitDir;
             double fresnelRe, fresnelTr;
             if (checkTotalReflection(into, ray.direction(), hitpoint.normal(), orieintingNormal, &reflectDir, &transmitDir, &fresnelRe, &fresnelTr)) {
-                const Ray nextRay(hitpoint.position(), reflectDir);
+                const Ray nextRay = hitpoint.spawnRay(reflectDir);
                 return radiance(scene, nextRay, params, rseq, bounces + 1, bounceLimit);
             } else {
                 const double probability = 0.25 + REFLECT_PROBABILITY * 0.5;
                 if (rands[1] < probability) {
                     // Reflection
-                    const Ray nextRay(hitpoint.position(), reflectDir);
+                    const Ray nextRay = hitpoint.spawnRay(reflectDir);
                     return bsdf.reflectance() * radiance(scene, nextRay, params, rseq, bounces, bounceLimit) * (fresnelRe / probability);
                 } else {
                     // Transmit
@@ -191,7 +216,7 @@ Vector3D PathTracing::radiance(const Scene& scene, const Ray& ray, const RenderP
     Vector3D nextDir;
     bsdf.sample(ray.direction(), hitpoint.normal(), rands[1], rands[2], &nextDir, &pdf);
 
-    Ray nextRay(hitpoint.position(), nextDir);
+    Ray nextRay = hitpoint.spawnRay(nextDir);
     throughput += bsdf.reflectance() * radiance(scene, nextRay, params, rseq, bounces + 1, bounceLimit) / (pdf * roulette);
 
     return throughput;
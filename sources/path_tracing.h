@@ -29,8 +29,12 @@ public:
     void render(const Scene& scene, const Camera& camera, const RenderParameters& params, RandomSamplerType randomSamplerType = RANDOM_SAMPLER_PSEUDO_RANDOM);
 
 private:
-    Vector3D executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, int bounceLimit = 64) const;
+    // Trace the pixels from (pixelX, pixelY) to (pixelX + numPixels - 1, pixelY)
+    // Their primary rays are intersected with the scene as a ray packet.
+    void executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, int numPixels,
+                            RandomSequence* rseqs, Vector3D* colors, int bounceLimit = 64) const;
     Vector3D radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit) const;
+    Vector3D radiance(const Scene& scene, const Ray& ray, const Intersection& isect, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit) const;
 };
 
 #endif  // _PATH_TRACING_H_
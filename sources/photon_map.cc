@@ -2,6 +2,7 @@
 #include "photon_map.h"
 
 #include "sampler.h"
+#include "parallel.h"
 #include "scene.h"
 
 PhotonMap::PhotonMap()
@@ -18,9 +19,50 @@ void PhotonMap::clear() {
 }
 
 void PhotonMap::construct(const std::vector<Photon>& photons) {
+    // Photons are packed as they are copied into the buckets
     _kdtree.construct(photons);
 }
 
+void PhotonMap::sortQueries(const std::vector<Vector3D>& positions, std::vector<int>* order) {
+    // Positions are quantized in their bounding box (10 bits per axis)
+    static const int bitsPerAxis = 10;
+
+    const int numPoints = (int)positions.size();
+    BBox bbox;
+    for (int i = 0; i < numPoints; i++) {
+        bbox.merge(positions[i]);
+    }
+
+    const double maxCell = static_cast<double>((1 << bitsPerAxis) - 1);
+    const Vector3D lo = bbox.posMin();
+    const Vector3D extent = bbox.posMax() - bbox.posMin();
+    double scale[3];
+    for (int d = 0; d < 3; d++) {
+        scale[d] = extent[d] > EPS ? maxCell / extent[d] : 0.0;
+    }
+
+    std::vector<unsigned int> codes(numPoints);
+    order->resize(numPoints);
+    ompfor (int i = 0; i < numPoints; i++) {
+        unsigned long long cells[3];
+        for (int d = 0; d < 3; d++) {
+            cells[d] = static_cast<unsigned long long>(std::min(maxCell, (positions[i][d] - lo[d]) * scale[d]));
+        }
+        codes[i] = static_cast<unsigned int>((accel::expandBits(cells[0]) << 2) | (accel::expandBits(cells[1]) << 1) | accel::expandBits(cells[2]));
+        (*order)[i] = i;
+    }
+
+    parallel::radixSort(codes, *order, 3 * bitsPerAxis);
+}
+
 void PhotonMap::findKNN(const Photon& query, std::vector<Photon>* photons, const int numTargetPhotons, const double targetRadius) const {
-    _kdtree.knnSearch(query, KnnQuery(K_NEAREST | EPSILON_BALL, numTargetPhotons, targetRadius), photons);
+    KnnQueryContext context;
+    findKNN(query, &context, numTargetPhotons, targetRadius);
+    for (int i = 0; i < context.size(); i++) {
+        photons->push_back(photon(context.index(i)));
+    }
+}
+
+void PhotonMap::findKNN(const Photon& query, KnnQueryContext* context, const int numTargetPhotons, const double targetRadius) const {
+    _kdtree.knnSearch(query, KnnQuery(K_NEAREST | EPSILON_BALL, targetRadius, numTargetPhotons), context);
 }
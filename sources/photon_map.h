@@ -12,6 +12,7 @@
 #endif
 
 #include "photon.h"
+#include "compact_photon.h"
 #include "kdtree.h"
 #include "readonly_interface.h"
 
@@ -19,9 +20,12 @@
 
 class Scene;
 
+// Photons are stored as CompactPhoton (8 bytes each, and 12 bytes for the
+// float positions in the kd-tree, instead of 96), and are decoded when they
+// are gathered.
 class PHOTON_MAP_DLL PhotonMap : private IReadOnly {
 private:
-    KdTree<Photon> _kdtree;
+    KdTree<CompactPhoton> _kdtree;
 
 public:
     PhotonMap();
@@ -31,6 +35,39 @@ public:
     void construct(const std::vector<Photon>& photons);
 
     void findKNN(const Photon& photon, std::vector<Photon>* photons, const int numTargetPhotons, const double targetRadius) const;
+
+    // Find the nearest photons without copying them
+    // The indices set to the context refer to photon(). Reuse one context per
+    // thread to gather without heap allocations.
+    void findKNN(const Photon& photon, KnnQueryContext* context, const int numTargetPhotons, const double targetRadius) const;
+
+    // Visit all the photons closer than the radius without allocations
+    // The visitor is called as visitor(index, squared distance) for each photon,
+    // where the index refers to photon(). Use it instead of findKNN when the
+    // gather radius is fixed (like progressive photon mapping).
+    // @param[in] radius2: squared gather radius
+    template <class Visitor>
+    void rangeQuery(const Vector3D& position, double radius2, Visitor& visitor) const {
+        _kdtree.rangeSearch(position, radius2, visitor);
+    }
+
+    // Order of the query positions along the Morton curve
+    // Gathering in this order lets neighbouring queries visit the photons
+    // (and the kd-tree nodes) loaded into the cache by the previous ones.
+    // @param[out] order: indices of the positions in the sorted order
+    static void sortQueries(const std::vector<Vector3D>& positions, std::vector<int>* order);
+
+    // Decode the photon (or only its position or flux) found by findKNN
+    inline Photon photon(int index) const { return _kdtree.point(index).decode(position(index)); }
+    inline Vector3D position(int index) const {
+        return Vector3D(_kdtree.position(index, 0), _kdtree.position(index, 1), _kdtree.position(index, 2));
+    }
+    inline Vector3D flux(int index) const { return _kdtree.point(index).flux(); }
+
+    inline int size() const { return _kdtree.size(); }
+
+    // Memory consumed by the photons and the kd-tree (in bytes)
+    inline size_t memoryUsage() const { return _kdtree.memoryUsage(); }
 };
 
 #endif
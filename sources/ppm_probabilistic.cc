@@ -7,6 +7,53 @@
 #include "reflectance.h"
 
 const double ProgressivePhotonMappingProb::ALPHA = 0.7;
+const int ProgressivePhotonMappingProb::GATHER_BATCH_SIZE = 256;
+
+namespace {
+
+    // Sum of the cone-filtered flux of the photons on the tangent plane
+    // Photons are visited by PhotonMap::rangeQuery within the radius.
+    class ConeFilterGather {
+    private:
+        static const double K;
+
+        const PhotonMap& _photonMap;
+        Vector3D _position;
+        Vector3D _normal;
+        double _radius;
+        double _planeThreshold;
+        Vector3D _totalFlux;
+
+    public:
+        ConeFilterGather(const PhotonMap& photonMap, const Vector3D& position, const Vector3D& normal, double radius)
+            : _photonMap(photonMap)
+            , _position(position)
+            , _normal(normal)
+            , _radius(radius)
+            , _planeThreshold(radius * radius * 0.01)
+            , _totalFlux(0.0, 0.0, 0.0)
+        {
+        }
+
+        void operator()(int index, double dist2) {
+            // Photons off the tangent plane are rejected
+            const Vector3D diff = _position - _photonMap.position(index);
+            const double dist = sqrt(dist2);
+            if (std::abs(Vector3D::dot(_normal, diff) / dist) < _planeThreshold) {
+                const double w = 1.0 - dist / (K * _radius);
+                _totalFlux += w * _photonMap.flux(index);
+            }
+        }
+
+        inline Vector3D totalFlux() const { return _totalFlux; }
+
+        // Integral of the cone filter relative to the box filter
+        static inline double normalization() { return 1.0 - 2.0 / (3.0 * K); }
+    };
+
+    const double ConeFilterGather::K = 1.1;
+
+}
 
 ProgressivePhotonMappingProb::ProgressivePhotonMappingProb()
     : _result()
@@ -47,12 +94,20 @@ void ProgressivePhotonMappingProb::render(const Scene& scene, const Camera& came
         _integrator = new SubsurfaceIntegrator();
     }
 
-    // Compute global radius for PPM-APA
+    // Compute global radius for PPM-APA, so that the first pass gathers
+    // about params.gatherPhotons() photons on the diffuse surfaces
     BBox bbox;
+    double diffuseArea = 0.0;
     for (int i = 0; i < scene.numTriangles(); i++) {
         bbox.merge(scene.getTriangle(i));
+        if (scene.getBsdf(i).type() & BSDF_TYPE_LAMBERTIAN_BRDF) {
+            diffuseArea += scene.getTriangle(i).area();
+        }
     }
     _radius = (bbox.posMax() - bbox.posMin()).norm() * 0.1;
+    if (diffuseArea > 0.0 && params.photons() > 0) {
+        _radius = std::min(_radius, initialRadius(diffuseArea, params.photons(), params.gatherPhotons()));
+    }
 
     // Prepare random samplers
     RandomSampler* rsamplers = new RandomSampler[OMP_NUM_CORE];
@@ -90,8 +145,8 @@ void ProgressivePhotonMappingProb::render(const Scene& scene, const Camera& came
         // 2nd pass: estimate radiance
         traceRays(&buffer, scene, camera, params, rsamplers);
 
-        // Update radius
-        _radius = (t + 1.0) / (t + ALPHA) * _radius;
+        // Update radius (R_{t+1}^2 = R_t^2 * (t + alpha) / (t + 1))
+        _radius *= sqrt((t + ALPHA) / (t + 1.0));
 
         // Save intermediate result
         for (int y = 0; y < height; y++) {
@@ -120,6 +175,11 @@ void ProgressivePhotonMappingProb::render(const Scene& scene, const Camera& came
     delete[] rsamplers;
 }
 
+double ProgressivePhotonMappingProb::initialRadius(double area, int numPhotons, int gatherPhotons) {
+    Assertion(area > 0.0 && numPhotons > 0, "area and number of photons must be positive");
+    return sqrt(gatherPhotons * area / (PI * numPhotons));
+}
+
 void ProgressivePhotonMappingProb::tracePhotons(const Scene& scene, const Camera& camera, const RenderParameters& params, RandomSampler* rsamplers, int bounceLimit) {
     const int numPhotons = params.photons();
 
@@ -178,7 +238,7 @@ void ProgressivePhotonMappingProb::tracePhotons(const Scene& scene, const Camera
                     if (rands[0] < probability) {
                         double pdf = 1.0;
                         bsdf.sample(currentRay.direction(), orientNormal, rands[1], rands[2], &nextDir, &pdf);
-                        currentRay = Ray(hitpoint.position(), nextDir);
+                        currentRay = hitpoint.spawnRay(nextDir);
                         currentFlux = currentFlux * bsdf.reflectance() / probability;
                     } else {
                         break;
@@ -186,7 +246,7 @@ void ProgressivePhotonMappingProb::tracePhotons(const Scene& scene, const Camera
                 } else {
                     double pdf = 1.0;
                     bsdf.sample(currentRay.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
-                    currentRay = Ray(hitpoint.position(), nextDir);
+                    currentRay = hitpoint.spawnRay(nextDir);
                     currentFlux = currentFlux * bsdf.reflectance() / pdf;
                 }
             }
@@ -217,6 +277,8 @@ void ProgressivePhotonMappingProb::traceRays(Image* buffer, const Scene& scene,
         tasks[y % OMP_NUM_CORE].push_back(y);
     }
 
+    // Camera paths are traced first, and their diffuse points are gathered together
+    std::vector<GatherPoint> gathers(width * height);
     for (int i = 0; i < taskPerThread; i++) {
         ompfor (int threadID = 0; threadID < OMP_NUM_CORE; threadID++) {
             if (i < tasks[threadID].size()) {
@@ -224,26 +286,70 @@ void ProgressivePhotonMappingProb::traceRays(Image* buffer, const Scene& scene,
                 for (int x = 0; x < width; x++) {
                     RandomSequence rseq;
                     rsamplers[threadID].request(200, &rseq);
-                    buffer->pixel(x, y) += executePathTracing(scene, camera, params, x, y, rseq);
+                    buffer->pixel(x, y) += executePathTracing(scene, camera, params, x, y, rseq, &gathers[y * width + x]);
                 }
             }
         }
         printf("%6.2f %% processed ...\r", 100.0 * (i + 1) / taskPerThread);
     }
-    printf("\nFinish!!\n");
+    printf("\n");
+
+    gatherPhotons(buffer, gathers, width);
+    printf("Finish!!\n");
 }
 
-Vector3D ProgressivePhotonMappingProb::executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, int bounceLimit) const {
+void ProgressivePhotonMappingProb::gatherPhotons(Image* buffer, const std::vector<GatherPoint>& gathers, int width) const {
+    Timer timer;
+    timer.start();
+
+    // Sort the points along the Morton curve, so that the neighbouring
+    // queries (and the threads sharing a batch) visit the same photons
+    // while they are in the cache.
+    std::vector<int> pixelIDs;
+    std::vector<Vector3D> positions;
+    for (int i = 0; i < (int)gathers.size(); i++) {
+        if (gathers[i].isActive) {
+            pixelIDs.push_back(i);
+            positions.push_back(gathers[i].position);
+        }
+    }
+
+    std::vector<int> order;
+    PhotonMap::sortQueries(positions, &order);
+
+    const int numPoints = (int)pixelIDs.size();
+    const int numBatches = (numPoints + GATHER_BATCH_SIZE - 1) / GATHER_BATCH_SIZE;
+    std::vector<Vector3D> results(numPoints);
+    ompfor_dynamic (int b = 0; b < numBatches; b++) {
+        const int endID = std::min(numPoints, (b + 1) * GATHER_BATCH_SIZE);
+        for (int k = b * GATHER_BATCH_SIZE; k < endID; k++) {
+            const GatherPoint& gather = gathers[pixelIDs[order[k]]];
+            ConeFilterGather filter(_photonMap, gather.position, gather.normal, _radius);
+            _photonMap.rangeQuery(gather.position, _radius * _radius, filter);
+            results[order[k]] = gather.weight * filter.totalFlux();
+        }
+    }
+
+    for (int i = 0; i < numPoints; i++) {
+        buffer->pixel(pixelIDs[i] % width, pixelIDs[i] / width) += results[i];
+    }
+
+    const double gatherTime = timer.stop();
+    printf("Gather: %d points, %.3f sec (%.2f kqueries/s)\n", numPoints, gatherTime, numPoints / std::max(gatherTime, 1.0e-6) * 1.0e-3);
+}
+
+Vector3D ProgressivePhotonMappingProb::executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, GatherPoint* gather, int bounceLimit) const {
     Assertion(pixelX >= 0 && pixelY >= 0 && pixelX < camera.imagesize().width() && pixelY < camera.imagesize().height(), "Pixel index out of bounds!!");   
 
     const double px = pixelX + rseq.pop() - 0.5;
     const double py = pixelY + rseq.pop() - 0.5;
     Ray ray = camera.getRay(px, py);
 
-    return radiance(scene, ray, params, rseq, 0, bounceLimit);
+    gather->isActive = false;
+    return radiance(scene, ray, params, rseq, Vector3D(1.0, 1.0, 1.0), gather, 0, bounceLimit);
 }
 
-Vector3D ProgressivePhotonMappingProb::radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit) const {
+Vector3D ProgressivePhotonMappingProb::radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, const Vector3D& weight, GatherPoint* gather, int bounces, int bounceLimit) const {
     // Terminate trace if the bounces reach limit or not intersect the scene
     Intersection isect;
     if (bounces >= bounceLimit || !scene.intersect(ray, isect)) {
@@ -277,14 +383,15 @@ Vector3D ProgressivePhotonMappingProb::radiance(const Scene& scene, const Ray& r
             Vector3D reflectDir, transmitDir;
             double fresnelRe, fresnelTr;
             if (checkTotalReflection(into, ray.direction(), hitpoint.normal(), orieintingNormal, &reflectDir, &transmitDir, &fresnelRe, &fresnelTr)) {
-                const Ray nextRay(hitpoint.position(), reflectDir);
-                return radiance(scene, nextRay, params, rseq, bounces + 1, bounceLimit);
+                const Ray nextRay = hitpoint.spawnRay(reflectDir);
+                return radiance(scene, nextRay, params, rseq, weight, gather, bounces + 1, bounceLimit);
             } else {
                 const double probability = 0.25 + REFLECT_PROBABILITY * 0.5;
                 if (rands[1] < probability) {
                     // Reflection
-                    const Ray nextRay(hitpoint.position(), reflectDir);
-                    return bsdf.reflectance() * radiance(scene, nextRay, params, rseq, bounces, bounceLimit) * (fresnelRe / probability);
+                    const Ray nextRay = hitpoint.spawnRay(reflectDir);
+                    const Vector3D nextWeight = bsdf.reflectance() * (fresnelRe / probability);
+                    return nextWeight * radiance(scene, nextRay, params, rseq, weight * nextWeight, gather, bounces, bounceLimit);
                 } else {
                     // Transmit
                     return _integrator->irradiance(hitpoint.position(), bsdf) * (fresnelTr / (1.0 - probability));
@@ -298,47 +405,19 @@ Vector3D ProgressivePhotonMappingProb::radiance(const Scene& scene, const Ray& r
     }
 
     if (bsdf.type() & BSDF_TYPE_LAMBERTIAN_BRDF) {
-        // Estimate irradiance with photon map
-        Photon query = Photon(hitpoint.position(), Vector3D(), ray.direction(), hitpoint.normal());
-        std::vector<Photon> photons;
-        _photonMap.findKNN(query, &photons, params.gatherPhotons(), _radius);
-
-        const int numPhotons = static_cast<int>(photons.size());
-
-        std::vector<Photon> validPhotons;
-        std::vector<double> distances;
-        double maxdist = 0.0;
-        for (int i = 0; i < numPhotons; i++) {
-            Vector3D diff = query - photons[i];
-            double dist = diff.norm();
-            if (std::abs(Vector3D::dot(hitpoint.normal(), diff) / dist) < _radius * _radius * 0.01) {
-                validPhotons.push_back(photons[i]);
-                distances.push_back(dist);
-                maxdist = std::max(maxdist, dist);
-            }
-        }
-
-        // Cone filter
-        const int numValidPhotons = static_cast<int>(validPhotons.size());
-        const double k = 1.1;
-        Vector3D totalFlux = Vector3D(0.0, 0.0, 0.0);
-        for (int i = 0; i < numValidPhotons; i++) {
-            const double w = 1.0 - (distances[i] / (k * maxdist));
-            const Vector3D v = bsdf.reflectance() * photons[i].flux() * invPI;
-            totalFlux += w * v;
-        }
-        totalFlux /= (1.0 - 2.0 / (3.0 * k));
-            
-        if (maxdist > EPS) {
-            throughput += totalFlux / (PI * maxdist * maxdist * roulette);
-        }
+        // Irradiance is estimated later with the photons within the global radius
+        gather->position = hitpoint.position();
+        gather->normal = hitpoint.normal();
+        gather->weight = weight * bsdf.reflectance() * invPI / (ConeFilterGather::normalization() * PI * _radius * _radius * roulette);
+        gather->isActive = true;
     } else {
         double pdf = 1.0;
         Vector3D nextDir;
         bsdf.sample(ray.direction(), hitpoint.normal(), rands[1], rands[2], &nextDir, &pdf);
 
-        Ray nextRay(hitpoint.position(), nextDir);
-        throughput += bsdf.reflectance() * radiance(scene, nextRay, params, rseq, bounces + 1, bounceLimit) / (pdf * roulette);
+        Ray nextRay = hitpoint.spawnRay(nextDir);
+        const Vector3D nextWeight = bsdf.reflectance() / (pdf * roulette);
+        throughput += nextWeight * radiance(scene, nextRay, params, rseq, weight * nextWeight, gather, bounces + 1, bounceLimit);
     }
     return throughput;
 }
@@ -22,7 +22,16 @@
 
 class PPM_PROBABILISTIC_DLL ProgressivePhotonMappingProb : private IReadOnly {
 private:
+    // Diffuse hit point of a camera path waiting for the photon gather
+    struct GatherPoint {
+        Vector3D position;
+        Vector3D normal;
+        Vector3D weight;    // Throughput of the path (the BRDF and the density normalization included)
+        bool isActive;      // False if the path did not end on a diffuse surface
+    };
+
     static const double ALPHA;
+    static const int GATHER_BATCH_SIZE;
     Image _result;
     SubsurfaceIntegrator* _integrator;
     double _radius;
@@ -34,11 +43,23 @@ public:
 
     void render(const Scene& scene, const Camera& camera, const RenderParameters& params, RandomSamplerType randomSamplerType = RANDOM_SAMPLER_PSEUDO_RANDOM);
 
+    // Radius of the disk which contains gatherPhotons photons on average
+    // when numPhotons photons are spread uniformly over the area
+    // @param[in] area: area of the surfaces which store photons
+    // @param[in] numPhotons: number of the photons per pass
+    // @param[in] gatherPhotons: number of the photons to be gathered
+    static double initialRadius(double area, int numPhotons, int gatherPhotons);
+
 private:
     void tracePhotons(const Scene& scene, const Camera& camera, const RenderParameters& params, RandomSampler* hals, int bounceLimit = 64);
     void traceRays(Image* buffer, const Scene& scene, const Camera& camera, const RenderParameters& params, RandomSampler* hals) const;
-    Vector3D executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, int bounceLimit = 64) const;
-    Vector3D radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, int bounces, int bounceLimit = 64) const;
+    void gatherPhotons(Image* buffer, const std::vector<GatherPoint>& gathers, int width) const;
+
+    // Trace a camera path, where the photon gather at the diffuse surface
+    // is deferred to gatherPhotons() and the point is set to the gather.
+    // @return radiance except for the deferred gather
+    Vector3D executePathTracing(const Scene& scene, const Camera& camera, const RenderParameters& params, int pixelX, int pixelY, RandomSequence& rseq, GatherPoint* gather, int bounceLimit = 64) const;
+    Vector3D radiance(const Scene& scene, const Ray& ray, const RenderParameters& params, RandomSequence& rseq, const Vector3D& weight, GatherPoint* gather, int bounces, int bounceLimit = 64) const;
 };
 
 #endif  // _PPM_PROBABILISTIC_H_
\ No newline at end of file
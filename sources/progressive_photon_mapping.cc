@@ -59,10 +59,13 @@ void ProgressivePhotonMapping::render(const Scene& scene, const Camera& camera,
             int id = y * width + x;
             rpoints[id].pixelX = x;
             rpoints[id].pixelY = y;
-            rpoints[id].n = 0;
+            rpoints[id].n = 0.0;
         }
     }
 
+    // Photons of each pass (reused across the passes)
+    std::vector<PhotonStats> stats(numPixels);
+
     // Allocate image
     _result.resize(width, height);
 
@@ -89,7 +92,7 @@ void ProgressivePhotonMapping::render(const Scene& scene, const Camera& camera,
         traceRays(scene, camera, hals, &rpoints);
 
         // 2nd pass: trace photons from lights
-        tracePhotons(scene, hals, params.photons());
+        tracePhotons(scene, hals, &rpoints, &stats, params.photons());
 
         // Save intermediate image
         for (int i = 0; i < numPixels; i++) {
@@ -130,7 +133,7 @@ void ProgressivePhotonMapping::constructHashGrid(std::vector<RenderPoint>& rpoin
     // Initialize radii
     Vector3D iradv(irad, irad, irad);
     for (int i = 0; i < numPixels; i++) {
-        if (rpoints[i].n == 0) {
+        if (rpoints[i].n == 0.0) {
             rpoints[i].r2 = irad * irad;
             rpoints[i].flux = Vector3D(0.0, 0.0, 0.0);
         }
@@ -145,12 +148,14 @@ void ProgressivePhotonMapping::constructHashGrid(std::vector<RenderPoint>& rpoin
 
     hashgrid.init(hashsize, hashscale, bbox);
 
-    // Set render points
+    // Set render points (the grid is read by the photon pass without locks)
+    std::vector<int> items(numPixels);
+    std::vector<BBox> boxes(numPixels);
     for (int i = 0; i < numPixels; i++) {
-        Vector3D boxMin = static_cast<Vector3D>(rpoints[i]) - iradv;
-        Vector3D boxMax = static_cast<Vector3D>(rpoints[i]) + iradv;
-        hashgrid.add(&rpoints[i], boxMin, boxMax);
+        items[i] = i;
+        boxes[i] = BBox(static_cast<Vector3D>(rpoints[i]) - iradv, static_cast<Vector3D>(rpoints[i]) + iradv);
     }
+    hashgrid.construct(items, boxes);
 }
 
 void ProgressivePhotonMapping::traceRays(const Scene& scene, const Camera& camera, Halton* hals, std::vector<RenderPoint>* rpoints) {
@@ -161,26 +166,33 @@ void ProgressivePhotonMapping::traceRays(const Scene& scene, const Camera& camer
     // Generate a ray to cast
     std::cout << "Tracing rays from camera ..." << std::endl;
 
-    // Distribute pixels to each thread
-    std::vector<std::vector<int> > pids(OMP_NUM_CORE);
-    for (int i = 0; i < numPixels; i++) {
-        pids[i % OMP_NUM_CORE].push_back(i);
+    // Distribute blocks of neighboring pixels to each thread
+    const int blockSize = RayPacket::maxSize;
+    const int numBlocks = (numPixels + blockSize - 1) / blockSize;
+    std::vector<std::vector<int> > bids(OMP_NUM_CORE);
+    for (int b = 0; b < numBlocks; b++) {
+        bids[b % OMP_NUM_CORE].push_back(b);
     }
 
     int proc = 0;
     ompfor (int threadID = 0; threadID < OMP_NUM_CORE; threadID++) {
+        RandomSequence rseqs[RayPacket::maxSize];
+        RenderPoint* rps[RayPacket::maxSize];
 
-        const int taskPerThread = (int)pids[threadID].size();
+        const int taskPerThread = (int)bids[threadID].size();
         for (int i = 0; i < taskPerThread; i++) {
-            RandomSequence rseq;
-            hals[threadID].request(200, &rseq);
- 
-            const int pid = pids[threadID][i];
-            executePathTracing(scene, camera, rseq, &rpoints->at(pid));
+            const int pidStart = bids[threadID][i] * blockSize;
+            const int numRays = std::min(blockSize, numPixels - pidStart);
+            for (int k = 0; k < numRays; k++) {
+                hals[threadID].request(200, &rseqs[k]);
+                rps[k] = &rpoints->at(pidStart + k);
+            }
+
+            executePathTracing(scene, camera, rseqs, rps, numRays);
 
             omplock {
-                proc += 1;
-                if (proc % width == 0) {
+                proc += numRays;
+                if ((proc - numRays) / width != proc / width) {
                     printf("%6.2f %% processed ... \r", 100.0 * proc / numPixels);
                 }
             }
@@ -193,13 +205,20 @@ void ProgressivePhotonMapping::traceRays(const Scene& scene, const Camera& camer
     std::cout << "Hash grid constructed !!" << std::endl << std::endl;
 }
 
-void ProgressivePhotonMapping::tracePhotons(const Scene& scene, Halton* hals, int photons, const int bounceLimit) {
+void ProgressivePhotonMapping::tracePhotons(const Scene& scene, Halton* hals, std::vector<RenderPoint>* rpoints, std::vector<PhotonStats>* stats, int photons, const int bounceLimit) {
     std::cout << "Shooting photons ..." << std::endl;
     int proc = 0;
 
+    Timer timer;
+    timer.start();
+
+    // Photons are accumulated to the stats with the radii fixed during the pass
+    const int numPoints = (int)rpoints->size();
+    Assertion((int)stats->size() == numPoints, "stats must be allocated for all the render points");
+
     const int taskPerThread = (photons + OMP_NUM_CORE - 1) / OMP_NUM_CORE;
-    for (int i = 0; i < taskPerThread; i++) {
-        ompfor (int threadID = 0; threadID < OMP_NUM_CORE; threadID++) {
+    ompfor (int threadID = 0; threadID < OMP_NUM_CORE; threadID++) {
+        for (int p = 0; p < taskPerThread; p++) {
             RandomSequence rseq;
             hals[threadID].request(200, &rseq);
 
@@ -240,22 +259,23 @@ void ProgressivePhotonMapping::tracePhotons(const Scene& scene, Halton* hals, in
 
                 if (bsdf.type() == BSDF_TYPE_LAMBERTIAN_BRDF) {
                     // Gather render points
-                    std::vector<RenderPoint*> results;
-                    omplock {
-                        results = hashgrid[hitpoint.position()];
-                    }
+                    const HashGrid<int>::Span results = hashgrid.cell(hitpoint.position());
 
-                    // Update render points
+                    // Accumulate photon to render points
                     for (int i = 0; i < results.size(); i++) {
-                        RenderPoint* rpp = results[i];
-                        const Vector3D v = (*rpp) - hitpoint.position();
-                        if (Vector3D::dot(rpp->normal, hitpoint.normal()) > EPS && (v.squaredNorm() <= rpp->r2)) {
-                            double g = (rpp->n * ALPHA + ALPHA) / (rpp->n * ALPHA + 1.0);
-                            omplock {
-                                rpp->r2 *= g;
-                                rpp->n  += 1;
-                                rpp->flux = (rpp->flux + rpp->weight * currentFlux * invPI) * g;
-                            }
+                        const RenderPoint& rp = (*rpoints)[results[i]];
+                        const Vector3D v = rp - hitpoint.position();
+                        if (Vector3D::dot(rp.normal, hitpoint.normal()) > EPS && (v.squaredNorm() <= rp.r2)) {
+                            PhotonStats& ps = (*stats)[results[i]];
+                            const Vector3D flux = rp.weight * currentFlux * invPI;
+                            ompatomic
+                            ps.flux[0] += flux.x();
+                            ompatomic
+                            ps.flux[1] += flux.y();
+                            ompatomic
+                            ps.flux[2] += flux.z();
+                            ompatomic
+                            ps.count += 1;
                         }
                     }
 
@@ -264,7 +284,7 @@ void ProgressivePhotonMapping::tracePhotons(const Scene& scene, Halton* hals, in
                     if (rands[0] < probability) {
                         double pdf = 1.0;
                         bsdf.sample(currentRay.direction(), orientNormal, rands[1], rands[2], &nextDir, &pdf);
-                        currentRay = Ray(hitpoint.position(), nextDir);
+                        currentRay = hitpoint.spawnRay(nextDir);
                         currentFlux = currentFlux * bsdf.reflectance() / probability;
                     } else {
                         break;
@@ -272,74 +292,122 @@ void ProgressivePhotonMapping::tracePhotons(const Scene& scene, Halton* hals, in
                 } else {
                     double pdf = 1.0;
                     bsdf.sample(currentRay.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
-                    currentRay = Ray(hitpoint.position(), nextDir);
+                    currentRay = hitpoint.spawnRay(nextDir);
                     currentFlux = currentFlux * bsdf.reflectance();
                 }
             }
+
+            if (p % 100 == 99) {
+                omplock {
+                    proc += 100;
+                    printf("%6.2f %% processed ...\r", 100.0 * std::min(proc, photons) / photons);
+                }
+            }
         }
+    }
+    printf("\nFinish !!\n");
 
-        proc += OMP_NUM_CORE;
-        if (proc % 100 == 0) {
-            printf("%6.2f %% processed ...\r", 100.0 * proc / photons);
+    // Radius reduction of PPM with the photons of the pass
+    // N' = N + alpha * M, R'^2 = R^2 * N' / (N + M), tau' = (tau + tau_M) * R'^2 / R^2
+    ompfor (int i = 0; i < numPoints; i++) {
+        PhotonStats& ps = (*stats)[i];
+        if (ps.count > 0) {
+            RenderPoint& rp = (*rpoints)[i];
+            const double g = (rp.n + ALPHA * ps.count) / (rp.n + ps.count);
+            rp.r2 *= g;
+            rp.n += ALPHA * ps.count;
+            rp.flux = (rp.flux + Vector3D(ps.flux[0], ps.flux[1], ps.flux[2])) * g;
+            ps = PhotonStats();
         }
     }
-    printf("\nFinish !!\n\n");
+
+    const double passTime = timer.stop();
+    printf("Photons: %d photons, %.3f sec (%.2f kphotons/s)\n\n", photons, passTime, photons / std::max(passTime, 1.0e-6) * 1.0e-3);
 }
 
-void ProgressivePhotonMapping::executePathTracing(const Scene& scene, const Camera& camera, RandomSequence& rseq, RenderPoint* rp, const int bounceLimit) {
-    Assertion(rp->pixelX >= 0 && rp->pixelY >= 0 && rp->pixelX < camera.imagesize().width() && rp->pixelY < camera.imagesize().height(), "Pixel index out of bounds!!");   
+void ProgressivePhotonMapping::executePathTracing(const Scene& scene, const Camera& camera, RandomSequence* rseqs, RenderPoint** rps, int numRays, const int bounceLimit) {
+    Assertion(numRays <= RayPacket::maxSize, "Too many rays for a ray packet!!");
 
-    double px = rp->pixelX + rseq.pop() - 0.5;
-    double py = rp->pixelY + rseq.pop() - 0.5;
-    Ray ray = camera.getRay(px, py);
     const double coeff = camera.sensitivity();
+    Ray rays[RayPacket::maxSize];
+    Vector3D weights[RayPacket::maxSize];
+    Vector3D throughputs[RayPacket::maxSize];
+    for (int k = 0; k < numRays; k++) {
+        const RenderPoint* rp = rps[k];
+        Assertion(rp->pixelX >= 0 && rp->pixelY >= 0 && rp->pixelX < camera.imagesize().width() && rp->pixelY < camera.imagesize().height(), "Pixel index out of bounds!!");   
+
+        double px = rp->pixelX + rseqs[k].pop() - 0.5;
+        double py = rp->pixelY + rseqs[k].pop() - 0.5;
+        rays[k] = camera.getRay(px, py);
+        weights[k] = Vector3D(1.0, 1.0, 1.0);
+        throughputs[k] = Vector3D(0.0, 0.0, 0.0);
+    }
+
+    // Rays which are not terminated yet are traced as a packet
+    RayPacket packet;
+    int rayIDs[RayPacket::maxSize];
+    int aliveMask = (1 << numRays) - 1;
+    for (int bounce = 0; aliveMask != 0; bounce++) {
+        packet.clear();
+        for (int k = 0; k < numRays; k++) {
+            if (aliveMask & (1 << k)) rayIDs[packet.add(rays[k])] = k;
+        }
 
-    Intersection isect;
-    Vector3D weight(1.0, 1.0, 1.0);
-    Vector3D throughput(0.0, 0.0, 0.0);
-
-    for (int bounce = 0; ; bounce++) {
-        // Terminate trace if the bounces reach limit or not intersect the scene
-        if (bounce >= bounceLimit || !scene.intersect(ray, isect)) {
-            rp->weight = weight;
-            rp->coeff  = coeff;
-            rp->emission += throughput + weight * scene.envmap().sampleFromDir(ray.direction());
-            break;
+        if (bounce < bounceLimit) {
+            scene.intersect(packet);
         }
 
-        // Request random numbers
-        const double rands[2] = { rseq.pop(), rseq.pop() };
-
-        // Next bounce
-        const int objectID = isect.objectID();
-        const Hitpoint& hitpoint = isect.hitpoint();
-        const BSDF& bsdf = scene.getBsdf(objectID);
-        const Vector3D orientNormal = Vector3D::dot(hitpoint.normal(), ray.direction()) < 0.0 ? hitpoint.normal() : -hitpoint.normal();
-
-        if (bsdf.type() == BSDF_TYPE_LAMBERTIAN_BRDF) {
-            weight = weight * bsdf.reflectance();
-            rp->setPosition(hitpoint.position());
-            rp->normal = hitpoint.normal();
-            rp->weight = weight;
-            rp->coeff  = coeff;
-            rp->emission += throughput;
-            break;
-        } else if (bsdf.type() != BSDF_TYPE_BSSRDF) {
-            double pdf = 1.0;
-            Vector3D nextDir;
-            bsdf.sample(ray.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
-            ray = Ray(hitpoint.position(), nextDir);
-            weight = weight * bsdf.reflectance() / pdf;
-        } else {
-            const double reflectProbability = 0.25 + REFLECT_PROBABILITY * 0.5;
-            Vector3D irad = _integrator->irradiance(hitpoint.position(), bsdf);
-            throughput += weight * irad * (1.0 - reflectProbability);
-
-            Vector3D nextDir;
-            double pdf = 1.0;
-            bsdf.sample(ray.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
-            ray = Ray(hitpoint.position(), nextDir);
-            weight = weight * bsdf.reflectance() * reflectProbability / pdf;
+        for (int j = 0; j < packet.size(); j++) {
+            const int k = rayIDs[j];
+            const Ray& ray = packet.ray(j);
+            const Intersection& isect = packet.intersection(j);
+            RenderPoint* rp = rps[k];
+            Vector3D& weight = weights[k];
+            Vector3D& throughput = throughputs[k];
+
+            // Terminate trace if the bounces reach limit or not intersect the scene
+            if (bounce >= bounceLimit || isect.objectID() < 0) {
+                rp->weight = weight;
+                rp->coeff  = coeff;
+                rp->emission += throughput + weight * scene.envmap().sampleFromDir(ray.direction());
+                aliveMask &= ~(1 << k);
+                continue;
+            }
+
+            // Request random numbers
+            const double rands[2] = { rseqs[k].pop(), rseqs[k].pop() };
+
+            // Next bounce
+            const int objectID = isect.objectID();
+            const Hitpoint& hitpoint = isect.hitpoint();
+            const BSDF& bsdf = scene.getBsdf(objectID);
+            const Vector3D orientNormal = Vector3D::dot(hitpoint.normal(), ray.direction()) < 0.0 ? hitpoint.normal() : -hitpoint.normal();
+
+            if (bsdf.type() == BSDF_TYPE_LAMBERTIAN_BRDF) {
+                weight = weight * bsdf.reflectance();
+                rp->setPosition(hitpoint.position());
+                rp->normal = hitpoint.normal();
+                rp->weight = weight;
+                rp->coeff  = coeff;
+                rp->emission += throughput;
+                aliveMask &= ~(1 << k);
+            } else if (bsdf.type() != BSDF_TYPE_BSSRDF) {
+                double pdf = 1.0;
+                Vector3D nextDir;
+                bsdf.sample(ray.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
+                rays[k] = hitpoint.spawnRay(nextDir);
+                weight = weight * bsdf.reflectance() / pdf;
+            } else {
+                const double reflectProbability = 0.25 + REFLECT_PROBABILITY * 0.5;
+                Vector3D irad = _integrator->irradiance(hitpoint.position(), bsdf);
+                throughput += weight * irad * (1.0 - reflectProbability);
+
+                Vector3D nextDir;
+                double pdf = 1.0;
+                bsdf.sample(ray.direction(), orientNormal, rands[0], rands[1], &nextDir, &pdf);
+                rays[k] = hitpoint.spawnRay(nextDir);
+                weight = weight * bsdf.reflectance() * reflectProbability / pdf;
+            }
         }
     }
 }
@@ -34,7 +34,7 @@ private:
         double coeff;
         int pixelX, pixelY;
         double r2;
-        int n;
+        double n;    // Accumulated number of photons (N of PPM)
 
         explicit RenderPoint(const Vector3D& v = Vector3D())
             : Vector3D(v)
@@ -46,7 +46,7 @@ private:
             , pixelX(-1)
             , pixelY(-1)
             , r2(0.0)
-            , n(0)
+            , n(0.0)
         {
         }
 
@@ -60,7 +60,7 @@ private:
             , pixelX(-1)
             , pixelY(-1)
             , r2(0.0)
-            , n(0)
+            , n(0.0)
         {
             this->operator=(rp);
         }
@@ -84,8 +84,22 @@ private:
         }
     };
 
+    // Photons gathered by a render point during a photon pass
+    // Threads add to them with atomics, and they are merged into the render
+    // point (and cleared) at the end of the pass.
+    struct PhotonStats {
+        double flux[3];
+        int count;
+
+        PhotonStats()
+            : count(0)
+        {
+            flux[0] = flux[1] = flux[2] = 0.0;
+        }
+    };
+
 private:
-    HashGrid<RenderPoint*> hashgrid;
+    HashGrid<int> hashgrid;
     static const double ALPHA;
 
     Image _result;
@@ -103,8 +117,11 @@ public:
 private:
     void constructHashGrid(std::vector<RenderPoint>& rpoints, const int imageW, const int imageH);
     void traceRays(const Scene& scene, const Camera& camera, Halton* hals, std::vector<RenderPoint>* rpoints);
-    void tracePhotons(const Scene& scene, Halton* hals, int photons, const int bounceLimit = 64);
-    void executePathTracing(const Scene& scene, const Camera& camera, RandomSequence& rseq, RenderPoint* rp, const int bounceLimit = 64);
+    void tracePhotons(const Scene& scene, Halton* hals, std::vector<RenderPoint>* rpoints, std::vector<PhotonStats>* stats, int photons, const int bounceLimit = 64);
+    // Trace the rays for the render points together
+    // Rays are intersected as a ray packet at each bounce, so that
+    // primary rays and coherent specular bounces share traversal.
+    void executePathTracing(const Scene& scene, const Camera& camera, RandomSequence* rseqs, RenderPoint** rps, int numRays, const int bounceLimit = 64);
 };
 
 #endif  // _PROGRESSIVE_PHOTON_MAPPING_H_
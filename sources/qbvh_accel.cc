@@ -1,12 +1,14 @@
 #include "qbvh_accel.h"
 
-#include <stack>
 #include <cmath>
 #include <cstring>
+#include <fstream>
 #include <algorithm>
+#include <emmintrin.h>
 
 #include "common.h"
 #include "bbox.h"
+#include "parallel.h"
 
 namespace {
     
@@ -18,24 +20,20 @@ namespace {
     __m128 simdNinf = _mm_load_ps(ninfs);
     __m128 simdZero = _mm_load_ps(zeros);
 
-    static const int orderTable[] = {
-        //+++      -++      +-+      --+      ++-      -+-      +--      ---       <-- right, left, top
-        0x44444, 0x44444, 0x44444, 0x44444, 0x44444, 0x44444, 0x44444, 0x44444,  // --|-- (TL, TR | BL, BR)
-        0x44440, 0x44440, 0x44440, 0x44440, 0x44440, 0x44440, 0x44440, 0x44440,  // +-|--
-        0x44441, 0x44441, 0x44441, 0x44441, 0x44441, 0x44441, 0x44441, 0x44441,  // -+|--
-        0x44401, 0x44401, 0x44410, 0x44410, 0x44401, 0x44401, 0x44410, 0x44410,  // ++|--
-        0x44442, 0x44442, 0x44442, 0x44442, 0x44442, 0x44442, 0x44442, 0x44442,  // --|+-
-        0x44402, 0x44402, 0x44402, 0x44402, 0x44420, 0x44420, 0x44420, 0x44420,  // +-|+-
-        0x44412, 0x44412, 0x44412, 0x44412, 0x44421, 0x44421, 0x44421, 0x44421,  // -+|+-
-        0x44012, 0x44012, 0x44102, 0x44102, 0x44201, 0x44201, 0x44210, 0x44210,  // ++|+-
-        0x44443, 0x44443, 0x44443, 0x44443, 0x44443, 0x44443, 0x44443, 0x44443,  // --|-+
-        0x44403, 0x44403, 0x44403, 0x44403, 0x44430, 0x44430, 0x44430, 0x44430,  // +-|-+
-        0x44413, 0x44413, 0x44413, 0x44413, 0x44431, 0x44431, 0x44431, 0x44431,  // -+|-+
-        0x44013, 0x44013, 0x44103, 0x44103, 0x44301, 0x44301, 0x44310, 0x44310,  // ++|-+
-        0x44423, 0x44432, 0x44423, 0x44432, 0x44423, 0x44432, 0x44423, 0x44432,  // --|++
-        0x44023, 0x44032, 0x44023, 0x44032, 0x44230, 0x44320, 0x44230, 0x44320,  // +-|++
-        0x44123, 0x44132, 0x44123, 0x44132, 0x44231, 0x44321, 0x44231, 0x44321,  // -+|++
-        0x40123, 0x40132, 0x41023, 0x41032, 0x42301, 0x43201, 0x42310, 0x43210,  // ++|++
+    __m128 simdOne = _mm_set1_ps(1.0f);
+
+    // Rounding error bounds of the watertight triangle test and the slab test
+    __m128 simdGamma2 = _mm_set1_ps(accel::errorGamma(2));
+    __m128 simdGamma3 = _mm_set1_ps(accel::errorGamma(3));
+    __m128 simdGamma5 = _mm_set1_ps(accel::errorGamma(5));
+    __m128 simdBoxScale = _mm_set1_ps(accel::boxErrorScale());
+
+    // Bit of each ray in a packet (for accumulating ray masks in SIMD lanes)
+    __m128 simdRayBits[] = {
+        _mm_castsi128_ps(_mm_set1_epi32(1 << 0)), _mm_castsi128_ps(_mm_set1_epi32(1 << 1)),
+        _mm_castsi128_ps(_mm_set1_epi32(1 << 2)), _mm_castsi128_ps(_mm_set1_epi32(1 << 3)),
+        _mm_castsi128_ps(_mm_set1_epi32(1 << 4)), _mm_castsi128_ps(_mm_set1_epi32(1 << 5)),
+        _mm_castsi128_ps(_mm_set1_epi32(1 << 6)), _mm_castsi128_ps(_mm_set1_epi32(1 << 7)),
     };
 
     class AxisComparator {
@@ -50,36 +48,136 @@ namespace {
         bool operator()(const TriangleWithID& t1, const TriangleWithID& t2) const {
             return t1.first.gravity()[d] < t2.first.gravity()[d];
         }
+
+        template <class Ty>
+        bool operator()(const Ty& t1, const Ty& t2) const {
+            return t1.gravity[d] < t2.gravity[d];
+        }
     };
 
-    BBox enclosingBox(const std::vector<TriangleWithID>& triangles) {
-        Vector3D posMin(INFTY, INFTY, INFTY);
-        Vector3D posMax(-INFTY, -INFTY, -INFTY);
-        const int nTri = (int)triangles.size();
-        for (int i = 0; i < nTri; i++) {
-            for (int j = 0; j < 3; j++) {
-                posMin = Vector3D::minimum(posMin, triangles[i].first.p(j));
-                posMax = Vector3D::maximum(posMax, triangles[i].first.p(j));
-            }
+    // Predicate to partition triangles by SAH bins along an axis
+    template <class Ty>
+    class BinPredicate {
+    private:
+        int d;
+        double lo;
+        double scale;
+        int nBins;
+        int split;
+    public:
+        BinPredicate(int dim, double lo_, double scale_, int nBins_, int split_)
+            : d(dim), lo(lo_), scale(scale_), nBins(nBins_), split(split_) {}
+        bool operator()(const Ty& t) const {
+            return binIndex(t.centroid[d], lo, scale, nBins) <= split;
+        }
+
+        static int binIndex(double v, double lo, double scale, int nBins) {
+            const int b = static_cast<int>((v - lo) * scale);
+            return std::max(0, std::min(b, nBins - 1));
+        }
+    };
+
+    // Start index of a chunk when the range is divided into chunks
+    inline int chunkStart(int startID, int endID, int c, int numChunks) {
+        return startID + static_cast<int>((long long)(endID - startID) * c / numChunks);
+    }
+
+    template <class Ty>
+    void mergeBoxes(const std::vector<Ty>& triangles, int startID, int endID, BBox* box) {
+        for (int i = startID; i < endID; i++) {
+            box->merge(triangles[i].box);
+        }
+    }
+
+    template <class Ty>
+    void mergeCentroids(const std::vector<Ty>& triangles, int startID, int endID, BBox* box) {
+        for (int i = startID; i < endID; i++) {
+            box->merge(triangles[i].centroid);
+        }
+    }
+
+    template <class Ty>
+    void binTriangles(const std::vector<Ty>& triangles, int startID, int endID, int dim, double lo, double scale, int nBins, BBox* boxes, int* counts) {
+        for (int i = startID; i < endID; i++) {
+            const int b = BinPredicate<Ty>::binIndex(triangles[i].centroid[dim], lo, scale, nBins);
+            boxes[b].merge(triangles[i].box);
+            counts[b] += 1;
+        }
+    }
+
+    // Bounding box of the triangles in the range (computed in parallel for large ranges)
+    template <class Ty>
+    BBox rangeBox(const std::vector<Ty>& triangles, int startID, int endID, int grain) {
+        BBox ret;
+        if (endID - startID <= grain) {
+            mergeBoxes(triangles, startID, endID, &ret);
+            return ret;
+        }
+
+        const int numChunks = parallel::numChunks();
+        std::vector<BBox> boxes(numChunks);
+        ompfor (int c = 0; c < numChunks; c++) {
+            mergeBoxes(triangles, chunkStart(startID, endID, c, numChunks), chunkStart(startID, endID, c + 1, numChunks), &boxes[c]);
         }
-        return BBox(posMin, posMax);
+
+        for (int c = 0; c < numChunks; c++) {
+            ret.merge(boxes[c]);
+        }
+        return ret;
+    }
+
+    inline __m128 simdAbs(const __m128& a) {
+        return _mm_max_ps(a, _mm_sub_ps(simdZero, a));
+    }
+
+    inline __m128 simdMax3(const __m128& a, const __m128& b, const __m128& c) {
+        return _mm_max_ps(_mm_max_ps(a, b), c);
     }
 
 }
 
+const double QBVHAccel::_traversalCost = 1.0;
+const double QBVHAccel::_intersectCost = 1.0;
+const double QBVHAccel::_sbvhDuplicationBudget = 0.3;
+const double QBVHAccel::_sbvhOverlapRatio = 1.0e-5;
+
 QBVHAccel::QBVHAccel()
-    : _root(NULL)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
 {
 }
 
 QBVHAccel::QBVHAccel(const QBVHAccel& qbvh)
-    : _root(NULL)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
 {
     this->operator=(qbvh);
 }
 
 QBVHAccel::QBVHAccel(QBVHAccel&& qbvh) 
-    : _root(NULL)
+    : _nodes(NULL)
+    , _numNodes(0)
+    , _packets(NULL)
+    , _numPackets(0)
+    , _stackSize(0)
+    , _buildType(ACCEL_BUILD_SAH)
+    , _buildCost(0.0)
+    , _triangles()
+    , _mappedFile()
 {
     this->operator=(std::move(qbvh));    
 }
@@ -90,96 +188,378 @@ QBVHAccel::~QBVHAccel()
 }
 
 QBVHAccel& QBVHAccel::operator=(const QBVHAccel& qbvh) {
+    if (this == &qbvh) return *this;
+
     release();
 
-    _root = copyNode(qbvh._root);
+    if (qbvh._numNodes > 0) {
+        _nodes = (QBVHNode*)align_alloc(sizeof(QBVHNode) * qbvh._numNodes, 64);
+        memcpy((void*)_nodes, (void*)qbvh._nodes, sizeof(QBVHNode) * qbvh._numNodes);
+    }
+    _numNodes = qbvh._numNodes;
+
+    if (qbvh._numPackets > 0) {
+        _packets = (TrianglePacket*)align_alloc(sizeof(TrianglePacket) * qbvh._numPackets, 16);
+        memcpy((void*)_packets, (void*)qbvh._packets, sizeof(TrianglePacket) * qbvh._numPackets);
+    }
+    _numPackets = qbvh._numPackets;
+    _stackSize = qbvh._stackSize;
+    _buildType = qbvh._buildType;
+    _buildCost = qbvh._buildCost;
+    _triangles = qbvh._triangles;
 
     return *this;
 }
 
 QBVHAccel& QBVHAccel::operator=(QBVHAccel&& qbvh) {
+    if (this == &qbvh) return *this;
+
     release();
 
-    _root = qbvh._root;
-    qbvh._root = nullptr;
+    _nodes = qbvh._nodes;
+    _numNodes = qbvh._numNodes;
+    _packets = qbvh._packets;
+    _numPackets = qbvh._numPackets;
+    _stackSize = qbvh._stackSize;
+    _buildType = qbvh._buildType;
+    _buildCost = qbvh._buildCost;
+    _triangles = std::move(qbvh._triangles);
+    _mappedFile = std::move(qbvh._mappedFile);
+    qbvh._nodes = NULL;
+    qbvh._numNodes = 0;
+    qbvh._packets = NULL;
+    qbvh._numPackets = 0;
 
     return *this;
 }
 
 void QBVHAccel::release() {
-    deleteNode(_root);
+    // Nodes and packets loaded from a cache are unmapped with the file
+    if (_mappedFile == NULL) {
+        align_free(_nodes);
+        align_free(_packets);
+    }
+    _mappedFile.reset();
+    _nodes = NULL;
+    _numNodes = 0;
+    _packets = NULL;
+    _numPackets = 0;
+    _stackSize = 0;
+    _triangles.clear();
 }
 
-void QBVHAccel::deleteNode(QBVHNode* node) {
-    if (node != NULL) {
-        for (int i = 0; i < 4; i++) {
-            deleteNode(node->children[i]);
+void QBVHAccel::construct(const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    static_assert(sizeof(QBVHNode) == 128, "QBVHNode must fit into two cache lines");
+
+    release();
+
+    // Triangles are referred to while building (SBVH clips them)
+    _triangles = triangles;
+
+    const int numTriangles = (int)triangles.size();
+    Assertion(numTriangles * (1.0 + _sbvhDuplicationBudget) < (1 << (31 - _leafCountBits)), "Too many triangles for QBVH leaf entries");
+
+    std::vector<BuildTriangle> temp(numTriangles);
+    ompfor (int i = 0; i < numTriangles; i++) {
+        temp[i].box = BBox::fromTriangle(triangles[i]);
+        temp[i].centroid = (temp[i].box.posMin() + temp[i].box.posMax()) * 0.5;
+        temp[i].gravity = triangles[i].gravity();
+        temp[i].morton = 0;
+        temp[i].index = i;
+    }
+
+    // LBVH splits the triangles sorted once by Morton codes
+    if (buildType == ACCEL_BUILD_LBVH) {
+        sortMorton(temp);
+    }
+
+    // The root is always the node 0. A scene small enough to be
+    // a single leaf is wrapped with a root node.
+    std::vector<QBVHNode> nodes;
+    nodes.reserve(std::max(1, numTriangles / 2));
+    if (numTriangles <= _maxNodeSize) {
+        const int bounds[5] = { 0, numTriangles, numTriangles, numTriangles, numTriangles };
+        const int axes[3] = { 0, 0, 0 };
+        makeNode(temp, bounds, axes, nodes);
+        nodes[0].children[0] = leafEntry(0, numTriangles);
+    } else if (buildType == ACCEL_BUILD_SBVH) {
+        // References are reordered (and duplicated) into the leaves one by one
+        const double rootArea = rangeBox(temp, 0, numTriangles, _parallelGrain).area();
+        int budget = static_cast<int>(numTriangles * _sbvhDuplicationBudget);
+        std::vector<BuildTriangle> ordered;
+        ordered.reserve(numTriangles + budget);
+        constructSBVHRec(temp, rootArea, nodes, ordered, &budget);
+        temp.swap(ordered);
+    } else {
+        // Top levels are split with parallel binning and partitioning.
+        // Smaller subtrees are deferred and built concurrently.
+        std::vector<BuildTask> tasks;
+        constructRec(temp, 0, numTriangles, 0, buildType, nodes, numTriangles > _parallelGrain ? &tasks : NULL);
+
+        // Larger subtrees are scheduled first
+        const int numTasks = (int)tasks.size();
+        std::vector<std::pair<int, int> > order(numTasks);
+        for (int i = 0; i < numTasks; i++) {
+            order[i] = std::make_pair(-(tasks[i].endID - tasks[i].startID), i);
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<std::vector<QBVHNode> > subtrees(numTasks);
+        ompfor_dynamic (int k = 0; k < numTasks; k++) {
+            const BuildTask& task = tasks[order[k].second];
+            constructRec(temp, task.startID, task.endID, task.dim, buildType, subtrees[order[k].second], NULL);
+        }
+
+        // Append subtrees in the order of tasks, so that the result
+        // does not depend on the number of threads.
+        for (int k = 0; k < numTasks; k++) {
+            const unsigned int offset = static_cast<unsigned int>(nodes.size());
+            for (int i = 0; i < (int)subtrees[k].size(); i++) {
+                QBVHNode node = subtrees[k][i];
+                for (int c = 0; c < 4; c++) {
+                    if (!isLeaf(node.children[c])) node.children[c] += offset;
+                }
+                nodes.push_back(node);
+            }
+            nodes[tasks[k].parentID].children[tasks[k].slot] = offset;
+            std::vector<QBVHNode>().swap(subtrees[k]);
         }
-        delete node;
-        node = NULL;
     }
+
+    // Copy nodes to the aligned buffer, and pack triangles of each leaf
+    _numNodes = (int)nodes.size();
+    _nodes = (QBVHNode*)align_alloc(sizeof(QBVHNode) * _numNodes, 64);
+    memcpy((void*)_nodes, (void*)&nodes[0], sizeof(QBVHNode) * _numNodes);
+
+    makePackets(temp);
+
+    // Each internal node on the path from the root leaves at most three siblings on the stack
+    _stackSize = 3 * depthRec(0) + 1;
+
+    _buildType = buildType;
+    _buildCost = sahCost();
 }
 
-QBVHAccel::QBVHNode* QBVHAccel::copyNode(QBVHNode* node) {
-    QBVHNode* ret = NULL;
-    if (node != NULL) {
-        ret = new QBVHNode();
-        memcpy((void*)ret->childBoxes, (void*)node->childBoxes, sizeof(__m128) * 6);
-        ret->triangles = node->triangles;
-        memcpy((void*)ret->sepAxes, (void*)node->sepAxes, sizeof(char) * 3);
-        ret->isLeaf = node->isLeaf;
+bool QBVHAccel::refit(const std::vector<Triangle>& triangles, double maxCostRatio) {
+    Assertion(triangles.size() == _triangles.size(), "Number of triangles is changed after construction");
 
-        for (int i = 0; i < 4; i++) {
-            ret->children[i] = copyNode(node->children[i]);
+    _triangles = triangles;
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    ompfor (int i = 0; i < _numPackets; i++) {
+        int ids[4];
+        int count = 0;
+        for (; count < 4 && _packets[i].ids[count] >= 0; count++) {
+            ids[count] = _packets[i].ids[count];
         }
+        setPacket(_triangles, ids, count, &_packets[i]);
     }
-    return ret;
+
+    // Children are always stored after their parents, so the boxes
+    // are updated bottom-up by visiting the nodes in reverse order.
+    std::vector<BBox> nodeBoxes(_numNodes);
+    for (int i = _numNodes - 1; i >= 0; i--) {
+        BBox boxes[4];
+        for (int c = 0; c < 4; c++) {
+            const unsigned int entry = _nodes[i].children[c];
+            if (entry == _emptyLeaf) continue;
+
+            if (isLeaf(entry)) {
+                const TrianglePacket& packet = _packets[leafStart(entry)];
+                for (int k = 0; k < leafCount(entry); k++) {
+                    boxes[c].merge(BBox::fromTriangle(_triangles[packet.ids[k]]));
+                }
+            } else {
+                boxes[c] = nodeBoxes[entry];
+            }
+            nodeBoxes[i].merge(boxes[c]);
+        }
+        setChildBoxes(boxes, &_nodes[i]);
+    }
+
+    if (sahCost() > maxCostRatio * _buildCost) {
+        construct(triangles, _buildType);
+        return true;
+    }
+    return false;
 }
 
-void QBVHAccel::construct(const std::vector<Triangle>& triangles) {
-    release();
+int QBVHAccel::depthRec(int nodeID) const {
+    int depth = 0;
+    for (int i = 0; i < 4; i++) {
+        const unsigned int child = _nodes[nodeID].children[i];
+        if (!isLeaf(child)) {
+            depth = std::max(depth, depthRec(child));
+        }
+    }
+    return depth + 1;
+}
 
-    const int numTriangles = (int)triangles.size();
-    std::vector<TriangleWithID> temp(numTriangles);
-    for (int i = 0; i < numTriangles; i++) {
-        temp[i] = TriangleWithID(triangles[i], i);
+void QBVHAccel::makePackets(const std::vector<BuildTriangle>& triangles) {
+    // Leaf entries refer to ranges of the build triangles at this point.
+    // They are replaced with packet indices in the order of nodes.
+    std::vector<unsigned int*> leaves;
+    for (int i = 0; i < _numNodes; i++) {
+        for (int c = 0; c < 4; c++) {
+            const unsigned int entry = _nodes[i].children[c];
+            if (isLeaf(entry) && entry != _emptyLeaf) {
+                leaves.push_back(&_nodes[i].children[c]);
+            }
+        }
+    }
+
+    _numPackets = (int)leaves.size();
+    if (_numPackets == 0) {
+        return;
+    }
+
+    _packets = (TrianglePacket*)align_alloc(sizeof(TrianglePacket) * _numPackets, 16);
+    ompfor (int i = 0; i < _numPackets; i++) {
+        const unsigned int entry = *leaves[i];
+        int ids[4];
+        for (int k = 0; k < leafCount(entry); k++) {
+            ids[k] = triangles[leafStart(entry) + k].index;
+        }
+        setPacket(_triangles, ids, leafCount(entry), &_packets[i]);
+        *leaves[i] = leafEntry(i, leafCount(entry));
     }
-    _root = constructRec(temp, 0);
 }
-    
-QBVHAccel::QBVHNode* QBVHAccel::constructRec(std::vector<TriangleWithID>& triangles, int dim) {
-    const int nTri = static_cast<int>(triangles.size());
 
-    if (triangles.size() <= _maxNodeSize) {
-        QBVHNode* node = new QBVHNode();
-        node->triangles.resize(nTri);
-        std::copy(triangles.begin(), triangles.end(), node->triangles.begin());
-        node->isLeaf = true;
-        return node;
+void QBVHAccel::setPacket(const std::vector<Triangle>& triangles, const int* ids, int count, TrianglePacket* packet) {
+    Assertion(count <= 4, "Triangle packet can store at most 4 triangles");
+
+    align_attrib(float, 16) vals[3][3][4];    // [p0-p1-p2][x-y-z][lane]
+    memset(vals, 0, sizeof(vals));
+    for (int k = 0; k < 4; k++) {
+        if (k >= count) {
+            packet->ids[k] = -1;
+            continue;
+        }
+
+        const int index = ids[k];
+        const Triangle& tri = triangles[index];
+        for (int i = 0; i < 3; i++) {
+            const Vector3D p = tri.p(i);
+            for (int d = 0; d < 3; d++) {
+                vals[i][d][k] = static_cast<float>(p[d]);
+            }
+        }
+        packet->ids[k] = index;
+    }
+
+    for (int d = 0; d < 3; d++) {
+        packet->p0[d] = _mm_load_ps(vals[0][d]);
+        packet->p1[d] = _mm_load_ps(vals[1][d]);
+        packet->p2[d] = _mm_load_ps(vals[2][d]);
     }
+}
 
-    std::sort(triangles.begin(), triangles.end(), AxisComparator(dim));
-        
-    const int mid = nTri / 2;
-    std::sort(triangles.begin(), triangles.begin() + mid, AxisComparator((dim + 1) % 3));
-    std::sort(triangles.begin() + mid, triangles.end(), AxisComparator((dim + 1) % 3));
+void QBVHAccel::intersectPacket(const TrianglePacket& packet, const SimdRay& ray, HitRecord* record) {
+    // Watertight test of Woop et al. for four triangles at once. Vertices are
+    // translated to the ray origin, and sheared and scaled so that the ray goes
+    // along +z. Then the ray hits the triangle iff the 2D edge functions of the
+    // sheared vertices at the origin have the same signs.
+    const int kx = ray.axes[0];
+    const int ky = ray.axes[1];
+    const int kz = ray.axes[2];
 
-    std::vector<TriangleWithID> c0(triangles.begin(), triangles.begin() + (mid / 2));
-    std::vector<TriangleWithID> c1(triangles.begin() + (mid / 2), triangles.begin() + mid);
-    std::vector<TriangleWithID> c2(triangles.begin() + mid, triangles.begin() + (mid + mid / 2));
-    std::vector<TriangleWithID> c3(triangles.begin() + (mid + mid / 2), triangles.end());
+    const __m128 az = _mm_sub_ps(packet.p0[kz], ray.orig[kz]);
+    const __m128 bz = _mm_sub_ps(packet.p1[kz], ray.orig[kz]);
+    const __m128 cz = _mm_sub_ps(packet.p2[kz], ray.orig[kz]);
+    const __m128 ax = _mm_sub_ps(_mm_sub_ps(packet.p0[kx], ray.orig[kx]), _mm_mul_ps(ray.shear[0], az));
+    const __m128 ay = _mm_sub_ps(_mm_sub_ps(packet.p0[ky], ray.orig[ky]), _mm_mul_ps(ray.shear[1], az));
+    const __m128 bx = _mm_sub_ps(_mm_sub_ps(packet.p1[kx], ray.orig[kx]), _mm_mul_ps(ray.shear[0], bz));
+    const __m128 by = _mm_sub_ps(_mm_sub_ps(packet.p1[ky], ray.orig[ky]), _mm_mul_ps(ray.shear[1], bz));
+    const __m128 cx = _mm_sub_ps(_mm_sub_ps(packet.p2[kx], ray.orig[kx]), _mm_mul_ps(ray.shear[0], cz));
+    const __m128 cy = _mm_sub_ps(_mm_sub_ps(packet.p2[ky], ray.orig[ky]), _mm_mul_ps(ray.shear[1], cz));
 
-    BBox boxes[4];
-    boxes[0] = enclosingBox(c0);
-    boxes[1] = enclosingBox(c1);
-    boxes[2] = enclosingBox(c2);
-    boxes[3] = enclosingBox(c3);
+    // Edge functions (barycentric coordinates scaled by the determinant)
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    // Unused lanes are excluded from the double precision fallback
+    const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128((const __m128i*)packet.ids), _mm_set1_epi32(-1)));
+    const __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, simdZero), _mm_cmpeq_ps(e1, simdZero)), _mm_cmpeq_ps(e2, simdZero));
+    const int edgeMask = _mm_movemask_ps(_mm_and_ps(valid, onEdge));
+    if (edgeMask != 0) {
+        align_attrib(float, 16) vals[9][4];
+        const __m128 regs[9] = { ax, ay, bx, by, cx, cy, e0, e1, e2 };
+        for (int i = 0; i < 9; i++) {
+            _mm_store_ps(vals[i], regs[i]);
+        }
+        for (int k = 0; k < 4; k++) {
+            if ((edgeMask & (1 << k)) == 0) continue;
+            vals[6][k] = accel::edgeFunction(vals[4][k], vals[5][k], vals[2][k], vals[3][k]);
+            vals[7][k] = accel::edgeFunction(vals[0][k], vals[1][k], vals[4][k], vals[5][k]);
+            vals[8][k] = accel::edgeFunction(vals[2][k], vals[3][k], vals[0][k], vals[1][k]);
+        }
+        e0 = _mm_load_ps(vals[6]);
+        e1 = _mm_load_ps(vals[7]);
+        e2 = _mm_load_ps(vals[8]);
+    }
+
+    // Unused lanes have zero determinants and are rejected here
+    const __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+    const __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, simdZero), _mm_cmplt_ps(e1, simdZero)), _mm_cmplt_ps(e2, simdZero));
+    const __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, simdZero), _mm_cmpgt_ps(e1, simdZero)), _mm_cmpgt_ps(e2, simdZero));
+    __m128 mask = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, simdZero));
+    if (_mm_movemask_ps(mask) == 0) {
+        return;
+    }
 
-    QBVHNode* node = new QBVHNode();
+    // Distance along the ray
+    const __m128 azs = _mm_mul_ps(ray.shear[2], az);
+    const __m128 bzs = _mm_mul_ps(ray.shear[2], bz);
+    const __m128 czs = _mm_mul_ps(ray.shear[2], cz);
+    const __m128 invdet = _mm_div_ps(simdOne, det);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, azs), _mm_mul_ps(e1, bzs)), _mm_mul_ps(e2, czs)), invdet);
+
+    // Hits closer than the rounding error of t are rejected. This conservative
+    // bound (Pharr et al.) replaces a fixed epsilon, so that rays spawned on
+    // surfaces do not hit them again without missing nearby surfaces.
+    const __m128 maxZ = simdMax3(simdAbs(azs), simdAbs(bzs), simdAbs(czs));
+    const __m128 maxX = simdMax3(simdAbs(ax), simdAbs(bx), simdAbs(cx));
+    const __m128 maxY = simdMax3(simdAbs(ay), simdAbs(by), simdAbs(cy));
+    const __m128 maxE = simdMax3(simdAbs(e0), simdAbs(e1), simdAbs(e2));
+    const __m128 deltaZ = _mm_mul_ps(simdGamma3, maxZ);
+    const __m128 deltaX = _mm_mul_ps(simdGamma5, _mm_add_ps(maxX, maxZ));
+    const __m128 deltaY = _mm_mul_ps(simdGamma5, _mm_add_ps(maxY, maxZ));
+    const __m128 deltaE = _mm_mul_ps(_mm_set1_ps(2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(simdGamma2, maxX), maxY),
+                                                                               _mm_mul_ps(deltaY, maxX)), _mm_mul_ps(deltaX, maxY)));
+    const __m128 deltaT = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(simdGamma3, maxE), maxZ),
+                                                                                         _mm_mul_ps(deltaE, maxZ)), _mm_mul_ps(deltaZ, maxE))),
+                                     simdAbs(invdet));
+
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, deltaT));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(record->t)));
+
+    const int hitMask = _mm_movemask_ps(mask);
+    if (hitMask == 0) {
+        return;
+    }
+
+    align_attrib(float, 16) ts[4], us[4], vs[4];
+    _mm_store_ps(ts, t);
+    _mm_store_ps(us, _mm_mul_ps(e1, invdet));
+    _mm_store_ps(vs, _mm_mul_ps(e2, invdet));
+    for (int k = 0; k < 4; k++) {
+        if ((hitMask & (1 << k)) != 0 && ts[k] < record->t) {
+            record->id = packet.ids[k];
+            record->t = ts[k];
+            record->u = us[k];
+            record->v = vs[k];
+        }
+    }
+}
+
+void QBVHAccel::setChildBoxes(const BBox boxes[4], QBVHNode* node) {
     align_attrib(float, 16) cboxes[2][3][4];
     for (int i = 0; i < 4; i++) {
         for (int d = 0; d < 3; d++) {
-            cboxes[0][d][i] = static_cast<float>(boxes[i].posMin()[d]);  
+            cboxes[0][d][i] = static_cast<float>(boxes[i].posMin()[d]);
             cboxes[1][d][i] = static_cast<float>(boxes[i].posMax()[d]);
         }
     }
@@ -189,97 +569,887 @@ QBVHAccel::QBVHNode* QBVHAccel::constructRec(std::vector<TriangleWithID>& triang
             node->childBoxes[i][j] = _mm_load_ps(cboxes[i][j]);
         }
     }
+}
+
+unsigned int QBVHAccel::makeNode(std::vector<BuildTriangle>& triangles, const int bounds[5], const int axes[3], std::vector<QBVHNode>& nodes) const {
+    QBVHNode node;
+    BBox boxes[4];
+    for (int i = 0; i < 4; i++) {
+        boxes[i] = rangeBox(triangles, bounds[i], bounds[i + 1], _parallelGrain);
+    }
+    setChildBoxes(boxes, &node);
+
+    for (int i = 0; i < 4; i++) {
+        node.children[i] = _emptyLeaf;
+    }
+    node.sepAxes[0] = (char)axes[0];
+    node.sepAxes[1] = (char)axes[1];
+    node.sepAxes[2] = (char)axes[2];
+    memset(node.padding, 0, sizeof(node.padding));
+
+    nodes.push_back(node);
+    return static_cast<unsigned int>(nodes.size() - 1);
+}
+
+unsigned int QBVHAccel::constructRec(std::vector<BuildTriangle>& triangles, int startID, int endID, int dim, AccelBuildType buildType,
+                                     std::vector<QBVHNode>& nodes, std::vector<BuildTask>* tasks) const {
+    const int nTri = endID - startID;
+
+    if (nTri <= _maxNodeSize) {
+        return leafEntry(startID, nTri);
+    }
+
+    int bounds[5];
+    int axes[3];
+    splitNode(triangles, startID, endID, dim, buildType, bounds, axes);
+    const unsigned int nodeID = makeNode(triangles, bounds, axes, nodes);
+
+    for (int i = 0; i < 4; i++) {
+        const int nChild = bounds[i + 1] - bounds[i];
+        if (nChild == 0) continue;
+
+        if (tasks != NULL && nChild > _maxNodeSize && nChild <= _parallelGrain) {
+            BuildTask task = { bounds[i], bounds[i + 1], (dim + 2) % 3, nodeID, i };
+            tasks->push_back(task);
+            continue;
+        }
+
+        const unsigned int child = constructRec(triangles, bounds[i], bounds[i + 1], (dim + 2) % 3, buildType, nodes, tasks);
+        nodes[nodeID].children[i] = child;
+    }
+    return nodeID;
+}
+
+void QBVHAccel::splitNode(std::vector<BuildTriangle>& triangles, int startID, int endID, int dim, AccelBuildType buildType, int bounds[5], int axes[3]) const {
+    if (buildType == ACCEL_BUILD_LBVH) {
+        // Same as SAH below, but the triangles are split at the highest differing bit of their codes
+        axes[0] = axes[1] = axes[2] = 0;
+        const int mid = splitMorton(triangles, startID, endID, &axes[0]);
+        const int midL = (mid - startID > _maxNodeSize) ? splitMorton(triangles, startID, mid, &axes[1]) : mid;
+        const int midR = (endID - mid > _maxNodeSize) ? splitMorton(triangles, mid, endID, &axes[2]) : endID;
+        bounds[0] = startID;
+        bounds[1] = midL;
+        bounds[2] = mid;
+        bounds[3] = midR;
+        bounds[4] = endID;
+    } else if (buildType == ACCEL_BUILD_SAH) {
+        // Split into two halves, and then split each half again.
+        // A half small enough to be a leaf is kept as is and its sibling slot is left empty.
+        axes[0] = axes[1] = axes[2] = 0;
+        const int mid = splitSAH(triangles, startID, endID, &axes[0]);
+        const int midL = (mid - startID > _maxNodeSize) ? splitSAH(triangles, startID, mid, &axes[1]) : mid;
+        const int midR = (endID - mid > _maxNodeSize) ? splitSAH(triangles, mid, endID, &axes[2]) : endID;
+        bounds[0] = startID;
+        bounds[1] = midL;
+        bounds[2] = mid;
+        bounds[3] = midR;
+        bounds[4] = endID;
+    } else {
+        const int nTri = endID - startID;
+        std::vector<BuildTriangle>::iterator begin = triangles.begin() + startID;
+        std::sort(begin, begin + nTri, AxisComparator(dim));
+
+        const int mid = nTri / 2;
+        std::sort(begin, begin + mid, AxisComparator((dim + 1) % 3));
+        std::sort(begin + mid, begin + nTri, AxisComparator((dim + 1) % 3));
+
+        bounds[0] = startID;
+        bounds[1] = startID + mid / 2;
+        bounds[2] = startID + mid;
+        bounds[3] = startID + mid + mid / 2;
+        bounds[4] = endID;
+        axes[0] = dim;
+        axes[1] = (dim + 1) % 3;
+        axes[2] = (dim + 1) % 3;
+    }
+}
+
+int QBVHAccel::splitSAH(std::vector<BuildTriangle>& triangles, int startID, int endID, int* axis) const {
+    typedef BinPredicate<BuildTriangle> Predicate;
+    static const int nBins = _numSAHBins;
+
+    // Large ranges near the root are binned and partitioned in parallel
+    const bool isParallel = endID - startID > _parallelGrain;
+    const int numChunks = isParallel ? parallel::numChunks() : 1;
+
+    BBox centroidBox;
+    if (isParallel) {
+        std::vector<BBox> boxes(numChunks);
+        ompfor (int c = 0; c < numChunks; c++) {
+            mergeCentroids(triangles, chunkStart(startID, endID, c, numChunks), chunkStart(startID, endID, c + 1, numChunks), &boxes[c]);
+        }
+
+        for (int c = 0; c < numChunks; c++) {
+            centroidBox.merge(boxes[c]);
+        }
+    } else {
+        mergeCentroids(triangles, startID, endID, &centroidBox);
+    }
+    const Vector3D extent = centroidBox.posMax() - centroidBox.posMin();
+
+    // Evaluate SAH cost at the boundaries of bins along each axis
+    double bestCost = INFTY;
+    int bestAxis = -1;
+    int bestSplit = -1;
+    for (int d = 0; d < 3; d++) {
+        if (extent[d] <= EPS) continue;
+
+        const double lo = centroidBox.posMin()[d];
+        const double scale = nBins / extent[d];
+
+        BBox binBoxes[nBins];
+        int binCounts[nBins] = { 0 };
+        if (isParallel) {
+            std::vector<BBox> chunkBoxes(numChunks * nBins);
+            std::vector<int> chunkCounts(numChunks * nBins, 0);
+            ompfor (int c = 0; c < numChunks; c++) {
+                binTriangles(triangles, chunkStart(startID, endID, c, numChunks), chunkStart(startID, endID, c + 1, numChunks),
+                             d, lo, scale, nBins, &chunkBoxes[c * nBins], &chunkCounts[c * nBins]);
+            }
+
+            for (int c = 0; c < numChunks; c++) {
+                for (int b = 0; b < nBins; b++) {
+                    binBoxes[b].merge(chunkBoxes[c * nBins + b]);
+                    binCounts[b] += chunkCounts[c * nBins + b];
+                }
+            }
+        } else {
+            binTriangles(triangles, startID, endID, d, lo, scale, nBins, binBoxes, binCounts);
+        }
+
+        double rightAreas[nBins];
+        int rightCounts[nBins];
+        BBox acc;
+        int count = 0;
+        for (int b = nBins - 1; b > 0; b--) {
+            acc.merge(binBoxes[b]);
+            count += binCounts[b];
+            rightAreas[b] = acc.area();
+            rightCounts[b] = count;
+        }
+
+        acc = BBox();
+        count = 0;
+        for (int b = 0; b < nBins - 1; b++) {
+            acc.merge(binBoxes[b]);
+            count += binCounts[b];
+            if (count == 0 || rightCounts[b + 1] == 0) continue;
+
+            const double cost = acc.area() * count + rightAreas[b + 1] * rightCounts[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = d;
+                bestSplit = b;
+            }
+        }
+    }
+
+    // All the centroids are at the same position
+    if (bestAxis < 0) {
+        *axis = 0;
+        return (startID + endID) / 2;
+    }
+
+    // Stable partition makes the tree independent of the number of threads
+    const double lo = centroidBox.posMin()[bestAxis];
+    const double scale = nBins / extent[bestAxis];
+    const Predicate pred(bestAxis, lo, scale, nBins, bestSplit);
+    std::vector<BuildTriangle>::iterator it;
+    if (isParallel) {
+        it = parallel::stablePartition(triangles.begin() + startID, triangles.begin() + endID, pred);
+    } else {
+        it = std::stable_partition(triangles.begin() + startID, triangles.begin() + endID, pred);
+    }
+    *axis = bestAxis;
+    return static_cast<int>(it - triangles.begin());
+}
+
+unsigned int QBVHAccel::constructSBVHRec(std::vector<BuildTriangle>& refs, double rootArea, std::vector<QBVHNode>& nodes,
+                                         std::vector<BuildTriangle>& ordered, int* budget) const {
+    const int nRef = (int)refs.size();
+    if (nRef <= _maxNodeSize) {
+        const int start = (int)ordered.size();
+        ordered.insert(ordered.end(), refs.begin(), refs.end());
+        return leafEntry(start, nRef);
+    }
+
+    // Split into two halves, and then split each half again (as SAH)
+    int axes[3] = { 0, 0, 0 };
+    std::vector<BuildTriangle> halves[2];
+    splitSBVH(refs, rootArea, halves[0], halves[1], &axes[0], budget);
+    std::vector<BuildTriangle>().swap(refs);
+
+    std::vector<BuildTriangle> quarters[4];
+    for (int h = 0; h < 2; h++) {
+        if (halves[h].size() > _maxNodeSize) {
+            splitSBVH(halves[h], rootArea, quarters[2 * h], quarters[2 * h + 1], &axes[h + 1], budget);
+        } else {
+            quarters[2 * h].swap(halves[h]);
+        }
+        std::vector<BuildTriangle>().swap(halves[h]);
+    }
+
+    QBVHNode node;
+    BBox boxes[4];
+    for (int i = 0; i < 4; i++) {
+        mergeBoxes(quarters[i], 0, (int)quarters[i].size(), &boxes[i]);
+        node.children[i] = _emptyLeaf;
+    }
+    setChildBoxes(boxes, &node);
+    node.sepAxes[0] = (char)axes[0];
+    node.sepAxes[1] = (char)axes[1];
+    node.sepAxes[2] = (char)axes[2];
+    memset(node.padding, 0, sizeof(node.padding));
+
+    const unsigned int nodeID = static_cast<unsigned int>(nodes.size());
+    nodes.push_back(node);
+    for (int i = 0; i < 4; i++) {
+        if (quarters[i].empty()) continue;
+
+        const unsigned int child = constructSBVHRec(quarters[i], rootArea, nodes, ordered, budget);
+        nodes[nodeID].children[i] = child;
+    }
+    return nodeID;
+}
 
-    node->children[0] = constructRec(c0, (dim + 2) % 3);
-    node->children[1] = constructRec(c1, (dim + 2) % 3);
-    node->children[2] = constructRec(c2, (dim + 2) % 3);
-    node->children[3] = constructRec(c3, (dim + 2) % 3);
-    node->triangles.clear();
-    node->sepAxes[0] = (char)dim;
-    node->sepAxes[1] = (char)((dim + 1) % 3);
-    node->sepAxes[2] = (char)((dim + 1) % 3);
-    node->isLeaf = false;
-    return node;
-}
-
-int QBVHAccel::intersect(const Ray& ray, Hitpoint* hitpoint) const {
-    // ray for SIMD arthimetic
-    __m128 simdOrig[3];  // origin
-    __m128 simdIdir[3];  // inverse direction
-    int sgn[3];          // signs of ray direction (pos -> 0, neg -> 1)
-        
-    float orgx = static_cast<float>(ray.origin().x());
-    float orgy = static_cast<float>(ray.origin().y());
-    float orgz = static_cast<float>(ray.origin().z());
-
-    align_attrib(float, 16) orgxs[4] = { orgx, orgx, orgx, orgx };
-    align_attrib(float, 16) orgys[4] = { orgy, orgy, orgy, orgy };
-    align_attrib(float, 16) orgzs[4] = { orgz, orgz, orgz, orgz };
-
-    float idirx = ray.direction().x() == 0.0 ? (float)1.0e20 : (float)(1.0 / ray.direction().x());
-    float idiry = ray.direction().y() == 0.0 ? (float)1.0e20 : (float)(1.0 / ray.direction().y());
-    float idirz = ray.direction().z() == 0.0 ? (float)1.0e20 : (float)(1.0 / ray.direction().z());
-
-    align_attrib(float, 16) idirxs[4] = { idirx, idirx, idirx, idirx };
-    align_attrib(float, 16) idirys[4] = { idiry, idiry, idiry, idiry };
-    align_attrib(float, 16) idirzs[4] = { idirz, idirz, idirz, idirz };
-
-    simdOrig[0] = _mm_load_ps(orgxs);
-    simdOrig[1] = _mm_load_ps(orgys);
-    simdOrig[2] = _mm_load_ps(orgzs);
-
-    simdIdir[0] = _mm_load_ps(idirxs);
-    simdIdir[1] = _mm_load_ps(idirys);
-    simdIdir[2] = _mm_load_ps(idirzs);
-
-    sgn[0] = idirx > 0.0f ? 0 : 1;
-    sgn[1] = idiry > 0.0f ? 0 : 1;
-    sgn[2] = idirz > 0.0f ? 0 : 1;
-
-    int hit = -1;
-    std::stack<QBVHNode*> stk;
-    stk.push(_root);
-    while(!stk.empty()) {
-        QBVHNode* node = stk.top();
-        stk.pop();
-
-        if (node->isLeaf) {
-            int triID = -1;
-            for (int i = 0; i < node->triangles.size(); i++) {
-                const Triangle& tri = node->triangles[i].first;
-                Hitpoint hpTemp;
-                if (tri.intersect(ray, &hpTemp)) {
-                    if (hitpoint->distance() > hpTemp.distance()) {
-                        *hitpoint = hpTemp;
-                        hit = node->triangles[i].second;
+void QBVHAccel::splitSBVH(const std::vector<BuildTriangle>& refs, double rootArea, std::vector<BuildTriangle>& left,
+                          std::vector<BuildTriangle>& right, int* axis, int* budget) const {
+    typedef BinPredicate<BuildTriangle> Predicate;
+    static const int nBins = _numSAHBins;
+    const int nRef = (int)refs.size();
+
+    BBox nodeBox, centroidBox;
+    mergeBoxes(refs, 0, nRef, &nodeBox);
+    mergeCentroids(refs, 0, nRef, &centroidBox);
+
+    // Object split: binned SAH over the centroids (same as splitSAH)
+    double objectCost = INFTY;
+    int objectAxis = -1;
+    int objectSplit = -1;
+    double overlapArea = 0.0;
+    for (int d = 0; d < 3; d++) {
+        const double extent = centroidBox.posMax()[d] - centroidBox.posMin()[d];
+        if (extent <= EPS) continue;
+
+        const double lo = centroidBox.posMin()[d];
+        const double scale = nBins / extent;
+        BBox binBoxes[nBins];
+        int binCounts[nBins] = { 0 };
+        binTriangles(refs, 0, nRef, d, lo, scale, nBins, binBoxes, binCounts);
+
+        BBox rightBoxes[nBins];
+        int rightCounts[nBins];
+        BBox acc;
+        int count = 0;
+        for (int b = nBins - 1; b > 0; b--) {
+            acc.merge(binBoxes[b]);
+            count += binCounts[b];
+            rightBoxes[b] = acc;
+            rightCounts[b] = count;
+        }
+
+        acc = BBox();
+        count = 0;
+        for (int b = 0; b < nBins - 1; b++) {
+            acc.merge(binBoxes[b]);
+            count += binCounts[b];
+            if (count == 0 || rightCounts[b + 1] == 0) continue;
+
+            const double cost = acc.area() * count + rightBoxes[b + 1].area() * rightCounts[b + 1];
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectAxis = d;
+                objectSplit = b;
+
+                const Vector3D overlapMin = Vector3D::maximum(acc.posMin(), rightBoxes[b + 1].posMin());
+                const Vector3D overlapMax = Vector3D::minimum(acc.posMax(), rightBoxes[b + 1].posMax());
+                const Vector3D overlap = overlapMax - overlapMin;
+                overlapArea = (overlap.x() > 0.0 && overlap.y() > 0.0 && overlap.z() > 0.0) ? BBox(overlapMin, overlapMax).area() : 0.0;
+            }
+        }
+    }
+
+    // Spatial split: triangles are clipped into bins of the node box,
+    // and only the ones straddling the plane are referenced from both sides.
+    double spatialCost = INFTY;
+    int spatialAxis = -1;
+    double spatialPlane = 0.0;
+    if (*budget > 0 && overlapArea > _sbvhOverlapRatio * rootArea) {
+        for (int d = 0; d < 3; d++) {
+            const double lo = nodeBox.posMin()[d];
+            const double extent = nodeBox.posMax()[d] - lo;
+            if (extent <= EPS) continue;
+
+            const double width = extent / nBins;
+            BBox binBoxes[nBins];
+            int entries[nBins] = { 0 };
+            int exits[nBins] = { 0 };
+            for (int i = 0; i < nRef; i++) {
+                const int b0 = Predicate::binIndex(refs[i].box.posMin()[d], lo, 1.0 / width, nBins);
+                const int b1 = Predicate::binIndex(refs[i].box.posMax()[d], lo, 1.0 / width, nBins);
+                if (b0 == b1) {
+                    binBoxes[b0].merge(refs[i].box);
+                } else {
+                    for (int b = b0; b <= b1; b++) {
+                        binBoxes[b].merge(clipReference(refs[i], d, lo + b * width, lo + (b + 1) * width).box);
                     }
                 }
+                entries[b0] += 1;
+                exits[b1] += 1;
+            }
+
+            double rightAreas[nBins];
+            int rightCounts[nBins];
+            BBox acc;
+            int count = 0;
+            for (int b = nBins - 1; b > 0; b--) {
+                acc.merge(binBoxes[b]);
+                count += exits[b];
+                rightAreas[b] = acc.area();
+                rightCounts[b] = count;
+            }
+
+            acc = BBox();
+            count = 0;
+            for (int b = 0; b < nBins - 1; b++) {
+                acc.merge(binBoxes[b]);
+                count += entries[b];
+                if (count == 0 || rightCounts[b + 1] == 0) continue;
+
+                const double cost = acc.area() * count + rightAreas[b + 1] * rightCounts[b + 1];
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialAxis = d;
+                    spatialPlane = lo + (b + 1) * width;
+                }
+            }
+        }
+    }
+
+    left.clear();
+    right.clear();
+    if (spatialCost < objectCost) {
+        // Straddling references are put on both sides while the budget remains
+        const int d = spatialAxis;
+        for (int i = 0; i < nRef; i++) {
+            const BuildTriangle& ref = refs[i];
+            if (ref.box.posMax()[d] <= spatialPlane) {
+                left.push_back(ref);
+            } else if (ref.box.posMin()[d] >= spatialPlane) {
+                right.push_back(ref);
+            } else if (*budget > 0) {
+                left.push_back(clipReference(ref, d, -INFTY, spatialPlane));
+                right.push_back(clipReference(ref, d, spatialPlane, INFTY));
+                *budget -= 1;
+            } else if (ref.centroid[d] < spatialPlane) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+
+        if (!left.empty() && !right.empty()) {
+            *axis = d;
+            return;
+        }
+        left.clear();
+        right.clear();
+    }
+
+    // All the centroids are at the same position
+    if (objectAxis < 0) {
+        *axis = 0;
+        left.assign(refs.begin(), refs.begin() + nRef / 2);
+        right.assign(refs.begin() + nRef / 2, refs.end());
+        return;
+    }
+
+    const double lo = centroidBox.posMin()[objectAxis];
+    const double scale = nBins / (centroidBox.posMax()[objectAxis] - lo);
+    const Predicate pred(objectAxis, lo, scale, nBins, objectSplit);
+    for (int i = 0; i < nRef; i++) {
+        if (pred(refs[i])) {
+            left.push_back(refs[i]);
+        } else {
+            right.push_back(refs[i]);
+        }
+    }
+    *axis = objectAxis;
+}
+
+QBVHAccel::BuildTriangle QBVHAccel::clipReference(const BuildTriangle& ref, int dim, double lo, double hi) const {
+    // Box of the triangle polygon clipped by the slab [lo, hi] along the axis
+    const Triangle& tri = _triangles[ref.index];
+    BBox clipped;
+    for (int k = 0; k < 3; k++) {
+        const Vector3D a = tri.p(k);
+        const Vector3D b = tri.p((k + 1) % 3);
+        if (a[dim] >= lo && a[dim] <= hi) {
+            clipped.merge(a);
+        }
+
+        const double planes[2] = { lo, hi };
+        for (int j = 0; j < 2; j++) {
+            if ((a[dim] - planes[j]) * (b[dim] - planes[j]) < 0.0) {
+                const double t = (planes[j] - a[dim]) / (b[dim] - a[dim]);
+                clipped.merge(a + t * (b - a));
+            }
+        }
+    }
+
+    // The clipped part is also inside the box of the reference (which may have been clipped before)
+    Vector3D posMin = Vector3D::maximum(clipped.posMin(), ref.box.posMin());
+    Vector3D posMax = Vector3D::minimum(clipped.posMax(), ref.box.posMax());
+    const Vector3D slabMin = Vector3D::maximum(ref.box.posMin(), Vector3D(dim == 0 ? lo : -INFTY, dim == 1 ? lo : -INFTY, dim == 2 ? lo : -INFTY));
+    const Vector3D slabMax = Vector3D::minimum(ref.box.posMax(), Vector3D(dim == 0 ? hi : INFTY, dim == 1 ? hi : INFTY, dim == 2 ? hi : INFTY));
+    if (posMin.x() > posMax.x() || posMin.y() > posMax.y() || posMin.z() > posMax.z()) {
+        // Rounding errors made the clipped part empty
+        posMin = slabMin;
+        posMax = slabMax;
+    }
+
+    BuildTriangle ret = ref;
+    ret.box = BBox(Vector3D::maximum(posMin, slabMin), Vector3D::minimum(posMax, slabMax));
+    ret.centroid = (ret.box.posMin() + ret.box.posMax()) * 0.5;
+    return ret;
+}
+
+void QBVHAccel::sortMorton(std::vector<BuildTriangle>& triangles) const {
+    const int numTriangles = (int)triangles.size();
+
+    // Quantize centroids in their bounding box. Small meshes are sorted with
+    // 30-bit codes (10 bits per axis), which halves the radix sort passes.
+    const int numChunks = parallel::numChunks();
+    std::vector<BBox> boxes(numChunks);
+    ompfor (int c = 0; c < numChunks; c++) {
+        mergeCentroids(triangles, chunkStart(0, numTriangles, c, numChunks), chunkStart(0, numTriangles, c + 1, numChunks), &boxes[c]);
+    }
+
+    BBox centroidBox;
+    for (int c = 0; c < numChunks; c++) {
+        centroidBox.merge(boxes[c]);
+    }
+
+    const int bitsPerAxis = numTriangles <= _maxMorton30Triangles ? 10 : 21;
+    const double maxCell = static_cast<double>((1 << bitsPerAxis) - 1);
+    const Vector3D lo = centroidBox.posMin();
+    const Vector3D extent = centroidBox.posMax() - centroidBox.posMin();
+    double scale[3];
+    for (int d = 0; d < 3; d++) {
+        scale[d] = extent[d] > EPS ? maxCell / extent[d] : 0.0;
+    }
+
+    std::vector<unsigned long long> codes(numTriangles);
+    std::vector<int> order(numTriangles);
+    ompfor (int i = 0; i < numTriangles; i++) {
+        unsigned long long cells[3];
+        for (int d = 0; d < 3; d++) {
+            cells[d] = static_cast<unsigned long long>(std::min(maxCell, (triangles[i].centroid[d] - lo[d]) * scale[d]));
+        }
+        codes[i] = (accel::expandBits(cells[0]) << 2) | (accel::expandBits(cells[1]) << 1) | accel::expandBits(cells[2]);
+        order[i] = i;
+    }
+
+    parallel::radixSort(codes, order, 3 * bitsPerAxis);
+
+    std::vector<BuildTriangle> sorted(numTriangles);
+    ompfor (int i = 0; i < numTriangles; i++) {
+        sorted[i] = triangles[order[i]];
+        sorted[i].morton = codes[i];
+    }
+    triangles.swap(sorted);
+}
+
+int QBVHAccel::splitMorton(const std::vector<BuildTriangle>& triangles, int startID, int endID, int* axis) const {
+    // Triangles in the same cell are split at the middle
+    const unsigned long long diff = triangles[startID].morton ^ triangles[endID - 1].morton;
+    if (diff == 0) {
+        *axis = 0;
+        return (startID + endID) / 2;
+    }
+
+    int bit = 63;
+    while (((diff >> bit) & 1) == 0) bit--;
+
+    // Codes share the bits above, so the bit is zero in the first half and one in the second
+    int lo = startID + 1;
+    int hi = endID - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if ((triangles[mid].morton >> bit) & 1) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    *axis = 2 - bit % 3;    // x, y and z are interleaved from the upper bit
+    return lo;
+}
+
+double QBVHAccel::sahCost() const {
+    if (_numNodes == 0) {
+        return 0.0;
+    }
+
+    BBox rootBox;
+    for (int i = 0; i < 4; i++) {
+        if (_nodes[0].children[i] != _emptyLeaf) {
+            rootBox.merge(childBox(_nodes[0], i));
+        }
+    }
+    const double rootArea = rootBox.area();
+    return sahCostRec(0, rootArea, rootArea);
+}
+
+double QBVHAccel::sahCostRec(int nodeID, double nodeArea, double rootArea) const {
+    const QBVHNode& node = _nodes[nodeID];
+    double cost = _traversalCost * nodeArea / rootArea;
+    for (int i = 0; i < 4; i++) {
+        const unsigned int child = node.children[i];
+        if (child == _emptyLeaf) continue;
+
+        const double childArea = childBox(node, i).area();
+        if (isLeaf(child)) {
+            cost += _intersectCost * leafCount(child) * childArea / rootArea;
+        } else {
+            cost += sahCostRec(child, childArea, rootArea);
+        }
+    }
+    return cost;
+}
+
+BBox QBVHAccel::childBox(const QBVHNode& node, int i) {
+    align_attrib(float, 16) cboxes[2][3][4];
+    for (int k = 0; k < 2; k++) {
+        for (int d = 0; d < 3; d++) {
+            _mm_store_ps(cboxes[k][d], node.childBoxes[k][d]);
+        }
+    }
+    return BBox(cboxes[0][0][i], cboxes[0][1][i], cboxes[0][2][i],
+                cboxes[1][0][i], cboxes[1][1][i], cboxes[1][2][i]);
+}
+
+size_t QBVHAccel::memoryUsage() const {
+    return sizeof(QBVHNode) * _numNodes + sizeof(TrianglePacket) * _numPackets + sizeof(Triangle) * _triangles.capacity();
+}
+
+bool QBVHAccel::save(const std::string& filename) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    AccelCacheHeader header;
+    memset((void*)&header, 0, sizeof(AccelCacheHeader));
+    strncpy(header.magic, name(), sizeof(header.magic));
+    header.version = accel::cacheVersion;
+    header.buildType = (unsigned int)_buildType;
+    header.key = accel::cacheKey(_triangles, _buildType, name());
+    header.numTriangles = (int)_triangles.size();
+    header.numNodes = _numNodes;
+    header.numPackets = _numPackets;
+    header.stackSize = _stackSize;
+    header.buildCost = _buildCost;
+
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    ofs.write((const char*)&header, sizeof(AccelCacheHeader));
+    ofs.write((const char*)_nodes, sizeof(QBVHNode) * _numNodes);
+    ofs.write((const char*)_packets, sizeof(TrianglePacket) * _numPackets);
+    ofs.close();
+    return !ofs.fail();
+}
+
+bool QBVHAccel::load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType) {
+    release();
+
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename)) {
+        return false;
+    }
+
+    const unsigned long long key = accel::cacheKey(triangles, buildType, name());
+    const AccelCacheHeader* header = accel::checkCache(*file, name(), key, sizeof(QBVHNode), sizeof(TrianglePacket));
+    if (header == NULL || header->numTriangles != (int)triangles.size()) {
+        return false;
+    }
+
+    // The mapping is page-aligned and the header keeps both arrays aligned
+    char* data = file->data() + sizeof(AccelCacheHeader);
+    _nodes = (QBVHNode*)data;
+    _numNodes = header->numNodes;
+    _packets = (TrianglePacket*)(data + sizeof(QBVHNode) * _numNodes);
+    _numPackets = header->numPackets;
+    _stackSize = header->stackSize;
+    _buildType = buildType;
+    _buildCost = header->buildCost;
+    _triangles = triangles;
+    _mappedFile = file;
+    return true;
+}
+
+void QBVHAccel::setSimdRay(const Ray& ray, SimdRay* simdRay) {
+    const Vector3D orig = ray.origin();
+    const Vector3D dir = ray.direction();
+
+    float orgx = static_cast<float>(orig.x());
+    float orgy = static_cast<float>(orig.y());
+    float orgz = static_cast<float>(orig.z());
+
+    float idirx = dir.x() == 0.0 ? (float)1.0e20 : (float)(1.0 / dir.x());
+    float idiry = dir.y() == 0.0 ? (float)1.0e20 : (float)(1.0 / dir.y());
+    float idirz = dir.z() == 0.0 ? (float)1.0e20 : (float)(1.0 / dir.z());
+
+    simdRay->orig[0] = _mm_set1_ps(orgx);
+    simdRay->orig[1] = _mm_set1_ps(orgy);
+    simdRay->orig[2] = _mm_set1_ps(orgz);
+
+    simdRay->idir[0] = _mm_set1_ps(idirx);
+    simdRay->idir[1] = _mm_set1_ps(idiry);
+    simdRay->idir[2] = _mm_set1_ps(idirz);
+
+    simdRay->sgn[0] = idirx > 0.0f ? 0 : 1;
+    simdRay->sgn[1] = idiry > 0.0f ? 0 : 1;
+    simdRay->sgn[2] = idirz > 0.0f ? 0 : 1;
+
+    float shear[3];
+    accel::shearRay(dir, simdRay->axes, shear);
+    for (int d = 0; d < 3; d++) {
+        simdRay->shear[d] = _mm_set1_ps(shear[d]);
+    }
+}
+
+template <bool anyHit>
+void QBVHAccel::traverse(const SimdRay& ray, HitRecord* record, AccelStats* stats) const {
+    if (stats != NULL) {
+        stats->numRays += 1;
+    }
+
+    // The stack is on the call stack unless the tree is unusually deep
+    StackItem localStack[_maxStackSize];
+    std::vector<StackItem> heapStack;
+    StackItem* stack = localStack;
+    if (_stackSize > _maxStackSize) {
+        heapStack.resize(_stackSize);
+        stack = &heapStack[0];
+    }
+
+    int stackTop = 0;
+    stack[stackTop].entry = 0;
+    stack[stackTop].tNear = 0.0f;
+    stackTop++;
+    while (stackTop > 0) {
+        const StackItem item = stack[--stackTop];
+        if (item.tNear > record->t) continue;    // Culled by a closer hit found after the push
+        const unsigned int entry = item.entry;
+
+        if (stats != NULL) {
+            stats->numNodeVisits += 1;
+            if (isLeaf(entry)) stats->numTriangleTests += leafCount(entry);
+        }
+
+        if (isLeaf(entry)) {
+            if (entry != _emptyLeaf) {
+                intersectPacket(_packets[leafStart(entry)], ray, record);
+                if (anyHit && record->id >= 0) return;
             }
             continue;
         }
 
         // Test ray-bbox intersection
-        float hitdist = static_cast<float>(hitpoint->distance());
-        align_attrib(float, 16) hitdists[4] = { hitdist, hitdist, hitdist, hitdist };
+        const QBVHNode& node = _nodes[entry];
         __m128 tMin = simdZero;
-        __m128 tMax = _mm_load_ps(hitdists);
+        __m128 tMax = _mm_set1_ps(record->t);
 
         for (int d = 0; d < 3; d++) {
-            tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(node->childBoxes[sgn[d]][d], simdOrig[d]), simdIdir[d]));
-            tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(node->childBoxes[1 - sgn[d]][d], simdOrig[d]), simdIdir[d]));
-        }
-
-        int hitMask = _mm_movemask_ps(_mm_cmpge_ps(tMax, tMin));
-        if (hitMask != 0) {
-            int sepMask = (sgn[node->sepAxes[0]] << 2) | (sgn[node->sepAxes[1]] << 1) | (sgn[node->sepAxes[2]]);
-            int ordMask = orderTable[hitMask * 8 + sepMask];
-            for (int i = 0; i < 4; i++) {    
-                if (ordMask & 0x04) break;
-                stk.push(node->children[ordMask & 0x03]);
-                ordMask >>= 4;
+            tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(node.childBoxes[ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+            tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(node.childBoxes[1 - ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+        }
+
+        const int hitMask = _mm_movemask_ps(_mm_cmpge_ps(_mm_mul_ps(tMax, simdBoxScale), tMin));
+        if (hitMask == 0) continue;
+
+        // Push hit children so that the nearest one is popped first
+        align_attrib(float, 16) tNears[4];
+        _mm_store_ps(tNears, tMin);
+        const int stackBottom = stackTop;
+        for (int i = 0; i < 4; i++) {
+            if ((hitMask & (1 << i)) == 0) continue;
+
+            StackItem child = { node.children[i], tNears[i] };
+            int k = stackTop++;
+            for (; k > stackBottom && stack[k - 1].tNear < child.tNear; k--) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+int QBVHAccel::intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return -1;
+    }
+
+    SimdRay simdRay;
+    setSimdRay(ray, &simdRay);
+
+    HitRecord record = { -1, static_cast<float>(hitpoint->distance()), 0.0f, 0.0f };
+    traverse<false>(simdRay, &record, stats);
+    if (record.id < 0) {
+        return -1;
+    }
+
+    resolveHit(_triangles[record.id], ray, record, hitpoint);
+    return record.id;
+}
+
+int QBVHAccel::intersect(RayPacket& packet, AccelStats* stats) const {
+    if (_numNodes == 0 || packet.size() == 0) {
+        return 0;
+    }
+
+    SimdRay simdRays[RayPacket::maxSize];
+    HitRecord records[RayPacket::maxSize];
+    for (int r = 0; r < packet.size(); r++) {
+        setSimdRay(packet.ray(r), &simdRays[r]);
+        const HitRecord record = { -1, static_cast<float>(packet.intersection(r).hittingDistance()), 0.0f, 0.0f };
+        records[r] = record;
+    }
+
+    traversePacket(simdRays, packet.size(), records, stats);
+
+    int hitMask = 0;
+    Hitpoint hitpoint;
+    for (int r = 0; r < packet.size(); r++) {
+        if (records[r].id < 0) continue;
+
+        resolveHit(_triangles[records[r].id], packet.ray(r), records[r], &hitpoint);
+        packet.setIntersection(r, records[r].id, hitpoint);
+        hitMask |= 1 << r;
+    }
+    return hitMask;
+}
+
+void QBVHAccel::traversePacket(const SimdRay* rays, int numRays, HitRecord* records, AccelStats* stats) const {
+    if (stats != NULL) {
+        stats->numRays += numRays;
+    }
+
+    PacketStackItem localStack[_maxStackSize];
+    std::vector<PacketStackItem> heapStack;
+    PacketStackItem* stack = localStack;
+    if (_stackSize > _maxStackSize) {
+        heapStack.resize(_stackSize);
+        stack = &heapStack[0];
+    }
+
+    int stackTop = 0;
+    stack[stackTop].entry = 0;
+    stack[stackTop].rayMask = (1 << numRays) - 1;
+    stack[stackTop].tNear = 0.0f;
+    stackTop++;
+    while (stackTop > 0) {
+        const PacketStackItem item = stack[--stackTop];
+
+        // Rays which already found closer hits are deactivated
+        int activeMask = 0;
+        for (int r = 0; r < numRays; r++) {
+            if ((item.rayMask & (1 << r)) && item.tNear <= records[r].t) activeMask |= 1 << r;
+        }
+        if (activeMask == 0) continue;
+
+        const unsigned int entry = item.entry;
+        if (isLeaf(entry)) {
+            if (entry == _emptyLeaf) continue;
+
+            const TrianglePacket& packet = _packets[leafStart(entry)];
+            for (int r = 0; r < numRays; r++) {
+                if ((activeMask & (1 << r)) == 0) continue;
+                if (stats != NULL) {
+                    stats->numNodeVisits += 1;
+                    stats->numTriangleTests += leafCount(entry);
+                }
+                intersectPacket(packet, rays[r], &records[r]);
             }
+            continue;
+        }
+
+        // Test ray-bbox intersection for each active ray. Ray masks and
+        // minimum entry distances of the children are accumulated in lanes.
+        const QBVHNode& node = _nodes[entry];
+        __m128 maskAcc = simdZero;
+        __m128 nearAcc = simdInf;
+        for (int r = 0; r < numRays; r++) {
+            if ((activeMask & (1 << r)) == 0) continue;
+            if (stats != NULL) stats->numNodeVisits += 1;
+
+            const SimdRay& ray = rays[r];
+            __m128 tMin = simdZero;
+            __m128 tMax = _mm_set1_ps(records[r].t);
+            for (int d = 0; d < 3; d++) {
+                tMin = _mm_max_ps(tMin, _mm_mul_ps(_mm_sub_ps(node.childBoxes[ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+                tMax = _mm_min_ps(tMax, _mm_mul_ps(_mm_sub_ps(node.childBoxes[1 - ray.sgn[d]][d], ray.orig[d]), ray.idir[d]));
+            }
+
+            const __m128 hit = _mm_cmpge_ps(_mm_mul_ps(tMax, simdBoxScale), tMin);
+            maskAcc = _mm_or_ps(maskAcc, _mm_and_ps(hit, simdRayBits[r]));
+            nearAcc = _mm_min_ps(nearAcc, _mm_or_ps(_mm_and_ps(hit, tMin), _mm_andnot_ps(hit, simdInf)));
+        }
+
+        align_attrib(int, 16) childMasks[4];
+        align_attrib(float, 16) childNears[4];
+        _mm_store_ps((float*)childMasks, maskAcc);
+        _mm_store_ps(childNears, nearAcc);
+
+        // Push children so that the nearest one is popped first
+        const int stackBottom = stackTop;
+        for (int i = 0; i < 4; i++) {
+            if (childMasks[i] == 0) continue;
+
+            PacketStackItem child = { node.children[i], childMasks[i], childNears[i] };
+            int k = stackTop++;
+            for (; k > stackBottom && stack[k - 1].tNear < child.tNear; k--) {
+                stack[k] = stack[k - 1];
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+void QBVHAccel::resolveHit(const Triangle& tri, const Ray& ray, const HitRecord& record, Hitpoint* hitpoint) {
+    // Hitpoint is computed only for the closest triangle. The position is
+    // interpolated in double with the barycentric coordinates of the float
+    // test, and it is off the triangle at most by the returned error bound.
+    const double u = record.u;
+    const double v = record.v;
+    const Vector3D pos = (1.0 - u - v) * tri.p0() + u * tri.p1() + v * tri.p2();
+
+    double magnitude = 0.0;
+    for (int d = 0; d < 3; d++) {
+        magnitude = std::max(magnitude, std::abs(pos[d]));
+        for (int i = 0; i < 3; i++) {
+            magnitude = std::max(magnitude, std::abs(tri.p(i)[d]));
         }
     }
 
-    return hit;
-}
\ No newline at end of file
+    hitpoint->setDistance((pos - ray.origin()).norm());
+    hitpoint->setPosition(pos);
+    hitpoint->setNormal(tri.normal());
+    hitpoint->setError(accel::hitError(magnitude));
+}
+
+bool QBVHAccel::occluded(const Ray& ray, double tMax, AccelStats* stats) const {
+    if (_numNodes == 0) {
+        return false;
+    }
+
+    SimdRay simdRay;
+    setSimdRay(ray, &simdRay);
+
+    HitRecord record = { -1, static_cast<float>(tMax), 0.0f, 0.0f };
+    traverse<true>(simdRay, &record, stats);
+    return record.id >= 0;
+}
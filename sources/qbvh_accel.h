@@ -2,63 +2,218 @@
 #define _QBVH_ACCEL_H_
 
 #include <cstdlib>
-#include <map>
+#include <memory>
 #include <vector>
 #include <xmmintrin.h>
 
+#include "accel_interface.h"
+#include "accel_cache.h"
 #include "triangle.h"
+#include "bbox.h"
+#include "ray_packet.h"
 
 typedef std::pair<Triangle, int> TriangleWithID;
 
-class QBVHAccel {
+class QBVHAccel : public IAccel {
+    friend class OBVHAccel;
+    friend class CompressedQBVHAccel;
+
 private:
 
+    // Nodes are stored in one 64-byte-aligned array (two cache lines per node).
+    // Each child entry is either an index of the child node, or a leaf entry
+    // which refers to a triangle packet and the number of triangles in it.
     struct QBVHNode {
         __m128 childBoxes[2][3];    // [min-max][x-y-z]
-        QBVHNode* children[4];      // Child nodes
-        std::vector<TriangleWithID> triangles;        
-        char sepAxes[3];          // top-left-right
-        bool isLeaf;
-
-        QBVHNode()
-            : childBoxes()
-            , children()
-            , triangles()
-            , sepAxes()
-            , isLeaf(false)
-        {
-        }
-
-        ~QBVHNode()
-        {
-        }
+        unsigned int children[4];   // Child node IDs or leaf entries
+        char sepAxes[3];            // Split axes (top-left-right)
+        char padding[13];
+    };
+
+    // Up to four triangles of a leaf in SoA layout for 4-wide intersection tests.
+    // Vertices are stored as they are (not as edges) so that the triangles
+    // sharing an edge see exactly the same float coordinates of it.
+    // Unused lanes are degenerate (and never hit) and their IDs are -1.
+    struct TrianglePacket {
+        __m128 p0[3];    // Vertices [x-y-z]
+        __m128 p1[3];
+        __m128 p2[3];
+        int ids[4];      // Indices of the original triangles
+    };
+
+    // Ray broadcast to four lanes for SIMD arithmetic
+    struct SimdRay {
+        __m128 orig[3];     // origin
+        __m128 idir[3];     // inverse direction
+        __m128 shear[3];    // shear and scale which map the direction to +z (Sx, Sy, Sz)
+        int axes[3];        // axes permuted so that the direction is the longest along axes[2]
+        int sgn[3];         // signs of ray direction (pos -> 0, neg -> 1)
+    };
+
+    // Child entry waiting for traversal with the distance where the ray enters its box
+    struct StackItem {
+        unsigned int entry;
+        float tNear;
+    };
+
+    // Stack entry of packet traversal with the rays which entered the box
+    struct PacketStackItem {
+        unsigned int entry;
+        int rayMask;
+        float tNear;    // Minimum entry distance of the rays
+    };
+
+    // Closest hit found during traversal
+    struct HitRecord {
+        int id;
+        float t, u, v;
+    };
+
+    // Bounding box and representative points of a triangle used during construction
+    struct BuildTriangle {
+        BBox box;
+        Vector3D centroid;    // Center of the bounding box (for SAH)
+        Vector3D gravity;     // Center of the vertices (for median split)
+        unsigned long long morton;    // Morton code of the centroid (for LBVH)
+        int index;
+    };
+
+    // Subtree whose construction is deferred to the parallel phase
+    struct BuildTask {
+        int startID, endID;
+        int dim;
+        unsigned int parentID;
+        int slot;
     };
 
-    static const int _maxNodeSize = 3;
-    QBVHNode* _root;
+    static const int _maxNodeSize = 4;
+    static const int _numSAHBins = 16;
+    static const int _maxMorton30Triangles = 1 << 16;    // LBVH uses 63-bit codes for larger meshes
+    static const double _sbvhDuplicationBudget;    // Ratio of references SBVH can add by splitting triangles
+    static const double _sbvhOverlapRatio;         // Spatial splits are tried when child boxes overlap more than this
+    static const int _parallelGrain = 8192;
+    static const int _maxStackSize = 256;    // Traversal stack kept on the call stack
+    static const double _traversalCost;
+    static const double _intersectCost;
+
+    static const unsigned int _leafFlag = 0x80000000;
+    static const unsigned int _leafCountBits = 4;
+    static const unsigned int _emptyLeaf = _leafFlag;
+
+    QBVHNode* _nodes;
+    int _numNodes;
+    TrianglePacket* _packets;
+    int _numPackets;
+    int _stackSize;    // Traversal stack size required by the tree depth
+    AccelBuildType _buildType;
+    double _buildCost;    // SAH cost right after the last construction
+    std::vector<Triangle> _triangles;    // Original triangles to compute hitpoints
+    std::shared_ptr<MappedFile> _mappedFile;    // Owner of the nodes and packets when loaded from a cache
 
 public:
     QBVHAccel();
     QBVHAccel(const QBVHAccel& qbvh);
     QBVHAccel(QBVHAccel&& qbvh);
-    ~QBVHAccel();
+    virtual ~QBVHAccel();
 
     QBVHAccel& operator=(const QBVHAccel& qbvh);
     QBVHAccel& operator=(QBVHAccel&& qbvh);
 
-    void construct(const std::vector<Triangle>& triangles);
+    // Construct QBVH
+    // @param[in] triangles: triangles stored in the tree
+    // @param[in] buildType: split strategy (object median, binned SAH, Morton codes or spatial splits)
+    void construct(const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
+
+    // Update the bounds for moved triangles without changing the topology
+    // The tree is rebuilt with the last build type instead when the refitted
+    // tree is expected to be more than maxCostRatio times as costly (by SAH).
+    // @param[in] triangles: moved triangles in the same order as construction
+    // @return true if the tree was rebuilt
+    bool refit(const std::vector<Triangle>& triangles, double maxCostRatio = 1.5) override;
 
     // Intersection test
     // If ray is intersected, then return the index of the triangle.
     // If not, then return -1.
-    int intersect(const Ray& ray, Hitpoint* hitpoint) const;
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    int intersect(const Ray& ray, Hitpoint* hitpoint, AccelStats* stats = NULL) const override;
+
+    // Intersection test for a packet of coherent rays
+    // Rays share one traversal and each ray is tested only for the boxes
+    // its parent node was entered by. The intersections of the packet are set.
+    // @return bit mask of the rays which hit triangles
+    // @param[out] stats: node visits (per ray) and triangle tests are added to it (option)
+    int intersect(RayPacket& packet, AccelStats* stats = NULL) const override;
+
+    // Occlusion test (any hit)
+    // Traversal stops at the first triangle hit closer than tMax,
+    // and the hitpoint is not computed.
+    // @param[in] tMax: distance to the end of the ray segment
+    // @param[out] stats: node visits and triangle tests are added to it (option)
+    bool occluded(const Ray& ray, double tMax = INFTY, AccelStats* stats = NULL) const override;
+
+    // Expected cost of a ray query estimated with the surface area heuristic
+    double sahCost() const override;
+
+    // Memory consumed by the nodes and the triangle buffers (in bytes)
+    size_t memoryUsage() const override;
+
+    inline int numNodes() const override { return _numNodes; }
+    inline const char* name() const override { return "qbvh"; }
+
+    // Memory consumed by the nodes only (in bytes)
+    inline size_t nodeMemoryUsage() const { return sizeof(QBVHNode) * _numNodes; }
+
+    // Traversal stack size required by the tree depth
+    // Traversal keeps the stack on the heap when it exceeds maxStackSize().
+    inline int stackSize() const { return _stackSize; }
+    inline static int maxStackSize() { return _maxStackSize; }
+
+    // Write the nodes and the packets to a cache file
+    // The file is keyed by the hash of the triangles and the build type.
+    // @return false if the file cannot be written
+    bool save(const std::string& filename) const override;
+
+    // Map a cache file written by save() instead of construction
+    // The triangles and the build type must be the same as those of the cached tree.
+    // @return false (and the tree is left empty) if the file is missing or stale
+    bool load(const std::string& filename, const std::vector<Triangle>& triangles, AccelBuildType buildType = ACCEL_BUILD_SAH) override;
 
 private:
     void release();
-    void deleteNode(QBVHNode* node);
-    QBVHNode* copyNode(QBVHNode* node);
-        
-    QBVHNode* constructRec(std::vector<TriangleWithID>& triangles, int dim);
+
+    unsigned int constructRec(std::vector<BuildTriangle>& triangles, int startID, int endID, int dim, AccelBuildType buildType,
+                              std::vector<QBVHNode>& nodes, std::vector<BuildTask>* tasks) const;
+    void splitNode(std::vector<BuildTriangle>& triangles, int startID, int endID, int dim, AccelBuildType buildType, int bounds[5], int axes[3]) const;
+    int splitSAH(std::vector<BuildTriangle>& triangles, int startID, int endID, int* axis) const;
+    int splitMorton(const std::vector<BuildTriangle>& triangles, int startID, int endID, int* axis) const;
+    void sortMorton(std::vector<BuildTriangle>& triangles) const;
+    unsigned int makeNode(std::vector<BuildTriangle>& triangles, const int bounds[5], const int axes[3], std::vector<QBVHNode>& nodes) const;
+    unsigned int constructSBVHRec(std::vector<BuildTriangle>& refs, double rootArea, std::vector<QBVHNode>& nodes,
+                                  std::vector<BuildTriangle>& ordered, int* budget) const;
+    void splitSBVH(const std::vector<BuildTriangle>& refs, double rootArea, std::vector<BuildTriangle>& left,
+                   std::vector<BuildTriangle>& right, int* axis, int* budget) const;
+    BuildTriangle clipReference(const BuildTriangle& ref, int dim, double lo, double hi) const;
+    double sahCostRec(int nodeID, double nodeArea, double rootArea) const;
+    void makePackets(const std::vector<BuildTriangle>& triangles);
+    int depthRec(int nodeID) const;
+
+    template <bool anyHit>
+    void traverse(const SimdRay& ray, HitRecord* record, AccelStats* stats) const;
+    void traversePacket(const SimdRay* rays, int numRays, HitRecord* records, AccelStats* stats) const;
+    static void resolveHit(const Triangle& tri, const Ray& ray, const HitRecord& record, Hitpoint* hitpoint);
+
+    static void setPacket(const std::vector<Triangle>& triangles, const int* ids, int count, TrianglePacket* packet);
+    static void setSimdRay(const Ray& ray, SimdRay* simdRay);
+    static void intersectPacket(const TrianglePacket& packet, const SimdRay& ray, HitRecord* record);
+    static BBox childBox(const QBVHNode& node, int i);
+    static void setChildBoxes(const BBox boxes[4], QBVHNode* node);
+
+    static inline bool isLeaf(unsigned int entry) { return (entry & _leafFlag) != 0; }
+    static inline int leafStart(unsigned int entry) { return (int)((entry & ~_leafFlag) >> _leafCountBits); }
+    static inline int leafCount(unsigned int entry) { return (int)(entry & ((1 << _leafCountBits) - 1)); }
+    static inline unsigned int leafEntry(int start, int count) {
+        return _leafFlag | ((unsigned int)start << _leafCountBits) | (unsigned int)count;
+    }
 };
 
 #endif  // _SPICA_QBVH_ACCEL_H_
\ No newline at end of file
@@ -48,13 +48,15 @@ void Ray::calcInvdir() {
 Hitpoint::Hitpoint()
     : _distance(INFTY)
     , _normal()
-    , _position() {
+    , _position()
+    , _error(0.0) {
 }
 
 Hitpoint::Hitpoint(const Hitpoint& hp)
     : _distance(hp._distance)
     , _normal(hp._normal)
-    , _position(hp._position) {
+    , _position(hp._position)
+    , _error(hp._error) {
 }
 
 Hitpoint::~Hitpoint() {
@@ -64,9 +66,18 @@ Hitpoint& Hitpoint::operator=(const Hitpoint& hp) {
     this->_distance = hp._distance;
     this->_normal = hp._normal;
     this->_position = hp._position;
+    this->_error = hp._error;
     return *this;
 }
 
+Ray Hitpoint::spawnRay(const Vector3D& direction) const {
+    const Vector3D offset = _normal * _error;
+    if (Vector3D::dot(direction, _normal) < 0.0) {
+        return Ray(_position - offset, direction);
+    }
+    return Ray(_position + offset, direction);
+}
+
 Intersection::Intersection()
     : _hitPoint()
     , _objectId(-1) {
@@ -40,6 +40,7 @@ private:
     double _distance;
     Vector3D _normal;
     Vector3D _position;
+    double _error;    // Bound of the distance between the position and the surface
 
 public:
     Hitpoint();
@@ -51,10 +52,17 @@ public:
     inline double distance() const { return _distance; }
     inline Vector3D normal() const { return _normal; }
     inline Vector3D position() const { return _position; }
+    inline double error() const { return _error; }
 
     inline void setDistance(double distance) { _distance = distance; }
     inline void setNormal(const Vector3D& normal) { _normal = normal; }
     inline void setPosition(const Vector3D& position) { _position = position; }
+    inline void setError(double error) { _error = error; }
+
+    // Ray leaving the surface toward the given direction
+    // The origin is pushed off the surface by the error bound to the side
+    // of the direction, so that the ray does not hit the surface again.
+    Ray spawnRay(const Vector3D& direction) const;
 };
 
 class Intersection {
@@ -0,0 +1,42 @@
+#define RAY_PACKET_EXPORT
+#include "ray_packet.h"
+
+#include "common.h"
+
+const Hitpoint RayPacket::_noHit = Hitpoint();
+
+RayPacket::RayPacket()
+    : _size(0)
+{
+}
+
+RayPacket::RayPacket(const RayPacket& packet)
+    : _size(0)
+{
+    operator=(packet);
+}
+
+RayPacket::~RayPacket()
+{
+}
+
+RayPacket& RayPacket::operator=(const RayPacket& packet) {
+    for (int i = 0; i < packet._size; i++) {
+        this->_rays[i] = packet._rays[i];
+        this->_isects[i] = packet._isects[i];
+    }
+    this->_size = packet._size;
+    return *this;
+}
+
+void RayPacket::clear() {
+    _size = 0;
+}
+
+int RayPacket::add(const Ray& ray) {
+    Assertion(_size < maxSize, "Ray packet is full");
+    _rays[_size] = ray;
+    _isects[_size].setObjectId(-1);
+    _isects[_size].setHitpoint(_noHit);
+    return _size++;
+}
@@ -0,0 +1,57 @@
+#ifndef _RAY_PACKET_H_
+#define _RAY_PACKET_H_
+
+#if defined(_WIN32) || defined(__WIN32__)
+    #ifdef RAY_PACKET_EXPORT
+        #define RAY_PACKET_DLL __declspec(dllexport)
+    #else
+        #define RAY_PACKET_DLL __declspec(dllimport)
+    #endif
+#else
+    #define RAY_PACKET_DLL
+#endif
+
+#include "ray.h"
+
+// Small group of coherent rays (e.g. neighboring camera rays)
+// which are traversed through the accelerator together
+class RAY_PACKET_DLL RayPacket {
+public:
+    static const int maxSize = 8;
+
+private:
+    Ray _rays[maxSize];
+    Intersection _isects[maxSize];
+    int _size;
+
+    static const Hitpoint _noHit;
+
+public:
+    RayPacket();
+    RayPacket(const RayPacket& packet);
+    ~RayPacket();
+
+    RayPacket& operator=(const RayPacket& packet);
+
+    // Remove all the rays
+    void clear();
+
+    // Add a ray to the packet
+    // @param[in] ray: ray to be traced (the packet must not be full)
+    // @return index of the ray in the packet
+    int add(const Ray& ray);
+
+    // Bit mask of the rays in the packet
+    inline int activeMask() const { return (1 << _size) - 1; }
+
+    inline int size() const { return _size; }
+    inline bool isFull() const { return _size == maxSize; }
+    inline const Ray& ray(int i) const { return _rays[i]; }
+    inline const Intersection& intersection(int i) const { return _isects[i]; }
+    inline void setIntersection(int i, int objectID, const Hitpoint& hitpoint) {
+        _isects[i].setObjectId(objectID);
+        _isects[i].setHitpoint(hitpoint);
+    }
+};
+
+#endif  // _RAY_PACKET_H_
@@ -5,7 +5,15 @@
     
 Scene::Scene()
     : _triangles()
+    , _bsdfIds()
     , _bsdfs()
+    , _accel()
+    , _meshes()
+    , _meshBoxes()
+    , _instances()
+    , _numInstancedTriangles(0)
+    , _instanceAccel()
+    , _cacheDirectory()
     , _envmap()
 {
     _envmap.resize(512, 512);
@@ -16,32 +24,157 @@ Scene::~Scene()
 {
 }
 
-const Triangle& Scene::getTriangle(int id) const {
-    Assertion(id >= 0 && id < _triangles.size(), "Triangle index out of bounds");
-    return _triangles[id];
+void Scene::addInstance(const Trimesh& mesh, const Transform& transform, const BSDF& bsdf) {
+    int meshID = -1;
+    for (int i = 0; i < (int)_meshes.size(); i++) {
+        if (mesh.accel() != NULL && _meshes[i].accel() == mesh.accel()) {
+            meshID = i;
+            break;
+        }
+    }
+
+    if (meshID < 0) {
+        meshID = (int)_meshes.size();
+        _meshes.push_back(mesh);
+        if (_meshes.back().accel() == NULL) {
+            _meshes.back().buildAccel();
+        }
+
+        BBox box;
+        for (int i = 0; i < (int)mesh.numVerts(); i++) {
+            box.merge(mesh.getVertex(i));
+        }
+        _meshBoxes.push_back(box);
+    }
+
+    MeshInstance instance;
+    instance.meshID = meshID;
+    instance.bsdfID = (int)_bsdfs.size();
+    instance.idOffset = _numInstancedTriangles;
+    instance.transform = transform;
+    _instances.push_back(instance);
+
+    _bsdfs.push_back(bsdf);
+    _numInstancedTriangles += static_cast<int>(mesh.numFaces());
+}
+
+const Scene::MeshInstance& Scene::findInstance(int id) const {
+    // The last instance whose offset is not greater than the index
+    const int localID = id - (int)_triangles.size();
+    int lo = 0;
+    int hi = (int)_instances.size();
+    while (hi - lo > 1) {
+        const int mid = (lo + hi) / 2;
+        if (_instances[mid].idOffset <= localID) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return _instances[lo];
+}
+
+Triangle Scene::getTriangle(int id) const {
+    Assertion(id >= 0 && id < (int)numTriangles(), "Triangle index out of bounds");
+    if (id < (int)_triangles.size()) {
+        return _triangles[id];
+    }
+
+    const MeshInstance& instance = findInstance(id);
+    const int faceID = id - (int)_triangles.size() - instance.idOffset;
+    return instance.transform.applyToTriangle(_meshes[instance.meshID].getTriangle(faceID));
 }
 
 const BSDF& Scene::getBsdf(int id) const {
-    Assertion(id >= 0 && id < _bsdfIds.size(), "Object index out of boudns");
-    return _bsdfs[_bsdfIds[id]];
+    Assertion(id >= 0 && id < (int)numTriangles(), "Object index out of boudns");
+    if (id < (int)_bsdfIds.size()) {
+        return _bsdfs[_bsdfIds[id]];
+    }
+    return _bsdfs[findInstance(id).bsdfID];
 }
 
 void Scene::clear() {
     _triangles.clear();
     _bsdfIds.clear();
     _bsdfs.clear();
+    _meshes.clear();
+    _meshBoxes.clear();
+    _instances.clear();
+    _numInstancedTriangles = 0;
+    _instanceAccel.reset();
 }
 
-void Scene::setAccelerator() {
-    _accel = std::shared_ptr<QBVHAccel>(new QBVHAccel());
-    _accel->construct(_triangles);
+void Scene::setAccelerator(AccelBuildType buildType, AccelType accelType) {
+    _accel = accel::create(accelType);
+    if (_cacheDirectory.empty()) {
+        _accel->construct(_triangles, buildType);
+    } else {
+        accel::constructCached(_accel.get(), _triangles, buildType, _cacheDirectory);
+    }
+    buildInstanceAccel();
+}
+
+bool Scene::refitAccelerator(double maxCostRatio) {
+    if (_accel == NULL) {
+        setAccelerator();
+        return true;
+    }
+
+    const bool rebuilt = _accel->refit(_triangles, maxCostRatio);
+    buildInstanceAccel();
+    return rebuilt;
+}
+
+void Scene::buildInstanceAccel() {
+    _instanceAccel.reset();
+    if (_instances.empty()) {
+        return;
+    }
+
+    // Triangles added with add() are traced as an instance without transformation
+    std::vector<Instance> instances;
+    if (!_triangles.empty()) {
+        Instance flat;
+        flat.accel = _accel;
+        for (int i = 0; i < (int)_triangles.size(); i++) {
+            flat.objectBox.merge(_triangles[i]);
+        }
+        instances.push_back(flat);
+    }
+
+    for (int i = 0; i < (int)_instances.size(); i++) {
+        Instance instance;
+        instance.accel = _meshes[_instances[i].meshID].accel();
+        instance.transform = _instances[i].transform;
+        instance.objectBox = _meshBoxes[_instances[i].meshID];
+        instance.idOffset = (int)_triangles.size() + _instances[i].idOffset;
+        instances.push_back(instance);
+    }
+
+    _instanceAccel = std::shared_ptr<InstanceAccel>(new InstanceAccel());
+    _instanceAccel->construct(instances);
 }
 
 bool Scene::intersect(const Ray& ray, Intersection& isect) const {
     Hitpoint hitpoint;
-    int triID = _accel->intersect(ray, &hitpoint);
+    int triID = _instanceAccel != NULL ? _instanceAccel->intersect(ray, &hitpoint)
+                                       : _accel->intersect(ray, &hitpoint);
 
     isect.setObjectId(triID);
     isect.setHitpoint(hitpoint);
     return triID != -1;
 }
+
+int Scene::intersect(RayPacket& packet) const {
+    if (_instanceAccel != NULL) {
+        return _instanceAccel->intersect(packet);
+    }
+    return _accel->intersect(packet);
+}
+
+bool Scene::occluded(const Ray& ray, double tMax) const {
+    if (_instanceAccel != NULL) {
+        return _instanceAccel->occluded(ray, tMax);
+    }
+    return _accel->occluded(ray, tMax);
+}
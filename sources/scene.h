@@ -11,24 +11,44 @@
     #define SCENE_DLL
 #endif
 
+#include <string>
 #include <vector>
 #include <memory>
 
 #include "common.h"
 #include "vector3d.h"
 #include "triangle.h"
-#include "qbvh_accel.h"
+#include "trimesh.h"
+#include "transform.h"
+#include "accel.h"
+#include "instance_accel.h"
 
 #include "ray.h"
+#include "ray_packet.h"
 #include "brdf.h"
 #include "envmap.h"
     
 class SCENE_DLL Scene {
 private:
+    // Placement of a shared mesh. Triangles of the instances are indexed
+    // after the triangles added with add() in the order of addition.
+    struct MeshInstance {
+        int meshID;
+        int bsdfID;
+        int idOffset;
+        Transform transform;
+    };
+
     std::vector<Triangle>      _triangles;
     std::vector<int>           _bsdfIds;
     std::vector<BSDF>          _bsdfs;
-    std::shared_ptr<QBVHAccel> _accel;
+    std::shared_ptr<IAccel>    _accel;
+    std::vector<Trimesh>       _meshes;
+    std::vector<BBox>          _meshBoxes;
+    std::vector<MeshInstance>  _instances;
+    int                        _numInstancedTriangles;
+    std::shared_ptr<InstanceAccel> _instanceAccel;
+    std::string                _cacheDirectory;
     Envmap _envmap;
 
 public:
@@ -49,19 +69,54 @@ public:
         _bsdfs.push_back(bsdf);
     }
 
-    const Triangle& getTriangle(int triangleId) const;
+    // Add an instance of the mesh placed with the transform
+    // Instances of the meshes sharing an acceleration structure (copies of one
+    // mesh after Trimesh::buildAccel) share the mesh and the tree in the scene.
+    // The tree is built here if the mesh does not have it yet.
+    void addInstance(const Trimesh& mesh, const Transform& transform, const BSDF& bsdf);
+
+    // Triangle with the scene-wide index (instanced triangles are transformed to the world space)
+    Triangle getTriangle(int triangleId) const;
     const BSDF& getBsdf(int triangleId) const;
 
     void clear();
-    void setAccelerator();
+
+    // Build the acceleration structure over the triangles added so far
+    // @param[in] buildType: split strategy of the tree
+    // @param[in] accelType: tree width (chosen by the CPU features by default)
+    // Instanced meshes keep the trees built by Trimesh::buildAccel, and
+    // a top-level tree over the instances is built if there are any.
+    void setAccelerator(AccelBuildType buildType = ACCEL_BUILD_SAH, AccelType accelType = ACCEL_TYPE_AUTO);
+
+    // Directory where setAccelerator caches the tree (with a trailing separator)
+    // The tree is mapped from the cache without construction if the scene is not changed.
+    // Caching is disabled with an empty string (default).
+    inline void setAcceleratorCache(const std::string& directory) { _cacheDirectory = directory; }
+
+    // Update the acceleration structure for moved geometry (e.g. the next frame of an animation)
+    // The scene must be cleared and the same geometry must be added in the same order
+    // before calling this. Instanced meshes keep their trees, and only the top-level tree is rebuilt.
+    // @param[in] maxCostRatio: the tree is rebuilt if its SAH cost grows more than this ratio
+    // @return true if the tree was rebuilt
+    bool refitAccelerator(double maxCostRatio = 1.5);
 
     bool intersect(const Ray& ray, Intersection& isect) const;
 
-    inline size_t numTriangles() const { return _triangles.size(); }
+    // Intersection test for a packet of coherent rays (e.g. neighboring camera rays)
+    // @return bit mask of the rays which hit the scene
+    int intersect(RayPacket& packet) const;
+
+    // Check if any triangle is hit closer than tMax (for visibility tests)
+    bool occluded(const Ray& ray, double tMax = INFTY) const;
+
+    inline size_t numTriangles() const { return _triangles.size() + _numInstancedTriangles; }
     inline const Envmap& envmap() const { return _envmap; }
     inline void setEnvmap(const Envmap& envmap) { _envmap = envmap; }
 
 private:
+    const MeshInstance& findInstance(int triangleId) const;
+    void buildInstanceAccel();
+
     Scene(const Scene& scene) = delete;
     Scene& operator=(const Scene& scene) = delete;
 };
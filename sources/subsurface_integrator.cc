@@ -300,7 +300,7 @@ void SubsurfaceIntegrator::buildPhotonMap(const Scene& scene, const int numPhoto
 
                 double pdf = 1.0;
                 bsdf.sample(currentRay.direction(), hitpoint.normal(), rands[1], rands[2], &nextDir, &pdf);
-                currentRay = Ray(hitpoint.position(), nextDir);
+                currentRay = hitpoint.spawnRay(nextDir);
                 currentFlux = currentFlux * bsdf.reflectance() / (roulette * pdf);
             }
         }
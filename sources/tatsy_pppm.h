@@ -2,8 +2,9 @@
 #define _TATSY_PPPM_H_
 
 #include "vector3d.h"
-#include "qbvh_accel.h"
+#include "accel.h"
 #include "trimesh.h"
+#include "transform.h"
 #include "brdf.h"
 #include "scene.h"
 
@@ -0,0 +1,153 @@
+#define TRANSFORM_EXPORT
+#include "transform.h"
+
+#include <cmath>
+#include <cstring>
+
+#include "common.h"
+
+namespace {
+
+    // Inverse of the affine matrix [A | b], which is [A^-1 | -A^-1 b]
+    void invertAffine(const double m[3][4], double inv[3][4]) {
+        const double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                         - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                         + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        Assertion(std::abs(det) > 1.0e-12, "Transform is not invertible");
+
+        const double invdet = 1.0 / det;
+        inv[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invdet;
+        inv[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) * invdet;
+        inv[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invdet;
+        inv[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) * invdet;
+        inv[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invdet;
+        inv[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) * invdet;
+        inv[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invdet;
+        inv[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) * invdet;
+        inv[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invdet;
+        for (int i = 0; i < 3; i++) {
+            inv[i][3] = -(inv[i][0] * m[0][3] + inv[i][1] * m[1][3] + inv[i][2] * m[2][3]);
+        }
+    }
+
+}
+
+Transform::Transform()
+{
+    memset(_m, 0, sizeof(_m));
+    memset(_inv, 0, sizeof(_inv));
+    for (int i = 0; i < 3; i++) {
+        _m[i][i] = 1.0;
+        _inv[i][i] = 1.0;
+    }
+}
+
+Transform::Transform(const Vector3D& row0, const Vector3D& row1, const Vector3D& row2, const Vector3D& move)
+{
+    const Vector3D rows[3] = { row0, row1, row2 };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            _m[i][j] = rows[i][j];
+        }
+        _m[i][3] = move[i];
+    }
+    invertAffine(_m, _inv);
+}
+
+Transform::Transform(const Transform& transform)
+{
+    operator=(transform);
+}
+
+Transform::~Transform()
+{
+}
+
+Transform& Transform::operator=(const Transform& transform) {
+    memcpy(_m, transform._m, sizeof(_m));
+    memcpy(_inv, transform._inv, sizeof(_inv));
+    return *this;
+}
+
+Transform Transform::operator*(const Transform& t) const {
+    double r[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r[i][j] = _m[i][0] * t._m[0][j] + _m[i][1] * t._m[1][j] + _m[i][2] * t._m[2][j];
+        }
+        r[i][3] += _m[i][3];
+    }
+    return Transform(Vector3D(r[0][0], r[0][1], r[0][2]),
+                     Vector3D(r[1][0], r[1][1], r[1][2]),
+                     Vector3D(r[2][0], r[2][1], r[2][2]),
+                     Vector3D(r[0][3], r[1][3], r[2][3]));
+}
+
+Transform Transform::translate(const Vector3D& move) {
+    return Transform(Vector3D(1.0, 0.0, 0.0), Vector3D(0.0, 1.0, 0.0), Vector3D(0.0, 0.0, 1.0), move);
+}
+
+Transform Transform::scale(double scaleX, double scaleY, double scaleZ) {
+    return Transform(Vector3D(scaleX, 0.0, 0.0), Vector3D(0.0, scaleY, 0.0), Vector3D(0.0, 0.0, scaleZ), Vector3D());
+}
+
+Transform Transform::rotate(const Vector3D& axis, double theta) {
+    // Rodrigues' rotation formula
+    const Vector3D a = axis.normalized();
+    const double c = cos(theta);
+    const double s = sin(theta);
+    const double x = a.x(), y = a.y(), z = a.z();
+    return Transform(Vector3D(c + x * x * (1.0 - c), x * y * (1.0 - c) - z * s, x * z * (1.0 - c) + y * s),
+                     Vector3D(y * x * (1.0 - c) + z * s, c + y * y * (1.0 - c), y * z * (1.0 - c) - x * s),
+                     Vector3D(z * x * (1.0 - c) - y * s, z * y * (1.0 - c) + x * s, c + z * z * (1.0 - c)),
+                     Vector3D());
+}
+
+Transform Transform::inverted() const {
+    Transform ret;
+    memcpy(ret._m, _inv, sizeof(_m));
+    memcpy(ret._inv, _m, sizeof(_inv));
+    return ret;
+}
+
+Vector3D Transform::applyToPoint(const Vector3D& p) const {
+    return Vector3D(_m[0][0] * p.x() + _m[0][1] * p.y() + _m[0][2] * p.z() + _m[0][3],
+                    _m[1][0] * p.x() + _m[1][1] * p.y() + _m[1][2] * p.z() + _m[1][3],
+                    _m[2][0] * p.x() + _m[2][1] * p.y() + _m[2][2] * p.z() + _m[2][3]);
+}
+
+Vector3D Transform::applyToVector(const Vector3D& v) const {
+    return Vector3D(_m[0][0] * v.x() + _m[0][1] * v.y() + _m[0][2] * v.z(),
+                    _m[1][0] * v.x() + _m[1][1] * v.y() + _m[1][2] * v.z(),
+                    _m[2][0] * v.x() + _m[2][1] * v.y() + _m[2][2] * v.z());
+}
+
+Vector3D Transform::applyToNormal(const Vector3D& n) const {
+    return Vector3D(_inv[0][0] * n.x() + _inv[1][0] * n.y() + _inv[2][0] * n.z(),
+                    _inv[0][1] * n.x() + _inv[1][1] * n.y() + _inv[2][1] * n.z(),
+                    _inv[0][2] * n.x() + _inv[1][2] * n.y() + _inv[2][2] * n.z());
+}
+
+Triangle Transform::applyToTriangle(const Triangle& t) const {
+    return Triangle(applyToPoint(t.p0()), applyToPoint(t.p1()), applyToPoint(t.p2()));
+}
+
+BBox Transform::applyToBBox(const BBox& box) const {
+    BBox ret;
+    for (int i = 0; i < 8; i++) {
+        const Vector3D corner((i & 1) ? box.posMax().x() : box.posMin().x(),
+                              (i & 2) ? box.posMax().y() : box.posMin().y(),
+                              (i & 4) ? box.posMax().z() : box.posMin().z());
+        ret.merge(applyToPoint(corner));
+    }
+    return ret;
+}
+
+bool Transform::isIdentity() const {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            if (_m[i][j] != (i == j ? 1.0 : 0.0)) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef _TRANSFORM_H_
+#define _TRANSFORM_H_
+
+#if defined(_WIN32) || defined(__WIN32__)
+    #ifdef TRANSFORM_EXPORT
+        #define TRANSFORM_DLL __declspec(dllexport)
+    #else
+        #define TRANSFORM_DLL __declspec(dllimport)
+    #endif
+#else
+    #define TRANSFORM_DLL
+#endif
+
+#include "vector3d.h"
+#include "triangle.h"
+#include "bbox.h"
+
+// ----------------------------------------
+// ! Affine transformation (3x4 matrix and its inverse)
+// ----------------------------------------
+class TRANSFORM_DLL Transform {
+private:
+    double _m[3][4];
+    double _inv[3][4];
+
+public:
+    // Identity transform
+    Transform();
+
+    // Transform with the linear part (rows) and the translation
+    // @param[in] row0, row1, row2: rows of the linear part (must be invertible)
+    // @param[in] move: translation applied after the linear part
+    Transform(const Vector3D& row0, const Vector3D& row1, const Vector3D& row2, const Vector3D& move);
+
+    Transform(const Transform& transform);
+    ~Transform();
+
+    Transform& operator=(const Transform& transform);
+
+    // Composition (the right-hand side is applied first)
+    Transform operator*(const Transform& transform) const;
+
+    static Transform translate(const Vector3D& move);
+    static Transform scale(double scaleX, double scaleY, double scaleZ);
+
+    // Rotation around the axis by angle theta (in radian)
+    static Transform rotate(const Vector3D& axis, double theta);
+
+    Transform inverted() const;
+
+    Vector3D applyToPoint(const Vector3D& p) const;
+    Vector3D applyToVector(const Vector3D& v) const;
+
+    // Normals are transformed with the inverse transpose (not normalized)
+    Vector3D applyToNormal(const Vector3D& n) const;
+
+    Triangle applyToTriangle(const Triangle& t) const;
+
+    // Bounding box of the transformed box
+    BBox applyToBBox(const BBox& box) const;
+
+    bool isIdentity() const;
+};
+
+#endif  // _TRANSFORM_H_
@@ -87,6 +87,11 @@ bool Trimesh::intersect(const Ray& ray, Hitpoint* hitpoint) const {
     return _accel->intersect(ray, hitpoint) != -1;
 }
 
+bool Trimesh::occluded(const Ray& ray, double tMax) const {
+    Assertion(_accel != NULL, "Accelerator is not constructed");
+    return _accel->occluded(ray, tMax);
+}
+
 double Trimesh::area() const {
     double ret = 0.0;
     for (unsigned int i = 0; i < _faces.size(); i++) {
@@ -118,10 +123,15 @@ void Trimesh::buildAccel() {
         triangles[i] = Triangle(p0, p1, p2);
     }
 
-    _accel = std::shared_ptr<QBVHAccel>(new QBVHAccel());
+    _accel = accel::create();
     _accel->construct(triangles);
 }
 
+bool Trimesh::refitAccel(double maxCostRatio) {
+    Assertion(_accel != NULL, "Accelerator is not constructed");
+    return _accel->refit(triangulate(), maxCostRatio);
+}
+
 void Trimesh::load(const std::string& filename) {
     int dotPos = filename.find_last_of(".");
     std::string ext = filename.substr(dotPos);
@@ -24,7 +24,7 @@
 #include "plane.h"
 
 #include "vector3d.h"
-#include "qbvh_accel.h"
+#include "accel.h"
 
 class Triplet {
 private:
@@ -70,7 +70,7 @@ private:
     std::vector<Vector3D> _vertices;
     std::vector<Vector3D> _normals;
     std::vector<Triplet> _faces;
-    std::shared_ptr<QBVHAccel> _accel;
+    std::shared_ptr<IAccel> _accel;
 
 public:
     // Contructor
@@ -101,6 +101,11 @@ public:
     // @param[out] hitpoint: hit point if intersected
     bool intersect(const Ray& ray, Hitpoint* hitpoint) const override;
 
+    // Check occlusion (faster than intersect as the hit point is not computed)
+    // @param[in] ray: input to check occlusion with
+    // @param[in] tMax: distance to the end of the ray segment
+    bool occluded(const Ray& ray, double tMax = INFTY) const;
+
     // Area of trimesh
     double area() const override;
 
@@ -113,6 +118,12 @@ public:
     // Build accelerator structure
     void buildAccel();
 
+    // Update the accelerator structure after the vertices are moved
+    // (e.g. by translate or scale). The copies of the mesh share the updated tree.
+    // @param[in] maxCostRatio: the tree is rebuilt if its SAH cost grows more than this ratio
+    // @return true if the tree was rebuilt
+    bool refitAccel(double maxCostRatio = 1.5);
+
     // Load mesh file
     // @param[in] filename: .obj or .ply file
     void load(const std::string& filename);
@@ -160,6 +171,9 @@ public:
     // Get the number of faces (triangles)
     inline size_t numFaces() const { return _faces.size(); }
 
+    // Acceleration structure made by buildAccel (shared by the copies of the mesh)
+    inline std::shared_ptr<IAccel> accel() const { return _accel; }
+
 private:
     void loadPly(const std::string& filename);
     void loadObj(const std::string& filename);
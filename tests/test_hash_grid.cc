@@ -0,0 +1,71 @@
+#include "gtest/gtest.h"
+
+#include "../sources/renderer.h"
+
+#include "test_macros.h"
+
+namespace {
+
+    // Points clustered on a few planes (like photons on surfaces)
+    std::vector<Vector3D> randomPoints(int numPoints, unsigned int seed) {
+        Random rng(seed);
+        std::vector<Vector3D> points(numPoints);
+        for (int i = 0; i < numPoints; i++) {
+            const double plane = 0.25 * rng.nextInt(4);
+            points[i] = Vector3D(rng.nextReal(), plane, rng.nextReal() * 2.0);
+        }
+        return points;
+    }
+
+}
+
+TEST(HashGridTest, Construct) {
+    // Flattened cells hold the same items as the cells filled one by one
+    const std::vector<Vector3D> points = randomPoints(2000, 17);
+    const double radius = 0.03;
+    const Vector3D radv(radius, radius, radius);
+    const BBox bbox(Vector3D(-0.1, -0.1, -0.1), Vector3D(1.1, 1.1, 2.1));
+
+    HashGrid<int> grid, flatGrid;
+    grid.init(1000, 1.0 / (radius * 2.0), bbox);
+    flatGrid.init(1000, 1.0 / (radius * 2.0), bbox);
+    std::vector<int> items(points.size());
+    std::vector<BBox> boxes(points.size());
+    for (int i = 0; i < (int)points.size(); i++) {
+        grid.add(i, points[i] - radv, points[i] + radv);
+        items[i] = i;
+        boxes[i] = BBox(points[i] - radv, points[i] + radv);
+    }
+    parallel::setNumChunks(5);    // Items must stay in order across the chunks
+    flatGrid.construct(items, boxes);
+    parallel::setNumChunks(0);
+
+    const std::vector<Vector3D> queries = randomPoints(500, 23);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        const std::vector<int>& expected = grid[queries[i]];
+        const HashGrid<int>::Span actual = flatGrid.cell(queries[i]);
+        ASSERT_EQ(expected.size(), actual.size());
+        for (int k = 0; k < actual.size(); k++) {
+            EXPECT_EQ(expected[k], actual[k]);
+        }
+    }
+}
+
+TEST(HashGridTest, InitAfterConstruct) {
+    // Initializing the flattened grid again makes add() and operator[] usable
+    const BBox bbox(Vector3D(0.0, 0.0, 0.0), Vector3D(1.0, 1.0, 1.0));
+    const Vector3D p(0.5, 0.5, 0.5);
+    const Vector3D margin(0.01, 0.01, 0.01);
+
+    HashGrid<int> grid;
+    grid.init(100, 10.0, bbox);
+    grid.construct(std::vector<int>(1, 7), std::vector<BBox>(1, BBox(p - margin, p + margin)));
+    ASSERT_EQ(1, grid.cell(p).size());
+    EXPECT_EQ(7, grid.cell(p)[0]);
+
+    grid.init(100, 10.0, bbox);
+    EXPECT_TRUE(grid[p].empty());
+    grid.add(3, p - margin, p + margin);
+    ASSERT_EQ(1, grid[p].size());
+    EXPECT_EQ(3, grid[p][0]);
+}
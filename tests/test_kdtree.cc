@@ -0,0 +1,179 @@
+#include "gtest/gtest.h"
+
+#include "../sources/renderer.h"
+
+#include "test_macros.h"
+
+namespace {
+
+    // Points clustered on a few planes (like photons on surfaces)
+    std::vector<Vector3D> randomPoints(int numPoints, unsigned int seed) {
+        Random rng(seed);
+        std::vector<Vector3D> points(numPoints);
+        for (int i = 0; i < numPoints; i++) {
+            const double plane = 0.25 * rng.nextInt(4);
+            points[i] = Vector3D(rng.nextReal(), plane, rng.nextReal() * 2.0);
+        }
+        return points;
+    }
+
+    // Distances to the k nearest points within epsilon in ascending order
+    std::vector<double> bruteForceKnn(const std::vector<Vector3D>& points, const Vector3D& query, int k, double epsilon) {
+        std::vector<double> dists;
+        for (int i = 0; i < (int)points.size(); i++) {
+            const double dist = (points[i] - query).norm();
+            if (dist < epsilon) dists.push_back(dist);
+        }
+        std::sort(dists.begin(), dists.end());
+        if (k > 0 && (int)dists.size() > k) dists.resize(k);
+        return dists;
+    }
+
+    // Visitor which records the squared distances of the visited points
+    struct DistanceRecorder {
+        std::vector<double> dists;
+        void operator()(int index, double dist2) {
+            dists.push_back(sqrt(dist2));
+        }
+    };
+
+    std::vector<double> sortedDistances(const std::vector<Vector3D>& results, const Vector3D& query) {
+        std::vector<double> dists;
+        for (int i = 0; i < (int)results.size(); i++) {
+            dists.push_back((results[i] - query).norm());
+        }
+        std::sort(dists.begin(), dists.end());
+        return dists;
+    }
+
+}
+
+TEST(KdTreeTest, KnnSearch) {
+    // A single bucket, two buckets, and buckets of different sizes
+    const int sizes[4] = { 1, 17, 777, 5000 };
+    for (int s = 0; s < 4; s++) {
+        const std::vector<Vector3D> points = randomPoints(sizes[s], s);
+        KdTree<Vector3D> kdtree;
+        kdtree.construct(points);
+        EXPECT_EQ(sizes[s], kdtree.size());
+
+        const std::vector<Vector3D> queries = randomPoints(100, 100 + s);
+        for (int i = 0; i < (int)queries.size(); i++) {
+            std::vector<Vector3D> results;
+            kdtree.knnSearch(queries[i], KnnQuery(K_NEAREST | EPSILON_BALL, 0.2, 16), &results);
+            const std::vector<double> expected = bruteForceKnn(points, queries[i], 16, 0.2);
+            const std::vector<double> actual = sortedDistances(results, queries[i]);
+            ASSERT_EQ(expected.size(), actual.size());
+            for (int j = 0; j < (int)expected.size(); j++) {
+                EXPECT_DOUBLE_EQ(expected[j], actual[j]);
+            }
+        }
+    }
+}
+
+TEST(KdTreeTest, ParallelNthElement) {
+    Random rng(0);
+    std::vector<int> values(100000);
+    for (int i = 0; i < (int)values.size(); i++) {
+        values[i] = rng.nextInt(1000);
+    }
+
+    const int nths[3] = { 0, 31415, 99999 };
+    for (int k = 0; k < 3; k++) {
+        std::vector<int> expected(values);
+        std::vector<int> actual(values);
+        std::nth_element(expected.begin(), expected.begin() + nths[k], expected.end(), std::less<int>());
+        parallel::nthElement(actual.begin(), actual.begin() + nths[k], actual.end(), std::less<int>(), 1000);
+
+        EXPECT_EQ(expected[nths[k]], actual[nths[k]]);
+        for (int i = 0; i < (int)values.size(); i++) {
+            if (i < nths[k]) EXPECT_LE(actual[i], actual[nths[k]]);
+            if (i > nths[k]) EXPECT_GE(actual[i], actual[nths[k]]);
+        }
+    }
+}
+
+TEST(KdTreeTest, LargeTree) {
+    // Top levels are split in parallel and subtrees are built concurrently
+    const std::vector<Vector3D> points = randomPoints(50000, 0);
+    KdTree<Vector3D> kdtree;
+    kdtree.construct(points);
+
+    const std::vector<Vector3D> queries = randomPoints(100, 1);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        std::vector<Vector3D> results;
+        kdtree.knnSearch(queries[i], KnnQuery(K_NEAREST | EPSILON_BALL, 0.1, 32), &results);
+        const std::vector<double> expected = bruteForceKnn(points, queries[i], 32, 0.1);
+        const std::vector<double> actual = sortedDistances(results, queries[i]);
+        ASSERT_EQ(expected.size(), actual.size());
+        for (int j = 0; j < (int)expected.size(); j++) {
+            EXPECT_DOUBLE_EQ(expected[j], actual[j]);
+        }
+    }
+}
+
+TEST(KdTreeTest, EpsilonBall) {
+    const std::vector<Vector3D> points = randomPoints(3000, 0);
+    KdTree<Vector3D> kdtree;
+    kdtree.construct(points);
+
+    const std::vector<Vector3D> queries = randomPoints(100, 1);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        std::vector<Vector3D> results;
+        kdtree.knnSearch(queries[i], KnnQuery(EPSILON_BALL, 0.1, 0), &results);
+        const std::vector<double> expected = bruteForceKnn(points, queries[i], 0, 0.1);
+        const std::vector<double> actual = sortedDistances(results, queries[i]);
+        ASSERT_EQ(expected.size(), actual.size());
+        for (int j = 0; j < (int)expected.size(); j++) {
+            EXPECT_DOUBLE_EQ(expected[j], actual[j]);
+        }
+    }
+}
+
+TEST(KdTreeTest, RangeSearch) {
+    const std::vector<Vector3D> points = randomPoints(3000, 0);
+    KdTree<Vector3D> kdtree;
+    kdtree.construct(points);
+
+    const std::vector<Vector3D> queries = randomPoints(100, 1);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        DistanceRecorder recorder;
+        kdtree.rangeSearch(queries[i], 0.1 * 0.1, recorder);
+        std::sort(recorder.dists.begin(), recorder.dists.end());
+
+        const std::vector<double> expected = bruteForceKnn(points, queries[i], 0, 0.1);
+        ASSERT_EQ(expected.size(), recorder.dists.size());
+        for (int j = 0; j < (int)expected.size(); j++) {
+            EXPECT_DOUBLE_EQ(expected[j], recorder.dists[j]);
+        }
+    }
+}
+
+TEST(KdTreeTest, QueryContext) {
+    // One context is reused across queries
+    const std::vector<Vector3D> points = randomPoints(3000, 0);
+    KdTree<Vector3D> kdtree;
+    kdtree.construct(points);
+
+    KnnQueryContext context;
+    const std::vector<Vector3D> queries = randomPoints(100, 1);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        kdtree.knnSearch(queries[i], KnnQuery(K_NEAREST | EPSILON_BALL, 0.2, 16), &context);
+        const std::vector<double> expected = bruteForceKnn(points, queries[i], 16, 0.2);
+        ASSERT_EQ(expected.size(), context.size());
+
+        std::vector<double> actual;
+        for (int j = 0; j < context.size(); j++) {
+            const double dist2 = (kdtree.point(context.index(j)) - queries[i]).squaredNorm();
+            EXPECT_DOUBLE_EQ(dist2, context.squaredDistance(j));
+            actual.push_back(sqrt(context.squaredDistance(j)));
+        }
+        std::sort(actual.begin(), actual.end());
+        for (int j = 0; j < (int)expected.size(); j++) {
+            EXPECT_DOUBLE_EQ(expected[j], actual[j]);
+        }
+        if (!expected.empty()) {
+            EXPECT_DOUBLE_EQ(expected.back() * expected.back(), context.maxSquaredDistance());
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#include "gtest/gtest.h"
+
+#include "../sources/renderer.h"
+
+#include "test_macros.h"
+
+namespace {
+
+    // Points clustered on a few planes (like photons on surfaces)
+    std::vector<Vector3D> randomPoints(int numPoints, unsigned int seed) {
+        Random rng(seed);
+        std::vector<Vector3D> points(numPoints);
+        for (int i = 0; i < numPoints; i++) {
+            const double plane = 0.25 * rng.nextInt(4);
+            points[i] = Vector3D(rng.nextReal(), plane, rng.nextReal() * 2.0);
+        }
+        return points;
+    }
+
+    // Distances to the k nearest points within epsilon in ascending order
+    std::vector<double> bruteForceKnn(const std::vector<Vector3D>& points, const Vector3D& query, int k, double epsilon) {
+        std::vector<double> dists;
+        for (int i = 0; i < (int)points.size(); i++) {
+            const double dist = (points[i] - query).norm();
+            if (dist < epsilon) dists.push_back(dist);
+        }
+        std::sort(dists.begin(), dists.end());
+        if (k > 0 && (int)dists.size() > k) dists.resize(k);
+        return dists;
+    }
+
+}
+
+TEST(PhotonMapTest, CompactPhoton) {
+    Random rng(0);
+    for (int i = 0; i < 1000; i++) {
+        const Vector3D pos(rng.nextReal() * 200.0 - 100.0, rng.nextReal() * 200.0 - 100.0, rng.nextReal() * 200.0 - 100.0);
+        const Vector3D flux(rng.nextReal() * 10.0, rng.nextReal() * 10.0, rng.nextReal() * 10.0);
+        const Vector3D dir = Vector3D(rng.nextReal() - 0.5, rng.nextReal() - 0.5, rng.nextReal() - 0.5).normalized();
+        const Vector3D normal = Vector3D(rng.nextReal() - 0.5, rng.nextReal() - 0.5, rng.nextReal() - 0.5).normalized();
+        const Photon photon(pos, flux, dir, normal);
+
+        const CompactPhoton compact(photon);
+        const Photon decoded = compact.decode(pos);
+
+        // Channels share the exponent, so the error is relative to the largest one
+        const double maxFlux = std::max(flux.x(), std::max(flux.y(), flux.z()));
+        EXPECT_LE(std::abs(decoded.flux().x() - flux.x()), maxFlux / 128.0);
+        EXPECT_LE(std::abs(decoded.flux().y() - flux.y()), maxFlux / 128.0);
+        EXPECT_LE(std::abs(decoded.flux().z() - flux.z()), maxFlux / 128.0);
+
+        // Angles are quantized into 256 bins
+        EXPECT_GE(Vector3D::dot(decoded.direction(), dir), cos(2.0 * PI / 256.0));
+        EXPECT_GE(Vector3D::dot(decoded.normal(), normal), cos(2.0 * PI / 256.0));
+    }
+
+    EXPECT_EQ(8, sizeof(CompactPhoton));
+}
+
+TEST(PhotonMapTest, FindKNN) {
+    const std::vector<Vector3D> points = randomPoints(3000, 0);
+    std::vector<Photon> photons(points.size());
+    std::vector<Vector3D> positions(points.size());
+    for (int i = 0; i < (int)points.size(); i++) {
+        photons[i] = Photon(points[i], Vector3D(1.0, 0.5, 0.25), Vector3D(0.0, -1.0, 0.0), Vector3D(0.0, 1.0, 0.0));
+        positions[i] = Vector3D((float)points[i].x(), (float)points[i].y(), (float)points[i].z());
+    }
+
+    PhotonMap photonMap;
+    photonMap.construct(photons);
+    EXPECT_EQ(photons.size(), photonMap.size());
+    EXPECT_LE(photonMap.memoryUsage(), photons.size() * 24);
+
+    KnnQueryContext context;
+    const std::vector<Vector3D> queries = randomPoints(100, 1);
+    for (int i = 0; i < (int)queries.size(); i++) {
+        const Photon query(queries[i], Vector3D(), Vector3D(), Vector3D(0.0, 1.0, 0.0));
+        photonMap.findKNN(query, &context, 16, 0.2);
+
+        // Photons are searched at their float positions
+        const std::vector<double> expected = bruteForceKnn(positions, queries[i], 16, 0.2);
+        ASSERT_EQ(expected.size(), context.size());
+
+        std::vector<double> actual;
+        for (int j = 0; j < context.size(); j++) {
+            actual.push_back((photonMap.position(context.index(j)) - queries[i]).norm());
+            const Vector3D flux = photonMap.flux(context.index(j));
+            EXPECT_NEAR(1.0, flux.x(), 1.0 / 128.0);
+            EXPECT_NEAR(0.5, flux.y(), 1.0 / 128.0);
+            EXPECT_NEAR(0.25, flux.z(), 1.0 / 128.0);
+        }
+        std::sort(actual.begin(), actual.end());
+        for (int j = 0; j < (int)expected.size(); j++) {
+            EXPECT_DOUBLE_EQ(expected[j], actual[j]);
+        }
+    }
+}
+
+TEST(PhotonMapTest, SortQueries) {
+    // Points on a line are sorted along it
+    std::vector<Vector3D> positions;
+    for (int i = 0; i < 1000; i++) {
+        positions.push_back(Vector3D(999.0 - i, 0.0, 0.0));
+    }
+
+    std::vector<int> order;
+    PhotonMap::sortQueries(positions, &order);
+    ASSERT_EQ(positions.size(), order.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        EXPECT_EQ(999 - i, order[i]);
+    }
+}
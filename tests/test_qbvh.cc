@@ -0,0 +1,567 @@
+#include "gtest/gtest.h"
+
+#include "../sources/renderer.h"
+
+#include "test_macros.h"
+
+namespace {
+
+    int bruteForceIsect(const std::vector<Triangle>& triangles, const Ray& ray, Hitpoint* hitpoint) {
+        int ret = -1;
+        for (int i = 0; i < (int)triangles.size(); i++) {
+            Hitpoint hpTemp;
+            if (triangles[i].intersect(ray, &hpTemp)) {
+                if (hitpoint->distance() > hpTemp.distance()) {
+                    *hitpoint = hpTemp;
+                    ret = i;
+                }
+            }
+        }
+        return ret;
+    }
+
+    void checkRandomRays(const std::vector<Triangle>& triangles, const IAccel& accel, int nTrial) {
+        Random rng(0);
+        for (int i = 0; i < nTrial; i++) {
+            Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+            Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+            Ray ray(from, (to - from).normalized());
+
+            Hitpoint expected;
+            int expectedID = bruteForceIsect(triangles, ray, &expected);
+
+            Hitpoint actual;
+            int actualID = accel.intersect(ray, &actual);
+            EXPECT_EQ(expectedID != -1, actualID != -1) << "  from: " << from.toString() << std::endl;
+            if (expectedID != -1 && actualID != -1) {
+                EXPECT_NEAR(expected.distance(), actual.distance(), 1.0e-6);
+                EXPECT_EQ_VEC(expected.position(), actual.position(), 1.0e-6);
+            }
+        }
+    }
+
+    std::vector<Triangle> loadBunny() {
+        Trimesh trimesh(ASSET_DIRECTORY + "bunny.ply");
+        trimesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+        return trimesh.triangulate();
+    }
+
+    // Bunny with long slivers crossing its bounding box
+    std::vector<Triangle> loadBunnyWithSlivers() {
+        std::vector<Triangle> triangles = loadBunny();
+        Random rng(1);
+        for (int i = 0; i < 200; i++) {
+            const Vector3D p0 = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+            const Vector3D p1 = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+            triangles.push_back(Triangle(p0, p1, p1 + Vector3D(0.01, 0.01, 0.0)));
+        }
+        return triangles;
+    }
+
+}
+
+// ------------------------------
+// QBVHAccel class test
+// ------------------------------
+TEST(QBVHAccelTest, MedianSplitIntersection) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_MEDIAN_SPLIT);
+    checkRandomRays(triangles, accel, 100);
+}
+
+TEST(QBVHAccelTest, SAHIntersection) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    checkRandomRays(triangles, accel, 100);
+
+    QBVHAccel median;
+    median.construct(triangles, ACCEL_BUILD_MEDIAN_SPLIT);
+    EXPECT_LT(accel.sahCost(), median.sahCost());
+}
+
+TEST(QBVHAccelTest, LBVHIntersection) {
+    // The bunny is sorted with 63-bit codes and its part with 30-bit codes
+    std::vector<Triangle> triangles = loadBunny();
+    std::vector<Triangle> part(triangles.begin(), triangles.begin() + 10000);
+
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_LBVH);
+    checkRandomRays(triangles, accel, 100);
+
+    QBVHAccel partAccel;
+    partAccel.construct(part, ACCEL_BUILD_LBVH);
+    checkRandomRays(part, partAccel, 100);
+
+    QBVHAccel median;
+    median.construct(triangles, ACCEL_BUILD_MEDIAN_SPLIT);
+    EXPECT_LT(accel.sahCost(), median.sahCost());
+}
+
+TEST(QBVHAccelTest, SBVHIntersection) {
+    std::vector<Triangle> triangles = loadBunnyWithSlivers();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SBVH);
+    checkRandomRays(triangles, accel, 100);
+
+    // Spatial splits reduce the overlap of the sliver boxes
+    QBVHAccel sah;
+    sah.construct(triangles, ACCEL_BUILD_SAH);
+    EXPECT_LT(accel.sahCost(), sah.sahCost());
+}
+
+TEST(QBVHAccelTest, SecondaryRays) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    // Rays spawned on the surface must not hit the triangle they start from
+    Random rng(0);
+    for (int i = 0; i < 200; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        Hitpoint hitpoint;
+        if (accel.intersect(Ray(from, (to - from).normalized()), &hitpoint) < 0) continue;
+
+        Vector3D dir = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D normal = hitpoint.normal();
+        if (Vector3D::dot(normal, from - hitpoint.position()) < 0.0) normal = -normal;
+        if (Vector3D::dot(normal, dir) < 0.0) dir = -dir;
+        Ray ray = hitpoint.spawnRay(dir.normalized());
+
+        Hitpoint expected;
+        int expectedID = bruteForceIsect(triangles, ray, &expected);
+
+        Hitpoint actual;
+        int actualID = accel.intersect(ray, &actual);
+        EXPECT_EQ(expectedID, actualID);
+        if (expectedID != -1 && actualID != -1) {
+            EXPECT_NEAR(expected.distance(), actual.distance(), 1.0e-6);
+        }
+    }
+}
+
+TEST(QBVHAccelTest, Watertight) {
+    // Rays aimed at the shared vertices of a tessellated plane must not pass through it
+    static const int gridSize = 32;
+    const double spacing = 1.0 / 3.0;
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < gridSize; i++) {
+        for (int j = 0; j < gridSize; j++) {
+            const Vector3D p00(i * spacing, 0.1, j * spacing);
+            const Vector3D p01((i + 1) * spacing, 0.1, j * spacing);
+            const Vector3D p10(i * spacing, 0.1, (j + 1) * spacing);
+            const Vector3D p11((i + 1) * spacing, 0.1, (j + 1) * spacing);
+            triangles.push_back(Triangle(p00, p11, p01));
+            triangles.push_back(Triangle(p00, p10, p11));
+        }
+    }
+
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    Random rng(0);
+    for (int i = 1; i < gridSize; i++) {
+        for (int j = 1; j < gridSize; j++) {
+            const Vector3D target(i * spacing, 0.1, j * spacing);
+            const Vector3D from = target + Vector3D(rng.nextReal() * 2.0 - 1.0, rng.nextReal() + 0.01, rng.nextReal() * 2.0 - 1.0) * 10.0;
+            Hitpoint hitpoint;
+            EXPECT_NE(-1, accel.intersect(Ray(from, (target - from).normalized()), &hitpoint));
+        }
+    }
+}
+
+TEST(QBVHAccelTest, Occlusion) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    Random rng(0);
+    for (int i = 0; i < 100; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Ray ray(from, (to - from).normalized());
+        const double tMax = (to - from).norm();
+
+        Hitpoint expected;
+        int expectedID = bruteForceIsect(triangles, ray, &expected);
+        if (expectedID != -1 && std::abs(expected.distance() - tMax) < 1.0e-4) continue;
+
+        EXPECT_EQ(expectedID != -1 && expected.distance() < tMax, accel.occluded(ray, tMax));
+        EXPECT_EQ(expectedID != -1, accel.occluded(ray));
+    }
+}
+
+TEST(QBVHAccelTest, PacketIntersection) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    Random rng(0);
+    for (int i = 0; i < 50; i++) {
+        // Rays from a common origin to nearby points, and a partial packet
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        RayPacket packet;
+        const int size = (i % 2 == 0) ? RayPacket::maxSize : 3;
+        for (int k = 0; k < size; k++) {
+            Vector3D offset = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.2 - Vector3D(0.1, 0.1, 0.1);
+            packet.add(Ray(from, (to + offset - from).normalized()));
+        }
+
+        const int hitMask = accel.intersect(packet);
+        for (int k = 0; k < size; k++) {
+            Hitpoint expected;
+            int expectedID = accel.intersect(packet.ray(k), &expected);
+            EXPECT_EQ(expectedID, packet.intersection(k).objectID());
+            EXPECT_EQ(expectedID != -1, (hitMask & (1 << k)) != 0);
+            EXPECT_EQ(expected.distance(), packet.intersection(k).hittingDistance());
+        }
+    }
+}
+
+TEST(QBVHAccelTest, DeepTree) {
+    // Collinear triangles have empty boxes, so every SAH split among them
+    // costs nothing and the first bin is split off. Their centers approach
+    // x = 3 geometrically, so the first bin holds a single triangle and a
+    // node is nested for every two of them. The bunny is split off first.
+    std::vector<Triangle> triangles = loadBunny();
+    double gap = 1.0;
+    for (int i = 0; i < 256; i++) {
+        const Vector3D center(3.0 - gap, 5.0, 5.0);
+        const Vector3D half(gap * 0.01, 0.0, 0.0);
+        triangles.push_back(Triangle(center - half, center + half, center));
+        gap *= 0.93;
+    }
+
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    EXPECT_GT(accel.stackSize(), QBVHAccel::maxStackSize());
+    checkRandomRays(triangles, accel, 100);
+
+    // Packets use the heap stack as well
+    Random rng(0);
+    for (int i = 0; i < 20; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        RayPacket packet;
+        for (int k = 0; k < RayPacket::maxSize; k++) {
+            Vector3D offset = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.2 - Vector3D(0.1, 0.1, 0.1);
+            packet.add(Ray(from, (to + offset - from).normalized()));
+        }
+
+        accel.intersect(packet);
+        for (int k = 0; k < RayPacket::maxSize; k++) {
+            Hitpoint expected;
+            int expectedID = bruteForceIsect(triangles, packet.ray(k), &expected);
+            EXPECT_EQ(expectedID != -1, packet.intersection(k).objectID() != -1);
+            if (expectedID != -1) {
+                EXPECT_NEAR(expected.distance(), packet.intersection(k).hittingDistance(), 1.0e-6);
+            }
+        }
+    }
+}
+
+TEST(QBVHAccelTest, ParallelBuild) {
+    // Trees do not depend on how the parallel loops split their ranges
+    std::vector<Triangle> triangles = loadBunny();
+    const AccelBuildType buildTypes[] = { ACCEL_BUILD_SAH, ACCEL_BUILD_LBVH };
+    for (int b = 0; b < 2; b++) {
+        parallel::setNumChunks(1);
+        QBVHAccel serial;
+        serial.construct(triangles, buildTypes[b]);
+
+        parallel::setNumChunks(7);
+        QBVHAccel parallel;
+        parallel.construct(triangles, buildTypes[b]);
+        parallel::setNumChunks(0);
+
+        EXPECT_EQ(serial.numNodes(), parallel.numNodes());
+        EXPECT_EQ(serial.sahCost(), parallel.sahCost());
+
+        Random rng(0);
+        for (int i = 0; i < 100; i++) {
+            Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+            Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+            Ray ray(from, (to - from).normalized());
+
+            Hitpoint hp1, hp2;
+            EXPECT_EQ(serial.intersect(ray, &hp1), parallel.intersect(ray, &hp2));
+            EXPECT_EQ(hp1.distance(), hp2.distance());
+        }
+    }
+}
+
+TEST(QBVHAccelTest, Refit) {
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    const double buildCost = accel.sahCost();
+
+    // Refit without motion keeps the tree as it is
+    EXPECT_FALSE(accel.refit(triangles));
+    EXPECT_EQ(buildCost, accel.sahCost());
+
+    // Rigid motion keeps the topology valid
+    const Transform motion = Transform::translate(Vector3D(0.1, 0.0, 0.0)) * Transform::rotate(Vector3D(0.0, 1.0, 0.0), 0.05);
+    std::vector<Triangle> moved(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        moved[i] = motion.applyToTriangle(triangles[i]);
+    }
+    EXPECT_FALSE(accel.refit(moved));
+    checkRandomRays(moved, accel, 100);
+
+    // Triangles shuffled among each other make the tree costly and force a rebuild
+    std::vector<Triangle> shuffled(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        shuffled[i] = triangles[(i * 7919) % triangles.size()];
+    }
+    EXPECT_TRUE(accel.refit(shuffled));
+    EXPECT_NEAR(buildCost, accel.sahCost(), buildCost * 0.1);
+    checkRandomRays(shuffled, accel, 100);
+}
+
+TEST(QBVHAccelTest, Cache) {
+    std::vector<Triangle> triangles = loadBunny();
+    std::vector<QBVHAccel> accels(2);
+    const std::string directory = CACHE_DIRECTORY + "qbvh_test/";
+    std::remove(accel::cacheFilename(accels[0], triangles, ACCEL_BUILD_SAH, directory).c_str());
+    std::remove(directory.c_str());
+
+    // The tree is constructed and cached first (creating the directory), and then mapped from the cache
+    EXPECT_FALSE(accel::constructCached(&accels[0], triangles, ACCEL_BUILD_SAH, directory));
+    EXPECT_TRUE(accel::constructCached(&accels[1], triangles, ACCEL_BUILD_SAH, directory));
+    EXPECT_EQ(accels[0].numNodes(), accels[1].numNodes());
+    EXPECT_EQ(accels[0].sahCost(), accels[1].sahCost());
+    checkRandomRays(triangles, accels[1], 100);
+
+    // The cache is stale for the other build type and the moved triangles
+    const std::string filename = accel::cacheFilename(accels[0], triangles, ACCEL_BUILD_SAH, directory);
+    QBVHAccel stale;
+    EXPECT_FALSE(stale.load(filename, triangles, ACCEL_BUILD_MEDIAN_SPLIT));
+    triangles[0] = Triangle(triangles[0].p(1), triangles[0].p(2), triangles[0].p(0));
+    EXPECT_FALSE(stale.load(filename, triangles, ACCEL_BUILD_SAH));
+    EXPECT_EQ(0, stale.numNodes());
+
+    std::remove(filename.c_str());
+    std::remove(directory.c_str());
+}
+
+// ------------------------------
+// OBVHAccel class test
+// ------------------------------
+TEST(OBVHAccelTest, SAHIntersection) {
+    if (!OBVHAccel::isSupported()) return;
+
+    std::vector<Triangle> triangles = loadBunny();
+    OBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    checkRandomRays(triangles, accel, 100);
+    EXPECT_GT(accel.numNodes(), 0);
+}
+
+TEST(OBVHAccelTest, SBVHIntersection) {
+    if (!OBVHAccel::isSupported()) return;
+
+    // Both parts of a split triangle may be collapsed into a leaf
+    std::vector<Triangle> triangles = loadBunnyWithSlivers();
+    OBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SBVH);
+    checkRandomRays(triangles, accel, 100);
+}
+
+TEST(OBVHAccelTest, Refit) {
+    if (!OBVHAccel::isSupported()) return;
+
+    std::vector<Triangle> triangles = loadBunny();
+    OBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    const double buildCost = accel.sahCost();
+    EXPECT_FALSE(accel.refit(triangles));
+    EXPECT_EQ(buildCost, accel.sahCost());
+
+    const Transform motion = Transform::translate(Vector3D(0.0, 0.1, 0.0)) * Transform::scale(1.0, 1.1, 1.0);
+    std::vector<Triangle> moved(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        moved[i] = motion.applyToTriangle(triangles[i]);
+    }
+    EXPECT_FALSE(accel.refit(moved));
+    checkRandomRays(moved, accel, 100);
+}
+
+TEST(OBVHAccelTest, SameAsQBVH) {
+    if (!OBVHAccel::isSupported()) return;
+
+    std::vector<Triangle> triangles = loadBunny();
+    QBVHAccel qbvh;
+    qbvh.construct(triangles, ACCEL_BUILD_SAH);
+    OBVHAccel obvh;
+    obvh.construct(triangles, ACCEL_BUILD_SAH);
+
+    Random rng(0);
+    for (int i = 0; i < 200; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        Ray ray(from, (to - from).normalized());
+
+        Hitpoint hp1, hp2;
+        const int id1 = qbvh.intersect(ray, &hp1);
+        const int id2 = obvh.intersect(ray, &hp2);
+        EXPECT_EQ(id1, id2);
+        EXPECT_EQ(hp1.distance(), hp2.distance());
+        EXPECT_EQ(qbvh.occluded(ray), obvh.occluded(ray));
+        if (id1 < 0) continue;
+
+        // Secondary ray from the surface
+        Vector3D dir = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Ray secondary(hp1.position(), dir.normalized());
+        Hitpoint hp3, hp4;
+        EXPECT_EQ(qbvh.intersect(secondary, &hp3), obvh.intersect(secondary, &hp4));
+        EXPECT_EQ(hp3.distance(), hp4.distance());
+    }
+
+    for (int i = 0; i < 50; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 2.0 - Vector3D(1.0, 1.0, 1.0);
+        Vector3D to   = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        RayPacket packet1, packet2;
+        for (int k = 0; k < RayPacket::maxSize; k++) {
+            Vector3D offset = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.2 - Vector3D(0.1, 0.1, 0.1);
+            packet1.add(Ray(from, (to + offset - from).normalized()));
+            packet2.add(packet1.ray(k));
+        }
+
+        EXPECT_EQ(qbvh.intersect(packet1), obvh.intersect(packet2));
+        for (int k = 0; k < RayPacket::maxSize; k++) {
+            EXPECT_EQ(packet1.intersection(k).objectID(), packet2.intersection(k).objectID());
+            EXPECT_EQ(packet1.intersection(k).hittingDistance(), packet2.intersection(k).hittingDistance());
+        }
+    }
+}
+
+// ------------------------------
+// InstanceAccel class test
+// ------------------------------
+// ------------------------------
+// CompressedQBVHAccel class test
+// ------------------------------
+
+TEST(CompressedQBVHAccelTest, SAHIntersection) {
+    std::vector<Triangle> triangles = loadBunny();
+    CompressedQBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+    checkRandomRays(triangles, accel, 100);
+
+    // Quantized boxes are slightly larger than the original ones
+    QBVHAccel qbvh;
+    qbvh.construct(triangles, ACCEL_BUILD_SAH);
+    EXPECT_EQ(qbvh.numNodes(), accel.numNodes());
+    EXPECT_GE(accel.sahCost(), qbvh.sahCost());
+    EXPECT_LT(accel.sahCost(), qbvh.sahCost() * 1.2);
+    EXPECT_EQ(qbvh.nodeMemoryUsage(), accel.nodeMemoryUsage() * 2);
+}
+
+TEST(CompressedQBVHAccelTest, Refit) {
+    std::vector<Triangle> triangles = loadBunny();
+    CompressedQBVHAccel accel;
+    accel.construct(triangles, ACCEL_BUILD_SAH);
+
+    const Transform motion = Transform::translate(Vector3D(0.1, 0.0, 0.0)) * Transform::rotate(Vector3D(0.0, 1.0, 0.0), 0.05);
+    std::vector<Triangle> moved(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        moved[i] = motion.applyToTriangle(triangles[i]);
+    }
+    EXPECT_FALSE(accel.refit(moved));
+    checkRandomRays(moved, accel, 100);
+}
+
+TEST(InstanceAccelTest, SameAsFlattened) {
+    Trimesh mesh(ASSET_DIRECTORY + "bunny.ply");
+    mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+    mesh.buildAccel();
+    const std::vector<Triangle> triangles = mesh.triangulate();
+    const int numFaces = (int)triangles.size();
+
+    Transform transforms[3] = {
+        Transform(),
+        Transform::translate(Vector3D(2.0, 0.0, 0.0)) * Transform::rotate(Vector3D(0.0, 1.0, 0.0), 0.5) * Transform::scale(0.5, 0.5, 0.5),
+        Transform::translate(Vector3D(-2.0, 0.0, 0.0)) * Transform::scale(1.0, 2.0, 1.0)
+    };
+
+    BBox box;
+    for (int i = 0; i < numFaces; i++) {
+        box.merge(triangles[i]);
+    }
+
+    std::vector<Instance> instances;
+    std::vector<Triangle> flattened;
+    for (int k = 0; k < 3; k++) {
+        Instance instance;
+        instance.accel = mesh.accel();
+        instance.transform = transforms[k];
+        instance.objectBox = box;
+        instance.idOffset = k * numFaces;
+        instances.push_back(instance);
+        for (int i = 0; i < numFaces; i++) {
+            flattened.push_back(transforms[k].applyToTriangle(triangles[i]));
+        }
+    }
+
+    InstanceAccel accel;
+    accel.construct(instances);
+    QBVHAccel flat;
+    flat.construct(flattened, ACCEL_BUILD_SAH);
+
+    Random rng(0);
+    for (int i = 0; i < 200; i++) {
+        Vector3D from = Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 8.0 - Vector3D(4.0, 4.0, 4.0);
+        Vector3D to   = Vector3D(rng.nextReal() * 4.0 - 2.0, 0.0, 0.0) + Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.5 - Vector3D(0.25, 0.25, 0.25);
+        Ray ray(from, (to - from).normalized());
+
+        Hitpoint expected, actual;
+        const int expectedID = flat.intersect(ray, &expected);
+        const int actualID = accel.intersect(ray, &actual);
+        EXPECT_EQ(expectedID, actualID);
+        EXPECT_EQ(expectedID != -1, accel.occluded(ray));
+        if (expectedID != -1 && actualID != -1) {
+            EXPECT_NEAR(expected.distance(), actual.distance(), 1.0e-6);
+            EXPECT_EQ_VEC(expected.position(), actual.position(), 1.0e-6);
+            EXPECT_NEAR(1.0, std::abs(Vector3D::dot(expected.normal(), actual.normal())), 1.0e-6);
+        }
+    }
+}
+
+TEST(InstanceAccelTest, SceneInstances) {
+    Trimesh mesh(ASSET_DIRECTORY + "bunny.ply");
+    mesh.fitToBBox(BBox(-1.0, -1.0, -1.0, 1.0, 1.0, 1.0));
+    mesh.buildAccel();
+
+    Scene scene;
+    scene.add(Triangle(Vector3D(-10.0, -1.0, -10.0), Vector3D(10.0, -1.0, 10.0), Vector3D(10.0, -1.0, -10.0)), LambertianBRDF::factory(Vector3D(0.5, 0.5, 0.5)));
+    scene.addInstance(mesh, Transform::translate(Vector3D(-1.5, 0.0, 0.0)), LambertianBRDF::factory(Vector3D(0.75, 0.75, 0.75)));
+    scene.addInstance(mesh, Transform::translate(Vector3D(1.5, 0.0, 0.0)), SpecularBRDF::factory(Vector3D(0.9, 0.9, 0.9)));
+    scene.setAccelerator();
+    EXPECT_EQ(1 + 2 * mesh.numFaces(), scene.numTriangles());
+
+    // Rays toward the right bunny hit the specular instance
+    Random rng(0);
+    int numHits = 0;
+    for (int i = 0; i < 50; i++) {
+        Vector3D to = Vector3D(1.5, 0.0, 0.0) + Vector3D(rng.nextReal(), rng.nextReal(), rng.nextReal()) * 0.2 - Vector3D(0.1, 0.1, 0.1);
+        Vector3D from(1.5, 0.0, 5.0);
+        Ray ray(from, (to - from).normalized());
+
+        Intersection isect;
+        if (!scene.intersect(ray, isect)) continue;
+        numHits++;
+
+        const int id = isect.objectID();
+        EXPECT_GT(id, static_cast<int>(mesh.numFaces()));
+        EXPECT_EQ(BSDF_TYPE_SPECULAR_BRDF, scene.getBsdf(id).type());
+
+        Hitpoint hitpoint;
+        EXPECT_TRUE(scene.getTriangle(id).intersect(ray, &hitpoint));
+        EXPECT_NEAR(isect.hittingDistance(), hitpoint.distance(), 1.0e-6);
+    }
+    EXPECT_GT(numHits, 0);
+}